@@ -0,0 +1,36 @@
+#!/bin/sh
+# Measures the change notifications that clients of the bridge get while it
+# is kept busy: BENCH_COUNT synthetic inhibitors (default: 20000) are taken
+# and released, replayed at each speed in BENCH_SPEEDS (default: "1 10 0",
+# where 0 is as fast as possible), against the null lock backend answering
+# after BENCH_LATENCY_USEC (default: 1000), as logind would.
+#
+# Usage: scripts/bench-notify.sh BUILDDIR...
+#
+# For every run, the replay's "inhibit" line tells how long calls waited for
+# their lock, its "notify" line how long changes waited for their broadcast,
+# and the bridge's counters how many changes were folded into how many
+# broadcasts (without coalescing, there would be one each).
+#
+# Needs dbus-run-session (from dbus) and busctl.
+
+set -eu
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+count=${BENCH_COUNT:-20000}
+speeds=${BENCH_SPEEDS:-1 10 0}
+latency=${BENCH_LATENCY_USEC:-1000}
+
+if [ $# -lt 1 ]; then
+  echo "usage: $0 BUILDDIR..." >&2
+  exit 1
+fi
+
+for dir in "$@"; do
+  for speed in $speeds; do
+    echo "== $dir: speed=$speed"
+    WORKLOAD_STATS=1 "$src/scripts/run-workload.sh" "$dir" \
+      --backend-latency="$latency" -- \
+      --generate="$count" --speed="$speed"
+  done
+done
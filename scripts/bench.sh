@@ -0,0 +1,36 @@
+#!/bin/sh
+# Measures how long the bridge takes to acquire logind locks for a burst of
+# new clients: BENCH_COUNT clients (default: 1000) call Inhibit once each, all
+# at the same time, and most of them UnInhibit right after. The locks come
+# from the null backend, once for each latency in BENCH_LATENCIES (in
+# microseconds; default: "0 1000 10000").
+#
+# Usage: scripts/bench.sh BUILDDIR...
+#
+# Locks are acquired pipelined, so elapsed_usec should barely move with the
+# latency. A serial loop needs at least BENCH_COUNT times the latency, which
+# is printed alongside for comparison.
+#
+# Needs dbus-run-session (from dbus) and busctl.
+
+set -eu
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+count=${BENCH_COUNT:-1000}
+latencies=${BENCH_LATENCIES:-0 1000 10000}
+
+if [ $# -lt 1 ]; then
+  echo "usage: $0 BUILDDIR..." >&2
+  exit 1
+fi
+
+# One connection per client
+ulimit -n "$(ulimit -H -n)" 2>/dev/null || :
+
+for dir in "$@"; do
+  for latency in $latencies; do
+    echo "== $dir: latency_usec=$latency (serial: >= $((count * latency)) usec)"
+    "$src/scripts/run-workload.sh" "$dir" --backend-latency="$latency" -- \
+      --generate="$count" --peers="$count" --speed=0
+  done
+done
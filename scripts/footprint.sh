@@ -0,0 +1,102 @@
+#!/bin/sh
+# Checks that the bridge gives its memory back after a burst: FOOTPRINT_COUNT
+# synthetic inhibitors (default: 100000) are sent from FOOTPRINT_PEERS clients
+# (default: 1000), with the null lock backend, and then every client leaves.
+# Once the bridge has been quiet long enough to compact its state (30
+# seconds), it must be back within FOOTPRINT_MAX_GROWTH_KIB (default: 4096)
+# of the RSS it started with, and its peers table within
+# FOOTPRINT_MAX_BUCKETS buckets (default: 16, the size of an empty one).
+#
+# Usage: scripts/footprint.sh BUILDDIR
+#
+# Needs dbus-run-session (from dbus) and busctl.
+
+set -eu
+
+if [ $# -ne 1 ]; then
+  echo "usage: $0 BUILDDIR" >&2
+  exit 1
+fi
+
+# One connection per client
+ulimit -n "$(ulimit -H -n)" 2>/dev/null || :
+
+log=$(mktemp)
+trap 'rm -f "$log"' EXIT
+
+dbus-run-session -- sh -eu -c '
+  export DBUS_SYSTEM_BUS_ADDRESS="$DBUS_SESSION_BUS_ADDRESS"
+  dir=$1
+  log=$2
+  count=${FOOTPRINT_COUNT:-100000}
+  peers=${FOOTPRINT_PEERS:-1000}
+  max_growth=${FOOTPRINT_MAX_GROWTH_KIB:-4096}
+  max_buckets=${FOOTPRINT_MAX_BUCKETS:-16}
+
+  "$dir/src/sd-inhibit-bridge" --backend=null --no-journal 2>"$log" &
+  bridge=$!
+
+  i=0
+  until busctl --user status org.freedesktop.ScreenSaver >/dev/null 2>&1; do
+    i=$((i + 1))
+    if [ $i -gt 100 ]; then
+      echo "bridge did not come up" >&2
+      kill $bridge
+      exit 1
+    fi
+    sleep 0.1
+  done
+
+  status() {
+    sed -n "s/^$1:[[:space:]]*\([0-9]*\) kB$/\1/p" /proc/$bridge/status
+  }
+
+  # From the last "compacted state" entry in the log
+  compacted() {
+    grep "^<[0-9]>  $1=" "$log" | tail -n 1 | cut -d= -f2
+  }
+
+  start=$(status VmRSS)
+  compactions=$(grep -c "compacted state" "$log" || :)
+
+  "$dir/src/sd-inhibit-bridge-replay" \
+    --generate="$count" --peers="$peers" --speed=0 >/dev/null
+  peak=$(status VmHWM)
+
+  # The compaction timer waits for a quiet 30 seconds, and may have been
+  # armed during the burst
+  i=0
+  until [ "$(grep -c "compacted state" "$log" || :)" -gt "$compactions" ]; do
+    i=$((i + 1))
+    if [ $i -gt 120 ]; then
+      echo "bridge did not compact its state" >&2
+      kill $bridge
+      exit 1
+    fi
+    sleep 1
+  done
+
+  rss=$(compacted rss_after_kib)
+  left=$(compacted peers)
+  buckets=$(compacted peer_buckets)
+  kill -TERM $bridge
+  wait $bridge
+
+  echo "rss_kib: start=$start peak=$peak compacted=$rss"
+  echo "peers=$left peer_buckets=$buckets"
+
+  ok=true
+  if [ "$left" -ne 0 ]; then
+    echo "FAIL: $left peers left after every client is gone" >&2
+    ok=false
+  fi
+  if [ "$rss" -gt $((start + max_growth)) ]; then
+    echo "FAIL: RSS grew by $((rss - start)) KiB (limit: $max_growth)" >&2
+    ok=false
+  fi
+  if [ "$buckets" -gt "$max_buckets" ]; then
+    echo "FAIL: $buckets peer buckets (limit: $max_buckets)" >&2
+    ok=false
+  fi
+  $ok
+' sh "$1" "$log"
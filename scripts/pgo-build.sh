@@ -0,0 +1,86 @@
+#!/bin/sh
+# Builds sd-inhibit-bridge with LTO and profile-guided optimization:
+#
+#   1. an instrumented build is trained on a synthetic Inhibit/UnInhibit
+#      workload (sd-inhibit-bridge-replay --generate), served with the null
+#      lock backend on a private bus, so neither logind nor the session is
+#      involved;
+#   2. it is rebuilt with the profile, and benchmarked against a plain
+#      release build on the same workload.
+#
+# Usage: scripts/pgo-build.sh [BUILDDIR] [MESON_SETUP_ARGS...]
+#
+# The optimized build ends up in BUILDDIR/pgo (default: build-pgo/pgo) and
+# installs like any other: meson install -C build-pgo/pgo
+#
+# Needs dbus-run-session (from dbus) and busctl. TRAINING_COUNT and
+# BENCHMARK_COUNT set the size of the workloads; REPLAY_SPEED how fast they
+# are sent.
+
+set -eu
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+out=${1:-build-pgo}
+[ $# -gt 0 ] && shift
+
+training_count=${TRAINING_COUNT:-50000}
+benchmark_count=${BENCHMARK_COUNT:-50000}
+speed=${REPLAY_SPEED:-10}
+
+for tool in meson dbus-run-session busctl; do
+  if ! command -v "$tool" >/dev/null; then
+    echo "$tool is required" >&2
+    exit 1
+  fi
+done
+
+# Replays $2 synthetic inhibitors against the bridge from build directory $1
+run_workload() {
+  "$src/scripts/run-workload.sh" "$1" -- --generate="$2" --speed="$speed"
+}
+
+setup() {
+  dir=$1
+  shift
+  if [ -d "$dir/meson-private" ]; then
+    meson setup --reconfigure "$dir" "$src" "$@" >/dev/null
+  else
+    meson setup "$dir" "$src" "$@" >/dev/null
+  fi
+}
+
+echo "== plain release build"
+setup "$out/baseline" -Dbuildtype=release "$@"
+meson compile -C "$out/baseline" >/dev/null
+
+echo "== instrumented build"
+setup "$out/pgo" -Dbuildtype=release -Db_lto=true -Db_pgo=generate "$@"
+find "$out/pgo" \( -name '*.gcda' -o -name '*.profraw' \) -delete
+meson compile -C "$out/pgo" >/dev/null
+
+echo "== training"
+# clang writes raw profiles that have to be merged by hand; gcc's .gcda
+# files land next to the objects on their own
+if meson introspect --compilers "$out/pgo" | grep -q '"id": *"clang"'; then
+  clang=true
+else
+  clang=false
+fi
+if $clang; then
+  LLVM_PROFILE_FILE="$(cd "$out/pgo" && pwd)/%p.profraw"
+  export LLVM_PROFILE_FILE
+fi
+run_workload "$out/pgo" "$training_count" >/dev/null
+if $clang; then
+  llvm-profdata merge -o "$out/pgo/default.profdata" "$out"/pgo/*.profraw
+  unset LLVM_PROFILE_FILE
+fi
+
+echo "== optimized build"
+meson configure "$out/pgo" -Db_pgo=use
+meson compile -C "$out/pgo" >/dev/null
+
+echo "== benchmark: plain release"
+run_workload "$out/baseline" "$benchmark_count"
+echo "== benchmark: LTO + PGO"
+run_workload "$out/pgo" "$benchmark_count"
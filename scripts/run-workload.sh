@@ -0,0 +1,67 @@
+#!/bin/sh
+# Runs the bridge from a build directory with the null lock backend on a
+# private bus, and plays sd-inhibit-bridge-replay against it:
+#
+#   scripts/run-workload.sh BUILDDIR [BRIDGE_ARGS...] -- REPLAY_ARGS...
+#
+# The bridge connects to that same bus as its system bus; nothing answers for
+# logind there, which the null backend doesn't need. It is stopped cleanly
+# once the replay is done (PGO profiles are only written out then).
+#
+# With WORKLOAD_STATS=1, the bridge's change notification counters are
+# printed after the replay's report.
+#
+# Needs dbus-run-session (from dbus) and busctl.
+
+set -eu
+
+if [ $# -lt 1 ]; then
+  echo "usage: $0 BUILDDIR [BRIDGE_ARGS...] -- REPLAY_ARGS..." >&2
+  exit 1
+fi
+
+dbus-run-session -- sh -eu -c '
+  export DBUS_SYSTEM_BUS_ADDRESS="$DBUS_SESSION_BUS_ADDRESS"
+  dir=$1
+  shift
+
+  bridge_args=
+  while [ $# -gt 0 ] && [ "$1" != -- ]; do
+    bridge_args="$bridge_args $1"
+    shift
+  done
+  [ $# -gt 0 ] && shift
+
+  "$dir/src/sd-inhibit-bridge" \
+    --backend=null \
+    --no-journal \
+    --frontend=power-management \
+    --frontend=gnome-session \
+    $bridge_args \
+    2>/dev/null &
+  bridge=$!
+
+  i=0
+  until busctl --user status org.freedesktop.ScreenSaver >/dev/null 2>&1; do
+    i=$((i + 1))
+    if [ $i -gt 100 ]; then
+      echo "bridge did not come up" >&2
+      kill $bridge
+      exit 1
+    fi
+    sleep 0.1
+  done
+
+  "$dir/src/sd-inhibit-bridge-replay" "$@"
+
+  if [ "${WORKLOAD_STATS:-0}" = 1 ]; then
+    busctl --user get-property org.freedesktop.ScreenSaver \
+      /io/github/notpeelz/SdInhibitBridge1 \
+      io.github.notpeelz.SdInhibitBridge1 NotifyChanges NotifyFlushes \
+      | { read -r _ changes; read -r _ flushes
+          echo "bridge: changes=$changes broadcasts=$flushes"; }
+  fi
+
+  kill -TERM $bridge
+  wait $bridge
+' sh "$@"
@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "capture.h"
+#include "htable.h"
+
+// A capture is a header followed by records, each a fixed part and then
+// the app_name and reason strings (unterminated). Integers are in host byte
+// order: captures are meant to be replayed on the machine they were taken
+// on, or one like it.
+
+#define CAPTURE_MAGIC "SDIBCAP"
+#define CAPTURE_VERSION 1
+
+typedef struct capture_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+} capture_header_t;
+static_assert(sizeof(capture_header_t) == 16);
+
+typedef struct capture_disk_record {
+  uint8_t op;
+  uint8_t frontend;
+  uint16_t app_name_len;
+  uint16_t reason_len;
+  uint16_t reserved;
+  uint32_t peer;
+  uint32_t serial;
+  uint32_t cookie;
+  uint32_t flags;
+  uint64_t usec;
+} capture_disk_record_t;
+static_assert(sizeof(capture_disk_record_t) == 32);
+
+struct capture {
+  FILE* f;
+  uint64_t start;
+  // "uid/name" -> peer number + 1
+  htable_t* peers;
+  uint32_t next_peer;
+};
+
+static uint64_t capture_now(void) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+    return 0;
+  }
+
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static uint64_t capture_peers_hash(void const* in) {
+  uint64_t hash = 0xcbf29ce484222325u;
+  for (char const* k = in; *k != '\0'; k++) {
+    hash ^= *k;
+    hash *= 0x100000001b3u;
+  }
+  return hash;
+}
+
+static bool capture_peers_keq(void const* a, void const* b) {
+  return strcmp(a, b) == 0;
+}
+
+static void* capture_peers_kcopy(void* in) {
+  return strdup(in);
+}
+
+static void capture_peers_kfree(void* in) {
+  free(in);
+}
+
+static htable_callbacks_t capture_peers_callbacks = {
+  .kcopy = capture_peers_kcopy,
+  .kfree = capture_peers_kfree,
+};
+
+#define CAPTURE_PEER_KEY_MAX 128
+
+// Unique names are per bus, and in --system mode there's one per user
+static void capture_peer_key(
+  char key[CAPTURE_PEER_KEY_MAX],
+  uint32_t uid,
+  char const* peer
+) {
+  (void)snprintf(key, CAPTURE_PEER_KEY_MAX, "%u/%s", (unsigned)uid, peer);
+}
+
+int capture_open(char const* path, capture_t** ret) {
+  assert(path != nullptr);
+  assert(ret != nullptr);
+
+  _cleanup_(capture_closep)
+  capture_t* c = calloc(1, sizeof(*c));
+  if (c == nullptr) return -ENOMEM;
+
+  c->peers = htable_create(
+    capture_peers_hash,
+    capture_peers_keq,
+    &capture_peers_callbacks
+  );
+  if (c->peers == nullptr) return -ENOMEM;
+
+  c->f = fopen(path, "we");
+  if (c->f == nullptr) return -errno;
+
+  capture_header_t header = {
+    .magic = CAPTURE_MAGIC,
+    .version = CAPTURE_VERSION,
+  };
+  if (fwrite(&header, sizeof(header), 1, c->f) != 1) {
+    return -EIO;
+  }
+
+  c->start = capture_now();
+  *ret = c;
+  c = nullptr;
+  return 0;
+}
+
+void capture_close(capture_t* c) {
+  if (c == nullptr) return;
+
+  if (c->f != nullptr) {
+    (void)fclose(c->f);
+  }
+  if (c->peers != nullptr) {
+    htable_destroy(c->peers);
+  }
+  free(c);
+}
+
+void capture_forget_peer(capture_t* c, uint32_t uid, char const* peer) {
+  assert(c != nullptr);
+  assert(peer != nullptr);
+
+  char key[CAPTURE_PEER_KEY_MAX];
+  capture_peer_key(key, uid, peer);
+  (void)htable_remove(c->peers, key, nullptr);
+}
+
+int capture_write(
+  capture_t* c,
+  uint32_t uid,
+  char const* peer,
+  capture_record_t* record
+) {
+  assert(c != nullptr);
+  assert(peer != nullptr);
+  assert(record != nullptr);
+
+  char key[CAPTURE_PEER_KEY_MAX];
+  capture_peer_key(key, uid, peer);
+
+  void* value;
+  if (htable_get(c->peers, key, &value)) {
+    record->peer = (uint32_t)((uintptr_t)value - 1);
+  } else {
+    record->peer = c->next_peer;
+    if (!htable_insert(c->peers, key, (void*)(uintptr_t)(c->next_peer + 1))) {
+      return -ENOMEM;
+    }
+    c->next_peer++;
+  }
+
+  record->usec = capture_now() - c->start;
+
+  size_t app_name_len = 0;
+  size_t reason_len = 0;
+  if (record->op == CAPTURE_INHIBIT) {
+    app_name_len = strnlen(record->app_name, UINT16_MAX);
+    reason_len = strnlen(record->reason, UINT16_MAX);
+  }
+
+  capture_disk_record_t disk = {
+    .op = (uint8_t)record->op,
+    .frontend = record->frontend,
+    .app_name_len = (uint16_t)app_name_len,
+    .reason_len = (uint16_t)reason_len,
+    .peer = record->peer,
+    .serial = record->serial,
+    .cookie = record->cookie,
+    .flags = record->flags,
+    .usec = record->usec,
+  };
+  if (
+    fwrite(&disk, sizeof(disk), 1, c->f) != 1
+    || fwrite(record->app_name, 1, app_name_len, c->f) != app_name_len
+    || fwrite(record->reason, 1, reason_len, c->f) != reason_len
+  ) {
+    return -EIO;
+  }
+
+  return 0;
+}
+
+int capture_read(char const* path, capture_read_cb_t cb, void* userdata) {
+  assert(path != nullptr);
+  assert(cb != nullptr);
+
+  int r;
+
+  FILE* f = fopen(path, "re");
+  if (f == nullptr) return -errno;
+
+  capture_header_t header;
+  if (
+    fread(&header, sizeof(header), 1, f) != 1
+    || memcmp(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0
+    || header.version != CAPTURE_VERSION
+  ) {
+    r = -EBADMSG;
+    goto out;
+  }
+
+  char app_name[UINT16_MAX + 1];
+  char reason[UINT16_MAX + 1];
+
+  r = 0;
+  while (true) {
+    // A record cut short is what a crash leaves behind; treat it as the end
+    capture_disk_record_t disk;
+    if (fread(&disk, sizeof(disk), 1, f) != 1) break;
+    if (fread(app_name, 1, disk.app_name_len, f) != disk.app_name_len) break;
+    if (fread(reason, 1, disk.reason_len, f) != disk.reason_len) break;
+    app_name[disk.app_name_len] = '\0';
+    reason[disk.reason_len] = '\0';
+
+    if (disk.op < CAPTURE_INHIBIT || disk.op > CAPTURE_PEER_GONE) {
+      r = -EBADMSG;
+      break;
+    }
+
+    capture_record_t record = {
+      .op = (capture_op_t)disk.op,
+      .usec = disk.usec,
+      .peer = disk.peer,
+      .frontend = disk.frontend,
+      .serial = disk.serial,
+      .cookie = disk.cookie,
+      .app_name = app_name,
+      .reason = reason,
+      .flags = disk.flags,
+    };
+    r = cb(&record, userdata);
+    if (r < 0) break;
+  }
+
+out:
+  (void)fclose(f);
+  return r;
+}
@@ -0,0 +1,67 @@
+#ifndef SDIB_CAPTURE_H
+#define SDIB_CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Traces of client traffic, as written by --capture and fed back to a
+// bridge by sd-inhibit-bridge-replay
+
+typedef struct capture capture_t;
+
+typedef enum capture_op {
+  // An Inhibit call came in
+  CAPTURE_INHIBIT = 1,
+  // The Inhibit call with the given serial was answered with a cookie
+  CAPTURE_INHIBITED,
+  CAPTURE_UNINHIBIT,
+  // The peer left the bus
+  CAPTURE_PEER_GONE,
+} capture_op_t;
+
+typedef struct capture_record {
+  capture_op_t op;
+  // Since the start of the capture
+  uint64_t usec;
+  // Peers are numbered in order of appearance
+  uint32_t peer;
+  // The frontend_t the call came through
+  uint8_t frontend;
+  // D-Bus serial of the Inhibit call (CAPTURE_INHIBIT, CAPTURE_INHIBITED)
+  uint32_t serial;
+  // CAPTURE_INHIBITED, CAPTURE_UNINHIBIT
+  uint32_t cookie;
+  // CAPTURE_INHIBIT; flags are those of org.gnome.SessionManager.Inhibit
+  char const* app_name;
+  char const* reason;
+  uint32_t flags;
+} capture_record_t;
+
+typedef int (*capture_read_cb_t)(
+  capture_record_t const* record,
+  void* userdata
+);
+
+int capture_open(char const* path, capture_t** ret);
+
+// Flushes whatever is still buffered
+void capture_close(capture_t* c);
+DEFINE_POINTER_CLEANUP_FUNC(capture_t, capture_close);
+
+// Fills in the time and peer number of record. A peer keeps its number
+// until it's forgotten. Writes are buffered; a crash loses the last few
+// records.
+int capture_write(
+  capture_t* c,
+  uint32_t uid,
+  char const* peer,
+  capture_record_t* record
+);
+
+// Called once the bridge is done with a peer; if it shows up again, it's
+// numbered as a new one
+void capture_forget_peer(capture_t* c, uint32_t uid, char const* peer);
+
+int capture_read(char const* path, capture_read_cb_t cb, void* userdata);
+
+#endif
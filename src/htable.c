@@ -3,6 +3,7 @@
 #include <assert.h>
 
 #include "htable.h"
+#include "trace.h"
 
 // Inspired by https://nachtimwald.com/2020/03/06/generic-hashtable-in-c/
 // Copyright (c) 2020 John Schember <john@nachtimwald.com>
@@ -111,10 +112,14 @@ void htable_destroy(htable_t* ht) {
   free(ht);
 }
 
-static bool htable_resize(htable_t* ht) {
-  size_t new_capacity = ht->capacity * 2;
+static bool htable_resize(htable_t* ht, size_t new_capacity) {
+  TRACE(htable_resize_entry, ht, ht->count, ht->capacity);
+
   htable_entry_t** new_entries = calloc(new_capacity, sizeof(*new_entries));
-  if (new_entries == nullptr) return false;
+  if (new_entries == nullptr) {
+    TRACE(htable_resize_return, ht, 0);
+    return false;
+  }
 
   for (size_t i = 0; i < ht->capacity; i++) {
     htable_entry_t* entry = ht->entries[i];
@@ -130,27 +135,35 @@ static bool htable_resize(htable_t* ht) {
   free(ht->entries);
   ht->capacity = new_capacity;
   ht->entries = new_entries;
+  TRACE(htable_resize_return, ht, 1);
   return true;
 }
 
-void htable_insert(htable_t* ht, void* k, void* v) {
+bool htable_insert(htable_t* ht, void* k, void* v) {
   assert(ht != nullptr);
   assert(k != nullptr);
 
   auto load_factor = ht->count / (double)ht->capacity;
   if (load_factor > LOAD_FACTOR_THRESHOLD) {
-    if (!htable_resize(ht)) return;
+    // Not fatal: the chains just get longer until a later resize succeeds
+    (void)htable_resize(ht, ht->capacity * 2);
   }
 
   size_t idx = ht->hfunc(k) % ht->capacity;
   htable_entry_t* entry = calloc(1, sizeof(*entry));
-  if (entry == nullptr) return;
+  if (entry == nullptr) return false;
 
   entry->k = ht->callbacks.kcopy(k);
+  if (entry->k == nullptr) {
+    free(entry);
+    return false;
+  }
+
   entry->v = ht->callbacks.vcopy(v);
   entry->next = ht->entries[idx];
   ht->entries[idx] = entry;
   ht->count++;
+  return true;
 }
 
 bool htable_remove(htable_t* ht, void const* k, void** v) {
@@ -191,6 +204,16 @@ bool htable_remove(htable_t* ht, void const* k, void** v) {
   return false;
 }
 
+size_t htable_count(htable_t* ht) {
+  assert(ht != nullptr);
+  return ht->count;
+}
+
+size_t htable_capacity(htable_t* ht) {
+  assert(ht != nullptr);
+  return ht->capacity;
+}
+
 bool htable_get(htable_t* ht, void const* k, void** v) {
   assert(ht != nullptr);
   assert(k != nullptr);
@@ -214,6 +237,22 @@ bool htable_get(htable_t* ht, void const* k, void** v) {
   return false;
 }
 
+void htable_compact(htable_t* ht) {
+  assert(ht != nullptr);
+
+  // Leaves room for the table to grow back to twice its size before the
+  // next resize, so that it doesn't flip-flop around the threshold
+  size_t new_capacity = DEFAULT_CAPACITY;
+  while (ht->count / (double)new_capacity > LOAD_FACTOR_THRESHOLD / 2) {
+    new_capacity *= 2;
+  }
+
+  if (new_capacity >= ht->capacity) return;
+
+  // Not fatal either: the table just stays as big as it was
+  (void)htable_resize(ht, new_capacity);
+}
+
 htable_enum_t* htable_enum_create(htable_t* ht) {
   assert(ht != nullptr);
 
@@ -2,6 +2,7 @@
 #define SDIB_HTABLE_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 typedef struct htable htable_t;
 typedef struct htable_enum htable_enum_t;
@@ -28,10 +29,24 @@ htable_t* htable_create(
 void htable_destroy(htable_t* ht);
 DEFINE_POINTER_CLEANUP_FUNC(htable_t, htable_destroy);
 
-void htable_insert(htable_t* ht, void* k, void* v);
+// Returns false if out of memory (including kcopy returning nullptr), in
+// which case neither k nor v has been taken over. The key must not already
+// be in the table.
+bool htable_insert(htable_t* ht, void* k, void* v);
+// Hands the value over through v if given; otherwise it's freed along with
+// the key.
 bool htable_remove(htable_t* ht, void const* k, void** v);
 bool htable_get(htable_t* ht, void const* k, void** v);
+size_t htable_count(htable_t* ht);
+// Number of buckets
+size_t htable_capacity(htable_t* ht);
 
+// Tables only ever grow on their own; this shrinks the bucket array back
+// down to fit the current number of entries. Must not be called while the
+// table is being enumerated.
+void htable_compact(htable_t* ht);
+
+// The table must not be modified while it's being enumerated.
 htable_enum_t* htable_enum_create(htable_t* ht);
 bool htable_enum_next(htable_enum_t* he, void const** k, void** v);
 void htable_enum_destroy(htable_enum_t* he);
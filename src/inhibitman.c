@@ -1,40 +1,299 @@
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
-#include <unistd.h>
 #include <string.h>
 #include <assert.h>
-#include <fcntl.h>
+#include <time.h>
 #include <errno.h>
-#include <systemd/sd-bus.h>
+#include <stdio.h>
+#include <systemd/sd-daemon.h>
 
 #include "inhibitman.h"
+#include "trace.h"
 
-typedef struct inhibitor {
-  int fd;
+// An inhibitor lock from the backend (logind, normally), shared by every
+// inhibitor of the same peer that asks for the same (what, mode). The lock
+// is attributed to one of them, its owner, and released along with its last
+// inhibitor. When the owner goes away before the others, a new lock is taken
+// on behalf of one that's left and swapped in for the old one.
+typedef struct lock lock_t;
+typedef struct inhibitor inhibitor_t;
+typedef struct inhibitman_batch inhibitman_batch_t;
+struct lock {
+  lock_t* next;
+  lock_t** pprev;
+  unsigned refcount;
+  // Inhibitors sharing the lock, most recent first; the other references
+  // are held by batches
+  inhibitor_t* members;
+  lock_backend_t* backend;
+  // From the backend; -1 while there is none
+  int handle;
+  char const* what;
+  char const* mode;
   char const* who;
   char const* why;
-} inhibitor_t;
+  // Id of the inhibitor who and why come from; 0 while there is none
+  uint32_t owner;
+  // The backend holds the lock under a name other than who and why, since
+  // the owner changed after it was taken
+  bool misattributed;
+  // Pending backend call, if any. It belongs either to a recovery, to a
+  // batch if the lock is being acquired for the first time, or otherwise to
+  // a handover to a new owner.
+  lock_backend_call_t* call;
+  inhibitman_recovery_t* recovery;
+  inhibitman_batch_t* batch;
+  // Other batches with requests sharing in the outcome of batch's call, each
+  // listed once and counting it as one of theirs
+  inhibitman_batch_t** waiters;
+  size_t waiters_length;
+  // Why the last acquisition failed, if it did
+  int error;
+};
+
+struct inhibitor {
+  uint32_t id;
+  // Opaque to us; lets callers keep separate cookie namespaces apart
+  uint32_t tag;
+  lock_t* lock;
+  // Among the lock's members
+  inhibitor_t* lock_next;
+  inhibitor_t** lock_pprev;
+  // Point into strings
+  char const* who;
+  char const* why;
+  char const* app_name;
+  char const* reason;
+  // CLOCK_MONOTONIC, in microseconds
+  uint64_t created;
+  // Armed if the inhibitor has a maximum duration. Same clock as created;
+  // 0 means none.
+  uint64_t deadline;
+  timerwheel_timer_t timer;
+  // All four of them back to back, in a single allocation with the rest
+  char strings[];
+};
 
 typedef struct inhibitor_arr {
   inhibitor_t** items;
   size_t length;
   size_t capacity;
+  // Number of non-null items
+  size_t count;
 } inhibitor_arr_t;
 
 struct inhibitman {
-  sd_bus* system_bus;
+  lock_backend_t* backend;
   inhibitor_arr_t* inhibitors;
+  // There are only ever a handful of distinct (what, mode) pairs per peer
+  lock_t* locks;
+  // Batches still waiting on the backend
+  inhibitman_batch_t* batches;
+  inhibitman_expire_cb_t expire_cb;
+  void* expire_userdata;
+  // Set by inhibitman_destroy() while batches are being finished, since
+  // their callbacks are free to call it
+  bool* destroyed;
+};
+
+struct inhibitman_batch {
+  inhibitman_batch_t* next;
+  inhibitman_batch_t** pprev;
+  inhibitman_t* im;
+  inhibitman_request_t* reqs;
+  // The lock each request is going to share, holding one reference each;
+  // nullptr if the request already failed
+  lock_t** locks;
+  size_t length;
+  // Outstanding backend calls
+  size_t pending;
+  inhibitman_batch_cb_t cb;
+  void* userdata;
+};
+
+struct inhibitman_recovery {
+  unsigned refcount;
+  size_t acquired;
+  size_t failed;
+  bool sealed;
+  inhibitman_recovery_cb_t cb;
+  void* userdata;
 };
 
+static void inhibitman_recovery_complete(inhibitman_recovery_t* rec, bool ok);
+
+#define container_of(ptr, type, member) \
+  ((type*)((char*)(ptr) - offsetof(type, member)))
+
 static size_t const DEFAULT_ARR_CAPACITY = 16;
 
+static uint64_t now_usec() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+    return 0;
+  }
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void lock_cancel_call(lock_t* lock) {
+  if (lock->call == nullptr) return;
+
+  // Its callback won't run
+  lock_backend_cancel(lock->backend, lock->call);
+  lock->call = nullptr;
+  if (lock->recovery != nullptr) {
+    inhibitman_recovery_complete(lock->recovery, false);
+    lock->recovery = nullptr;
+  }
+  // A batch holds references to its locks, so this only happens when the
+  // batch itself is being torn down
+  lock->batch = nullptr;
+}
+
+static void lock_free(lock_t* lock) {
+  lock_backend_release(lock->backend, lock->handle);
+  free(lock->waiters);
+  free((void*)lock->what);
+  free((void*)lock->mode);
+  free((void*)lock->who);
+  free((void*)lock->why);
+  free(lock);
+}
+
+static void lock_unref(lock_t* lock) {
+  assert(lock->refcount > 0);
+
+  lock->refcount--;
+  if (lock->refcount > 0) return;
+
+  lock_cancel_call(lock);
+
+  *lock->pprev = lock->next;
+  if (lock->next != nullptr) {
+    lock->next->pprev = lock->pprev;
+  }
+
+  lock_free(lock);
+}
+
+static void lock_on_handed_over(int r, void* userdata) {
+  auto lock = (lock_t*)userdata;
+
+  lock->call = nullptr;
+
+  if (r < 0) {
+    // The old lock still does its job, just under the wrong name; the next
+    // recovery gets the name right
+    lock->misattributed = true;
+    fprintf(
+      stderr,
+      SD_WARNING "failed to hand over inhibitor lock: %s\n"
+      SD_WARNING "  what=%s\n"
+      SD_WARNING "  mode=%s\n"
+      SD_WARNING "  who=%s\n",
+      strerror(-r),
+      lock->what,
+      lock->mode,
+      lock->who
+    );
+    return;
+  }
+
+  // The new lock is in place before the old one goes, so there's no gap
+  lock_backend_release(lock->backend, lock->handle);
+  lock->handle = r;
+}
+
+// Takes a new lock under the current who and why, to replace the one held
+// under the previous owner's
+static void lock_reattribute(lock_t* lock) {
+  int r;
+
+  if (!lock->misattributed) return;
+
+  // The first acquisition or a recovery is about to replace the handle
+  // anyway; it comes back here once it's done. Locks that are held by
+  // nobody are taken under the right name by the next retry.
+  if (lock->batch != nullptr || lock->recovery != nullptr) return;
+  if (lock->handle < 0 || !lock_backend_healthy(lock->backend)) return;
+
+  // Supersedes an earlier handover
+  lock_cancel_call(lock);
+
+  lock->misattributed = false;
+  r = lock_backend_acquire_async(
+    lock->backend,
+    lock->what,
+    lock->mode,
+    lock->who,
+    lock->why,
+    lock_on_handed_over,
+    lock,
+    &lock->call
+  );
+  if (r < 0) {
+    lock_on_handed_over(r, lock);
+  }
+}
+
+static void lock_set_owner(lock_t* lock, inhibitor_t const* owner) {
+  lock->owner = owner->id;
+
+  // Typically, all the inhibitors of an application look the same
+  if (
+    strcmp(lock->who, owner->who) == 0
+    && strcmp(lock->why, owner->why) == 0
+  ) {
+    return;
+  }
+
+  char* who = strdup(owner->who);
+  char* why = strdup(owner->why);
+  if (who == nullptr || why == nullptr) {
+    free(who);
+    free(why);
+    return;
+  }
+
+  free((void*)lock->who);
+  free((void*)lock->why);
+  lock->who = who;
+  lock->why = why;
+  lock->misattributed = true;
+  lock_reattribute(lock);
+}
+
+// Takes over a reference to the lock
+static void inhibitor_set_lock(inhibitor_t* inhibitor, lock_t* lock) {
+  inhibitor->lock = lock;
+  inhibitor->lock_next = lock->members;
+  inhibitor->lock_pprev = &lock->members;
+  if (lock->members != nullptr) {
+    lock->members->lock_pprev = &inhibitor->lock_next;
+  }
+  lock->members = inhibitor;
+}
+
+static void inhibitor_destroy(inhibitor_t* inhibitor) {
+  timerwheel_cancel(&inhibitor->timer);
+  if (inhibitor->lock != nullptr) {
+    *inhibitor->lock_pprev = inhibitor->lock_next;
+    if (inhibitor->lock_next != nullptr) {
+      inhibitor->lock_next->lock_pprev = inhibitor->lock_pprev;
+    }
+    lock_unref(inhibitor->lock);
+  }
+  free(inhibitor);
+}
+
 static inhibitor_arr_t* inhibitor_arr_create() {
   inhibitor_arr_t* arr = calloc(1, sizeof(*arr));
   if (arr == nullptr) return nullptr;
 
   arr->capacity = DEFAULT_ARR_CAPACITY;
   arr->length = 0;
-  arr->items = calloc(arr->capacity, sizeof(inhibitor_t));
+  arr->items = calloc(arr->capacity, sizeof(*arr->items));
   if (arr->items == nullptr) {
     free(arr);
     return nullptr;
@@ -48,11 +307,7 @@ static void inhibitor_arr_destroy(inhibitor_arr_t* arr) {
 
   for (size_t i = 0; i < arr->length; i++) {
     if (arr->items[i] != nullptr) {
-      inhibitor_t* inhibitor = arr->items[i];
-      (void)close(inhibitor->fd);
-      free((void*)inhibitor->who);
-      free((void*)inhibitor->why);
-      free((void*)inhibitor);
+      inhibitor_destroy(arr->items[i]);
       arr->items[i] = nullptr;
     }
   }
@@ -62,30 +317,74 @@ static void inhibitor_arr_destroy(inhibitor_arr_t* arr) {
 }
 DEFINE_POINTER_CLEANUP_FUNC(inhibitor_arr_t, inhibitor_arr_destroy);
 
-static int inhibitor_arr_add(
-  inhibitor_arr_t* arr,
-  int fd,
+static char const* inhibitor_put_string(char** p, char const* s) {
+  size_t size = strlen(s) + 1;
+  char const* ret = memcpy(*p, s, size);
+  *p += size;
+  return ret;
+}
+
+static inhibitor_t* inhibitor_create(
   char const* who,
   char const* why,
-  size_t* idx
+  char const* app_name,
+  char const* reason
 ) {
-  assert(arr != nullptr);
-  assert(who != nullptr);
-  assert(why != nullptr);
-  assert(arr->length <= arr->capacity);
+  size_t size = sizeof(inhibitor_t)
+    + strlen(who) + 1
+    + strlen(why) + 1
+    + strlen(app_name) + 1
+    + strlen(reason) + 1;
 
-  inhibitor_t* inhibitor = calloc(1, sizeof(*inhibitor));
+  inhibitor_t* inhibitor = calloc(1, size);
   if (inhibitor == nullptr) {
+    return nullptr;
+  }
+
+  char* p = inhibitor->strings;
+  inhibitor->who = inhibitor_put_string(&p, who);
+  inhibitor->why = inhibitor_put_string(&p, why);
+  inhibitor->app_name = inhibitor_put_string(&p, app_name);
+  inhibitor->reason = inhibitor_put_string(&p, reason);
+  inhibitor->created = now_usec();
+
+  return inhibitor;
+}
+
+static int inhibitor_arr_reserve(inhibitor_arr_t* arr, size_t capacity) {
+  if (capacity <= arr->capacity) {
+    return 0;
+  }
+
+  size_t new_capacity = arr->capacity;
+  while (new_capacity < capacity) {
+    new_capacity *= 2;
+  }
+
+  void* new_items = reallocarray(arr->items, new_capacity, sizeof(*arr->items));
+  if (new_items == nullptr) {
     return -ENOMEM;
   }
 
-  inhibitor->fd = fd;
-  inhibitor->who = strdup(who);
-  inhibitor->why = strdup(why);
+  arr->items = new_items;
+  arr->capacity = new_capacity;
+  return 0;
+}
+
+// Takes over the inhibitor, even on failure
+static int inhibitor_arr_add(
+  inhibitor_arr_t* arr,
+  inhibitor_t* inhibitor,
+  size_t* idx
+) {
+  assert(arr != nullptr);
+  assert(inhibitor != nullptr);
+  assert(arr->length <= arr->capacity);
 
   for (size_t i = 0; i < arr->length; i++) {
     if (arr->items[i] == nullptr) {
       arr->items[i] = inhibitor;
+      arr->count++;
       if (idx != nullptr) {
         *idx = i;
       }
@@ -93,16 +392,9 @@ static int inhibitor_arr_add(
     }
   }
 
-  if (arr->length == arr->capacity) {
-    size_t new_capacity = arr->capacity * 2;
-    void* new_items = reallocarray(arr->items, new_capacity, sizeof(*arr->items));
-    if (new_items == nullptr) {
-      free(inhibitor);
-      return -ENOMEM;
-    }
-
-    arr->items = new_items;
-    arr->capacity = new_capacity;
+  if (inhibitor_arr_reserve(arr, arr->length + 1) < 0) {
+    inhibitor_destroy(inhibitor);
+    return -ENOMEM;
   }
 
   arr->items[arr->length] = inhibitor;
@@ -110,10 +402,64 @@ static int inhibitor_arr_add(
     *idx = arr->length;
   }
   arr->length++;
+  arr->count++;
+
+  return 0;
+}
+
+// Places an inhibitor at a specific (free) index, for restoring ids
+static int inhibitor_arr_put(
+  inhibitor_arr_t* arr,
+  size_t idx,
+  inhibitor_t* inhibitor
+) {
+  assert(arr != nullptr);
+  assert(inhibitor != nullptr);
 
+  int r;
+
+  if (idx < arr->length && arr->items[idx] != nullptr) {
+    return -EEXIST;
+  }
+
+  r = inhibitor_arr_reserve(arr, idx + 1);
+  if (r < 0) return r;
+
+  for (size_t i = arr->length; i < idx; i++) {
+    arr->items[i] = nullptr;
+  }
+  if (idx >= arr->length) {
+    arr->length = idx + 1;
+  }
+
+  arr->items[idx] = inhibitor;
+  arr->count++;
   return 0;
 }
 
+// Drops the free slots at the end, and the capacity that's no longer needed
+// for them. Slots in the middle have to stay, since they make up the ids.
+static void inhibitor_arr_compact(inhibitor_arr_t* arr) {
+  assert(arr != nullptr);
+
+  while (arr->length > 0 && arr->items[arr->length - 1] == nullptr) {
+    arr->length--;
+  }
+
+  size_t new_capacity = DEFAULT_ARR_CAPACITY;
+  while (new_capacity < arr->length) {
+    new_capacity *= 2;
+  }
+  if (new_capacity >= arr->capacity) return;
+
+  // Shrinking in place hardly ever fails, but keeping the old buffer is fine
+  void* new_items = reallocarray(arr->items, new_capacity, sizeof(*arr->items));
+  if (new_items == nullptr) return;
+
+  arr->items = new_items;
+  arr->capacity = new_capacity;
+}
+
 static bool inhibitor_arr_remove(inhibitor_arr_t* arr, size_t idx) {
   assert(arr != nullptr);
   assert(idx < arr->length);
@@ -123,31 +469,36 @@ static bool inhibitor_arr_remove(inhibitor_arr_t* arr, size_t idx) {
     return false;
   }
 
-  (void)close(old->fd);
-  free((void*)old->who);
-  free((void*)old->why);
-  free(old);
+  inhibitor_destroy(old);
   arr->items[idx] = nullptr;
+  arr->count--;
   return true;
 }
 
-inhibitman_t* inhibitman_create(sd_bus* system_bus) {
-  assert(system_bus != nullptr);
+inhibitman_t* inhibitman_create(lock_backend_t* backend) {
+  assert(backend != nullptr);
 
   inhibitman_t* im = calloc(1, sizeof(*im));
   if (im == nullptr) {
     return nullptr;
   }
 
-  im->system_bus = sd_bus_ref(system_bus);
+  im->backend = backend;
   im->inhibitors = inhibitor_arr_create();
 
   return im;
 }
 
+static void inhibitman_batch_free(inhibitman_batch_t* batch);
+
 void inhibitman_destroy(inhibitman_t* im) {
   if (im != nullptr) {
-    sd_bus_unrefp(&im->system_bus);
+    if (im->destroyed != nullptr) {
+      *im->destroyed = true;
+    }
+    while (im->batches != nullptr) {
+      inhibitman_batch_free(im->batches);
+    }
     inhibitor_arr_destroyp(&im->inhibitors);
     free(im);
   }
@@ -155,107 +506,824 @@ void inhibitman_destroy(inhibitman_t* im) {
 
 bool inhibitman_active(inhibitman_t* im) {
   assert(im != nullptr);
+  return im->inhibitors->count > 0;
+}
 
-  for (size_t i = 0; i < im->inhibitors->length; i++) {
-    if (im->inhibitors->items[i] != nullptr) {
-      return true;
-    }
+size_t inhibitman_count(inhibitman_t* im) {
+  assert(im != nullptr);
+  return im->inhibitors->count;
+}
+
+void inhibitman_compact(inhibitman_t* im) {
+  assert(im != nullptr);
+  inhibitor_arr_compact(im->inhibitors);
+}
+
+static void inhibitor_fill_entry(
+  inhibitor_t const* inhibitor,
+  inhibitman_entry_t* entry
+) {
+  *entry = (inhibitman_entry_t){
+    .id = inhibitor->id,
+    .tag = inhibitor->tag,
+    .what = inhibitor->lock->what,
+    .mode = inhibitor->lock->mode,
+    .who = inhibitor->who,
+    .why = inhibitor->why,
+    .app_name = inhibitor->app_name,
+    .reason = inhibitor->reason,
+    .created = inhibitor->created,
+    .deadline = inhibitor->deadline,
+  };
+}
+
+bool inhibitman_next(
+  inhibitman_t* im,
+  size_t* pos,
+  inhibitman_entry_t* entry
+) {
+  assert(im != nullptr);
+  assert(pos != nullptr);
+  assert(entry != nullptr);
+
+  for (size_t i = *pos; i < im->inhibitors->length; i++) {
+    inhibitor_t* inhibitor = im->inhibitors->items[i];
+    if (inhibitor == nullptr) continue;
+
+    inhibitor_fill_entry(inhibitor, entry);
+    *pos = i + 1;
+    return true;
   }
 
+  *pos = im->inhibitors->length;
   return false;
 }
 
-int inhibitman_add(
+// Locks whose first acquisition is still in flight are only shared if
+// pending is set, by batches that can wait for the outcome
+static lock_t* inhibitman_find_lock(
   inhibitman_t* im,
+  char const* what,
+  char const* mode,
+  bool pending
+) {
+  for (lock_t* lock = im->locks; lock != nullptr; lock = lock->next) {
+    // Either its first acquisition failed, and it's only kept alive by
+    // whoever shared in the failure, or re-acquiring it did and it's waiting
+    // for inhibitman_retry(). Newcomers are better off with a lock of their
+    // own.
+    if (lock->error < 0) continue;
+    if (lock->batch != nullptr && !pending) continue;
+
+    if (strcmp(lock->what, what) == 0 && strcmp(lock->mode, mode) == 0) {
+      return lock;
+    }
+  }
+
+  return nullptr;
+}
+
+static int inhibitman_create_lock(
+  inhibitman_t* im,
+  int handle,
+  char const* what,
+  char const* mode,
   char const* who,
   char const* why,
-  uint32_t* id
+  lock_t** ret
 ) {
-  assert(im != nullptr);
-  assert(who != nullptr);
-  assert(why != nullptr);
+  lock_t* lock = calloc(1, sizeof(*lock));
+  if (lock == nullptr) {
+    lock_backend_release(im->backend, handle);
+    return -ENOMEM;
+  }
 
-  int fd = -1;
-  int r;
-  int err;
-
-  _cleanup_(sd_bus_message_unrefp)
-  sd_bus_message* reply = nullptr;
-
-  r = sd_bus_call_method(
-    im->system_bus,
-    "org.freedesktop.login1",
-    "/org/freedesktop/login1",
-    "org.freedesktop.login1.Manager",
-    "Inhibit",
-    nullptr,
-    &reply,
-    "ssss",
-    "idle",
-    who,
-    why,
-    "block"
-  );
-  if (r < 0) {
-    err = -r;
-    goto fail;
+  lock->backend = im->backend;
+  lock->handle = handle;
+  lock->what = strdup(what);
+  lock->mode = strdup(mode);
+  lock->who = strdup(who);
+  lock->why = strdup(why);
+  if (
+    lock->what == nullptr
+    || lock->mode == nullptr
+    || lock->who == nullptr
+    || lock->why == nullptr
+  ) {
+    lock_free(lock);
+    return -ENOMEM;
   }
 
-  r = sd_bus_message_read_basic(reply, 'h', &fd);
-  if (r < 0) {
-    err = -r;
-    goto fail;
+  lock->refcount = 1;
+  lock->next = im->locks;
+  if (im->locks != nullptr) {
+    im->locks->pprev = &lock->next;
   }
+  lock->pprev = &im->locks;
+  im->locks = lock;
+
+  *ret = lock;
+  return 0;
+}
+
+static int inhibitman_acquire_lock(
+  inhibitman_t* im,
+  char const* what,
+  char const* mode,
+  char const* who,
+  char const* why,
+  lock_t** ret
+) {
+  int r;
+
+  TRACE(logind_inhibit_entry, im, what, mode);
+  r = lock_backend_acquire(im->backend, what, mode, who, why);
+  TRACE(logind_inhibit_return, im, r < 0 ? r : 0);
+  if (r < 0) return r;
+
+  // The lock owns the handle from here on, even on failure
+  return inhibitman_create_lock(im, r, what, mode, who, why, ret);
+}
+
+// Takes over a reference to the lock, even on failure
+static int inhibitman_insert(
+  inhibitman_t* im,
+  lock_t* lock,
+  inhibitman_request_t const* req,
+  uint32_t* id
+) {
+  int r;
 
-  fd = fcntl(fd, F_DUPFD_CLOEXEC, 3);
-  if (fd < 0) {
-    err = errno;
-    goto fail;
+  inhibitor_t* inhibitor = inhibitor_create(
+    req->who,
+    req->why,
+    req->app_name,
+    req->reason
+  );
+  if (inhibitor == nullptr) {
+    lock_unref(lock);
+    return -ENOMEM;
   }
+  inhibitor_set_lock(inhibitor, lock);
 
   size_t idx;
-  r = inhibitor_arr_add(im->inhibitors, fd, who, why, &idx);
-  if (r < 0) {
-    err = -r;
-    goto fail;
-  }
+  r = inhibitor_arr_add(im->inhibitors, inhibitor, &idx);
+  if (r < 0) return r;
 
   // Valid ids range from 1 to UINT32_MAX
   if (idx > UINT32_MAX - 1) {
+    // Drops the lock reference along with the inhibitor
     (void)inhibitor_arr_remove(im->inhibitors, idx);
-    err = EOVERFLOW;
-    goto fail;
+    return -EOVERFLOW;
   }
 
+  inhibitor->id = (uint32_t)(idx + 1);
+  inhibitor->tag = req->tag;
+  if (lock->owner == 0) {
+    lock_set_owner(lock, inhibitor);
+  }
   if (id != nullptr) {
     *id = (uint32_t)(idx + 1);
   }
 
   return 0;
+}
 
-fail:
-  if (fd >= 0) {
-    (void)close(fd);
+int inhibitman_add(inhibitman_t* im, inhibitman_request_t* req) {
+  assert(im != nullptr);
+  assert(req != nullptr);
+  assert(req->what != nullptr);
+  assert(req->mode != nullptr);
+  assert(req->who != nullptr);
+  assert(req->why != nullptr);
+  assert(req->app_name != nullptr);
+  assert(req->reason != nullptr);
+
+  int r;
+
+  req->id = 0;
+
+  // Only the first inhibitor for a given (what, mode) costs a logind call
+  lock_t* lock = inhibitman_find_lock(im, req->what, req->mode, false);
+  if (lock != nullptr) {
+    TRACE(lock_shared, im, req->what, req->mode, lock->refcount);
+    lock->refcount++;
+  } else {
+    r = inhibitman_acquire_lock(
+      im,
+      req->what,
+      req->mode,
+      req->who,
+      req->why,
+      &lock
+    );
+    if (r < 0) goto out;
   }
 
-  return -err;
+  r = inhibitman_insert(im, lock, req, &req->id);
+
+out:
+  req->error = r;
+  return r;
 }
 
-bool inhibitman_remove(inhibitman_t* im, uint32_t id) {
+static void inhibitman_batch_unlink(inhibitman_batch_t* batch) {
+  *batch->pprev = batch->next;
+  if (batch->next != nullptr) {
+    batch->next->pprev = batch->pprev;
+  }
+  batch->next = nullptr;
+  batch->pprev = nullptr;
+}
+
+static int lock_add_waiter(lock_t* lock, inhibitman_batch_t* batch) {
+  // Batches are set up in one go, so if it's already listed it's last
+  if (
+    lock->waiters_length > 0
+    && lock->waiters[lock->waiters_length - 1] == batch
+  ) {
+    return 0;
+  }
+
+  inhibitman_batch_t** waiters = realloc(
+    lock->waiters,
+    (lock->waiters_length + 1) * sizeof(*waiters)
+  );
+  if (waiters == nullptr) return -ENOMEM;
+
+  waiters[lock->waiters_length++] = batch;
+  lock->waiters = waiters;
+  batch->pending++;
+  return 0;
+}
+
+static void lock_remove_waiter(lock_t* lock, inhibitman_batch_t* batch) {
+  for (size_t i = 0; i < lock->waiters_length; i++) {
+    if (lock->waiters[i] != batch) continue;
+
+    lock->waiters_length--;
+    memmove(
+      &lock->waiters[i],
+      &lock->waiters[i + 1],
+      (lock->waiters_length - i) * sizeof(*lock->waiters)
+    );
+    return;
+  }
+}
+
+// Cancels whatever is still in flight, without running the callback. Calls
+// other batches are waiting on are left to them.
+static void inhibitman_batch_free(inhibitman_batch_t* batch) {
+  if (batch->pprev != nullptr) {
+    inhibitman_batch_unlink(batch);
+  }
+
+  for (size_t i = 0; i < batch->length; i++) {
+    lock_t* lock = batch->locks[i];
+    if (lock == nullptr) continue;
+
+    if (lock->batch == batch && lock->waiters_length > 0) {
+      lock->batch = lock->waiters[0];
+      lock_remove_waiter(lock, lock->batch);
+    } else if (lock->batch == batch) {
+      lock_backend_cancel(lock->backend, lock->call);
+      lock->call = nullptr;
+      lock->batch = nullptr;
+    } else {
+      lock_remove_waiter(lock, batch);
+    }
+    lock_unref(lock);
+  }
+
+  free(batch->locks);
+  free(batch);
+}
+
+static void inhibitman_batch_finish(inhibitman_batch_t* batch) {
+  inhibitman_t* im = batch->im;
+
+  inhibitman_batch_unlink(batch);
+
+  for (size_t i = 0; i < batch->length; i++) {
+    inhibitman_request_t* req = &batch->reqs[i];
+    lock_t* lock = batch->locks[i];
+    if (lock == nullptr) continue;
+    batch->locks[i] = nullptr;
+
+    if (lock->error < 0) {
+      req->error = lock->error;
+      lock_unref(lock);
+      continue;
+    }
+
+    req->error = inhibitman_insert(im, lock, req, &req->id);
+  }
+
+  // The callback is free to destroy the inhibitman
+  auto cb = batch->cb;
+  auto reqs = batch->reqs;
+  auto length = batch->length;
+  auto userdata = batch->userdata;
+  free(batch->locks);
+  free(batch);
+
+  cb(im, reqs, length, userdata);
+}
+
+static void lock_on_acquired(int r, void* userdata) {
+  auto lock = (lock_t*)userdata;
+  auto batch = lock->batch;
+  inhibitman_t* im = batch->im;
+
+  // Batches still to hear about it, starting with the one that made the call
+  inhibitman_batch_t** waiters = lock->waiters;
+  size_t waiters_length = lock->waiters_length;
+  lock->waiters = nullptr;
+  lock->waiters_length = 0;
+  lock->batch = nullptr;
+  lock->call = nullptr;
+
+  TRACE(logind_inhibit_return, im, r < 0 ? r : 0);
+  if (r >= 0) {
+    lock->handle = r;
+    r = 0;
+  }
+  lock->error = r;
+
+  assert(batch->pending > 0);
+  batch->pending--;
+  for (size_t i = 0; i < waiters_length; i++) {
+    assert(waiters[i]->pending > 0);
+    waiters[i]->pending--;
+  }
+
+  // Any callback may destroy the inhibitman, and the other batches with it
+  bool destroyed = false;
+  bool* outer = im->destroyed;
+  im->destroyed = &destroyed;
+
+  if (batch->pending == 0) {
+    inhibitman_batch_finish(batch);
+  }
+  for (size_t i = 0; i < waiters_length && !destroyed; i++) {
+    if (waiters[i]->pending == 0) {
+      inhibitman_batch_finish(waiters[i]);
+    }
+  }
+
+  free(waiters);
+  if (destroyed) {
+    if (outer != nullptr) {
+      *outer = true;
+    }
+    return;
+  }
+  im->destroyed = outer;
+}
+
+int inhibitman_add_batch(
+  inhibitman_t* im,
+  inhibitman_request_t* reqs,
+  size_t length,
+  inhibitman_batch_cb_t cb,
+  void* userdata
+) {
   assert(im != nullptr);
+  assert(reqs != nullptr || length == 0);
+  assert(cb != nullptr);
+
+  int r;
+
+  inhibitman_batch_t* batch = calloc(1, sizeof(*batch));
+  if (batch == nullptr) return -ENOMEM;
+
+  batch->locks = calloc(length > 0 ? length : 1, sizeof(*batch->locks));
+  // The backend calls for new locks, made all at once at the end
+  lock_backend_request_t* calls = calloc(
+    length > 0 ? length : 1,
+    sizeof(*calls)
+  );
+  size_t calls_length = 0;
+  if (batch->locks == nullptr || calls == nullptr) {
+    free(calls);
+    free(batch->locks);
+    free(batch);
+    return -ENOMEM;
+  }
+
+  batch->im = im;
+  batch->reqs = reqs;
+  batch->length = length;
+  batch->cb = cb;
+  batch->userdata = userdata;
+
+  batch->next = im->batches;
+  if (im->batches != nullptr) {
+    im->batches->pprev = &batch->next;
+  }
+  batch->pprev = &im->batches;
+  im->batches = batch;
 
+  for (size_t i = 0; i < length; i++) {
+    inhibitman_request_t* req = &reqs[i];
+    assert(req->what != nullptr);
+    assert(req->mode != nullptr);
+    assert(req->who != nullptr);
+    assert(req->why != nullptr);
+    assert(req->app_name != nullptr);
+    assert(req->reason != nullptr);
+
+    req->id = 0;
+    req->error = 0;
+
+    // Requests coalesce with each other just like with existing inhibitors;
+    // a lock that's still being acquired is shared along with its outcome,
+    // which the batch then waits for too.
+    lock_t* lock = inhibitman_find_lock(im, req->what, req->mode, true);
+    if (lock != nullptr) {
+      if (lock->batch != nullptr && lock->batch != batch) {
+        r = lock_add_waiter(lock, batch);
+        if (r < 0) {
+          req->error = r;
+          continue;
+        }
+      }
+      lock->refcount++;
+      batch->locks[i] = lock;
+      continue;
+    }
+
+    r = inhibitman_create_lock(
+      im,
+      -1,
+      req->what,
+      req->mode,
+      req->who,
+      req->why,
+      &lock
+    );
+    if (r < 0) {
+      req->error = r;
+      continue;
+    }
+
+    TRACE(logind_inhibit_entry, im, req->what, req->mode);
+    calls[calls_length++] = (lock_backend_request_t){
+      .what = lock->what,
+      .mode = lock->mode,
+      .who = lock->who,
+      .why = lock->why,
+      .userdata = lock,
+    };
+    lock->batch = batch;
+    batch->pending++;
+    batch->locks[i] = lock;
+  }
+
+  // The replies are collected from the event loop as they come in
+  lock_backend_acquire_batch(im->backend, calls, calls_length, lock_on_acquired);
+  for (size_t i = 0; i < calls_length; i++) {
+    lock_t* lock = calls[i].userdata;
+    if (calls[i].error >= 0) {
+      lock->call = calls[i].call;
+      continue;
+    }
+
+    // Fails every request sharing it, once the batch is finished
+    TRACE(logind_inhibit_return, im, calls[i].error);
+    lock->error = calls[i].error;
+    lock->batch = nullptr;
+    batch->pending--;
+  }
+  free(calls);
+
+  if (batch->pending == 0) {
+    inhibitman_batch_finish(batch);
+  }
+
+  return 0;
+}
+
+// Removes an inhibitor, handing its lock over to another one first if it
+// owned it
+static void inhibitman_drop(inhibitman_t* im, inhibitor_t* inhibitor) {
+  lock_t* lock = inhibitor->lock;
+
+  if (lock != nullptr && lock->owner == inhibitor->id && lock->refcount > 1) {
+    // The most recent one, which is likely to stay the longest when
+    // inhibitors come and go in order. If only references from batches are
+    // left, the next inhibitor to be inserted takes over.
+    lock->owner = 0;
+    inhibitor_t* other = lock->members != inhibitor
+      ? lock->members
+      : inhibitor->lock_next;
+    if (other != nullptr) {
+      lock_set_owner(lock, other);
+    }
+  }
+
+  (void)inhibitor_arr_remove(im->inhibitors, inhibitor->id - 1);
+}
+
+static inhibitor_t* inhibitman_get(inhibitman_t* im, uint32_t id) {
   if (id == 0) {
-    return false;
+    return nullptr;
   }
 
   if (id > UINT32_MAX - 1) {
-    return false;
+    return nullptr;
   }
 
   size_t idx = id - 1;
   if (idx >= im->inhibitors->length) {
+    return nullptr;
+  }
+
+  return im->inhibitors->items[idx];
+}
+
+bool inhibitman_remove(inhibitman_t* im, uint32_t id, uint32_t tag) {
+  assert(im != nullptr);
+
+  inhibitor_t* inhibitor = inhibitman_get(im, id);
+  if (inhibitor == nullptr || inhibitor->tag != tag) {
     return false;
   }
 
-  return inhibitor_arr_remove(im->inhibitors, idx);
+  inhibitman_drop(im, inhibitor);
+  return true;
+}
+
+bool inhibitman_lookup(
+  inhibitman_t* im,
+  uint32_t id,
+  inhibitman_entry_t* entry
+) {
+  assert(im != nullptr);
+  assert(entry != nullptr);
+
+  inhibitor_t* inhibitor = inhibitman_get(im, id);
+  if (inhibitor == nullptr) {
+    return false;
+  }
+
+  inhibitor_fill_entry(inhibitor, entry);
+  return true;
+}
+
+int inhibitman_restore(inhibitman_t* im, inhibitman_entry_t const* entry) {
+  assert(im != nullptr);
+  assert(entry != nullptr);
+  assert(entry->what != nullptr);
+  assert(entry->mode != nullptr);
+  assert(entry->who != nullptr);
+  assert(entry->why != nullptr);
+  assert(entry->app_name != nullptr);
+  assert(entry->reason != nullptr);
+
+  int r;
+
+  if (entry->id == 0 || entry->id > UINT32_MAX - 1) {
+    return -EINVAL;
+  }
+
+  lock_t* lock = inhibitman_find_lock(im, entry->what, entry->mode, false);
+  if (lock != nullptr) {
+    lock->refcount++;
+  } else {
+    // Held by nobody until the next inhibitman_reacquire()
+    r = inhibitman_create_lock(
+      im,
+      -1,
+      entry->what,
+      entry->mode,
+      entry->who,
+      entry->why,
+      &lock
+    );
+    if (r < 0) return r;
+  }
+
+  inhibitor_t* inhibitor = inhibitor_create(
+    entry->who,
+    entry->why,
+    entry->app_name,
+    entry->reason
+  );
+  if (inhibitor == nullptr) {
+    lock_unref(lock);
+    return -ENOMEM;
+  }
+
+  inhibitor->id = entry->id;
+  inhibitor->tag = entry->tag;
+  inhibitor_set_lock(inhibitor, lock);
+  if (lock->owner == 0) {
+    lock_set_owner(lock, inhibitor);
+  }
+  if (entry->created != 0) {
+    inhibitor->created = entry->created;
+  }
+
+  r = inhibitor_arr_put(im->inhibitors, entry->id - 1, inhibitor);
+  if (r < 0) {
+    inhibitor_destroy(inhibitor);
+    return r;
+  }
+
+  return 0;
+}
+
+void inhibitman_set_expire_cb(
+  inhibitman_t* im,
+  inhibitman_expire_cb_t cb,
+  void* userdata
+) {
+  assert(im != nullptr);
+
+  im->expire_cb = cb;
+  im->expire_userdata = userdata;
+}
+
+static void inhibitor_on_expired(timerwheel_timer_t* timer, void* userdata) {
+  auto im = (inhibitman_t*)userdata;
+  auto inhibitor = container_of(timer, inhibitor_t, timer);
+
+  if (im->expire_cb != nullptr) {
+    inhibitman_entry_t entry;
+    inhibitor_fill_entry(inhibitor, &entry);
+    im->expire_cb(im, &entry, im->expire_userdata);
+  }
+
+  inhibitman_drop(im, inhibitor);
+}
+
+int inhibitman_set_deadline(
+  inhibitman_t* im,
+  uint32_t id,
+  timerwheel_t* tw,
+  uint64_t deadline
+) {
+  assert(im != nullptr);
+  assert(tw != nullptr);
+
+  inhibitor_t* inhibitor = inhibitman_get(im, id);
+  if (inhibitor == nullptr) {
+    return -EINVAL;
+  }
+
+  inhibitor->deadline = deadline;
+  timerwheel_timer_init(&inhibitor->timer, inhibitor_on_expired, im);
+  timerwheel_add(tw, &inhibitor->timer, deadline);
+  return 0;
+}
+
+inhibitman_recovery_t* inhibitman_recovery_create(
+  inhibitman_recovery_cb_t cb,
+  void* userdata
+) {
+  assert(cb != nullptr);
+
+  inhibitman_recovery_t* rec = calloc(1, sizeof(*rec));
+  if (rec == nullptr) return nullptr;
+
+  // Held by the caller until the recovery is sealed
+  rec->refcount = 1;
+  rec->cb = cb;
+  rec->userdata = userdata;
+
+  return rec;
+}
+
+static void inhibitman_recovery_complete(inhibitman_recovery_t* rec, bool ok) {
+  assert(rec != nullptr);
+  assert(rec->refcount > 0);
+
+  if (ok) {
+    rec->acquired++;
+  } else {
+    rec->failed++;
+  }
+
+  rec->refcount--;
+  if (rec->refcount == 0) {
+    assert(rec->sealed);
+    rec->cb(rec->acquired, rec->failed, rec->userdata);
+    free(rec);
+  }
+}
+
+void inhibitman_recovery_seal(inhibitman_recovery_t* rec) {
+  assert(rec != nullptr);
+  assert(!rec->sealed);
+  assert(rec->refcount > 0);
+
+  rec->sealed = true;
+  rec->refcount--;
+  if (rec->refcount == 0) {
+    rec->cb(rec->acquired, rec->failed, rec->userdata);
+    free(rec);
+  }
+}
+
+static void lock_on_reacquired(int r, void* userdata) {
+  auto lock = (lock_t*)userdata;
+  auto rec = lock->recovery;
+
+  lock->recovery = nullptr;
+  lock->call = nullptr;
+
+  // The old lock belonged to a logind instance (or connection) that is gone;
+  // the new one only takes effect once we drop the stale one.
+  lock_backend_release(lock->backend, lock->handle);
+  if (r < 0) goto fail;
+
+  lock->handle = r;
+  lock->error = 0;
+
+  // In case the owner changed in the meantime
+  lock_reattribute(lock);
+
+  inhibitman_recovery_complete(rec, true);
+  return;
+
+fail:
+  // Held by nobody until the next inhibitman_retry()
+  lock->handle = -1;
+  lock->error = r;
+  fprintf(
+    stderr,
+    SD_ERR "failed to re-acquire inhibitor: %s\n"
+    SD_ERR "  what=%s\n"
+    SD_ERR "  mode=%s\n"
+    SD_ERR "  who=%s\n"
+    SD_ERR "  why=%s\n",
+    strerror(-r),
+    lock->what,
+    lock->mode,
+    lock->who,
+    lock->why
+  );
+  inhibitman_recovery_complete(rec, false);
+}
+
+static void lock_reacquire(lock_t* lock, inhibitman_recovery_t* rec) {
+  int r;
+
+  // Supersede any call still in flight from an earlier recovery
+  lock_cancel_call(lock);
+
+  // Calls are pipelined: all of them are made right away and the replies
+  // are collected from the event loop as they come in.
+  lock->misattributed = false;
+  r = lock_backend_acquire_async(
+    lock->backend,
+    lock->what,
+    lock->mode,
+    lock->who,
+    lock->why,
+    lock_on_reacquired,
+    lock,
+    &lock->call
+  );
+  if (r < 0) {
+    lock_backend_release(lock->backend, lock->handle);
+    lock->handle = -1;
+    lock->error = r;
+    rec->failed++;
+    return;
+  }
+
+  lock->recovery = rec;
+  rec->refcount++;
+}
+
+int inhibitman_reacquire(inhibitman_t* im, inhibitman_recovery_t* rec) {
+  assert(im != nullptr);
+  assert(rec != nullptr);
+  assert(!rec->sealed);
+
+  for (lock_t* lock = im->locks; lock != nullptr; lock = lock->next) {
+    // Locks that were never acquired are left to their batch, which is about
+    // to fail anyway: its calls went out on the connection that just died.
+    if (lock->batch != nullptr) continue;
+
+    lock_reacquire(lock, rec);
+  }
+
+  return 0;
+}
+
+int inhibitman_retry(inhibitman_t* im, inhibitman_recovery_t* rec) {
+  assert(im != nullptr);
+  assert(rec != nullptr);
+  assert(!rec->sealed);
+
+  for (lock_t* lock = im->locks; lock != nullptr; lock = lock->next) {
+    if (lock->handle >= 0 || lock->call != nullptr) continue;
+
+    lock_reacquire(lock, rec);
+  }
+
+  return 0;
 }
@@ -2,27 +2,148 @@
 #define SDIB_INHIBITMAN_H
 
 #include <stdint.h>
-#include <systemd/sd-bus.h>
+
+#include "lockbackend.h"
+#include "timerwheel.h"
 
 typedef struct inhibitman inhibitman_t;
+typedef struct inhibitman_recovery inhibitman_recovery_t;
+
+typedef struct inhibitman_entry {
+  uint32_t id;
+  uint32_t tag;
+  // The logind lock backing the inhibitor
+  char const* what;
+  char const* mode;
+  char const* who;
+  char const* why;
+  // As given by the client; who and why may have been attributed or
+  // remapped since
+  char const* app_name;
+  char const* reason;
+  // CLOCK_MONOTONIC, in microseconds; a deadline of 0 means none
+  uint64_t created;
+  uint64_t deadline;
+} inhibitman_entry_t;
+
+typedef struct inhibitman_request {
+  char const* what;
+  char const* mode;
+  char const* who;
+  char const* why;
+  char const* app_name;
+  char const* reason;
+  uint32_t tag;
+  // Set on completion: the new cookie, or a negative errno
+  uint32_t id;
+  int error;
+} inhibitman_request_t;
+
+typedef void (*inhibitman_batch_cb_t)(
+  inhibitman_t* im,
+  inhibitman_request_t* reqs,
+  size_t length,
+  void* userdata
+);
 
-inhibitman_t* inhibitman_create(sd_bus* system_bus);
+typedef void (*inhibitman_recovery_cb_t)(
+  size_t acquired,
+  size_t failed,
+  void* userdata
+);
+
+typedef void (*inhibitman_expire_cb_t)(
+  inhibitman_t* im,
+  inhibitman_entry_t const* entry,
+  void* userdata
+);
+
+// The backend is shared, and has to outlive the inhibitman
+inhibitman_t* inhibitman_create(lock_backend_t* backend);
 
 void inhibitman_destroy(inhibitman_t* im);
 DEFINE_POINTER_CLEANUP_FUNC(inhibitman_t, inhibitman_destroy)
 
 bool inhibitman_active(inhibitman_t* im);
+size_t inhibitman_count(inhibitman_t* im);
+
+// Gives back memory left over from inhibitors that were removed. Ids of live
+// inhibitors are unaffected.
+void inhibitman_compact(inhibitman_t* im);
 
-int inhibitman_add(
+// Walks the live inhibitors in cookie order. *pos must start at 0; the
+// entry's strings are only valid until the inhibitor is removed.
+bool inhibitman_next(
   inhibitman_t* im,
-  char const* who,
-  char const* why,
-  uint32_t* id
+  size_t* pos,
+  inhibitman_entry_t* entry
+);
+
+// Inhibitors with the same what and mode share one logind lock, which is
+// taken on behalf of the first of them. Inhibitors can only be removed with
+// the tag they were added with. Blocks on the backend if need be; the outcome
+// is returned and stored in the request, as with inhibitman_add_batch().
+int inhibitman_add(inhibitman_t* im, inhibitman_request_t* req);
+
+// Adds several inhibitors without blocking: the backend calls for all of them
+// are made at once, and cb runs a single time after the last reply (right
+// away, if no call was needed). Requests sharing a lock another batch is
+// still acquiring wait for that batch's reply too, and get its outcome.
+// reqs must stay valid until then.
+// Destroying the inhibitman cancels the batch without running cb.
+int inhibitman_add_batch(
+  inhibitman_t* im,
+  inhibitman_request_t* reqs,
+  size_t length,
+  inhibitman_batch_cb_t cb,
+  void* userdata
 );
 
 bool inhibitman_remove(
   inhibitman_t* im,
-  uint32_t id
+  uint32_t id,
+  uint32_t tag
+);
+
+bool inhibitman_lookup(
+  inhibitman_t* im,
+  uint32_t id,
+  inhibitman_entry_t* entry
+);
+
+// Recreates an inhibitor (e.g. from a previous instance's state) under its
+// original id, without taking any logind lock: the locks it needs are only
+// acquired by the next inhibitman_reacquire() or inhibitman_retry().
+int inhibitman_restore(inhibitman_t* im, inhibitman_entry_t const* entry);
+
+// Inhibitors with a deadline are removed automatically once it passes; the
+// expire callback runs right before that happens.
+void inhibitman_set_expire_cb(
+  inhibitman_t* im,
+  inhibitman_expire_cb_t cb,
+  void* userdata
+);
+int inhibitman_set_deadline(
+  inhibitman_t* im,
+  uint32_t id,
+  timerwheel_t* tw,
+  uint64_t deadline
 );
 
+// Re-acquiring locks after logind (or the system bus) went away is done in
+// one pipelined pass: every inhibitman_reacquire() call makes its backend
+// calls without waiting, and the recovery's callback fires once all replies
+// are in and inhibitman_recovery_seal() has been called.
+inhibitman_recovery_t* inhibitman_recovery_create(
+  inhibitman_recovery_cb_t cb,
+  void* userdata
+);
+void inhibitman_recovery_seal(inhibitman_recovery_t* rec);
+
+int inhibitman_reacquire(inhibitman_t* im, inhibitman_recovery_t* rec);
+
+// Like inhibitman_reacquire(), but only for the locks that are held by
+// nobody, e.g. because re-acquiring them failed
+int inhibitman_retry(inhibitman_t* im, inhibitman_recovery_t* rec);
+
 #endif
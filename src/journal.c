@@ -0,0 +1,425 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+
+// The journal is a memory-mapped file of fixed-size records behind a small
+// header. A record becomes visible to replay only once the header's count
+// has been bumped past it, so a process killed halfway through writing one
+// leaves a journal that simply ends before it. The mapping is shared, so
+// everything written is in the page cache the moment the store completes;
+// no msync() is needed to survive the process (as opposed to the machine).
+//
+// When the file fills up, it's replaced by a snapshot of the live state,
+// written to a temporary file and renamed over the old one.
+
+#define JOURNAL_MAGIC "SDIBJRN"
+#define JOURNAL_VERSION 3
+
+static size_t const JOURNAL_MIN_CAPACITY = 256;
+
+typedef struct journal_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  // Number of committed records
+  uint64_t count;
+  // Of the bus the peers are on; their unique names mean nothing on another
+  sd_id128_t bus_id;
+  uint8_t reserved[24];
+} journal_header_t;
+static_assert(sizeof(journal_header_t) == 64);
+
+typedef struct journal_record {
+  uint8_t op;
+  // Some string didn't fit, and was cut short
+  uint8_t truncated;
+  uint8_t reserved[2];
+  uint32_t id;
+  uint32_t tag;
+  uint32_t reserved2;
+  uint64_t created;
+  uint64_t deadline;
+  char peer[48];
+  // Enough for every kind of lock logind knows, as a policy may ask for
+  char what[128];
+  char mode[16];
+  char who[144];
+  char why[144];
+  char app_name[64];
+  char reason[192];
+} journal_record_t;
+static_assert(sizeof(journal_record_t) == 768);
+
+typedef struct journal_file {
+  int fd;
+  uint8_t* map;
+  // In records
+  size_t capacity;
+} journal_file_t;
+
+struct journal {
+  char* path;
+  char* tmp_path;
+  sd_id128_t bus_id;
+  journal_file_t file;
+  size_t count;
+  bool compacting;
+  journal_snapshot_cb_t snapshot_cb;
+  void* userdata;
+};
+
+static size_t journal_file_size(size_t capacity) {
+  return sizeof(journal_header_t) + capacity * sizeof(journal_record_t);
+}
+
+static journal_header_t* journal_file_header(journal_file_t* file) {
+  return (journal_header_t*)file->map;
+}
+
+static journal_record_t* journal_file_records(journal_file_t* file) {
+  return (journal_record_t*)(file->map + sizeof(journal_header_t));
+}
+
+static void journal_file_close(journal_file_t* file) {
+  if (file->map != nullptr) {
+    (void)munmap(file->map, journal_file_size(file->capacity));
+    file->map = nullptr;
+  }
+  if (file->fd >= 0) {
+    (void)close(file->fd);
+    file->fd = -1;
+  }
+  file->capacity = 0;
+}
+
+static int journal_file_map(journal_file_t* file, size_t capacity) {
+  size_t size = journal_file_size(capacity);
+
+  if (ftruncate(file->fd, (off_t)size) < 0) {
+    return -errno;
+  }
+
+  void* map = mmap(
+    nullptr,
+    size,
+    PROT_READ | PROT_WRITE,
+    MAP_SHARED,
+    file->fd,
+    0
+  );
+  if (map == MAP_FAILED) {
+    return -errno;
+  }
+
+  if (file->map != nullptr) {
+    (void)munmap(file->map, journal_file_size(file->capacity));
+  }
+  file->map = map;
+  file->capacity = capacity;
+  return 0;
+}
+
+static int journal_file_create(
+  char const* path,
+  size_t capacity,
+  sd_id128_t bus_id,
+  journal_file_t* ret
+) {
+  int r;
+
+  journal_file_t file = {
+    .fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600),
+  };
+  if (file.fd < 0) {
+    return -errno;
+  }
+
+  r = journal_file_map(&file, capacity);
+  if (r < 0) {
+    journal_file_close(&file);
+    (void)unlink(path);
+    return r;
+  }
+
+  journal_header_t* header = journal_file_header(&file);
+  memcpy(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+  header->version = JOURNAL_VERSION;
+  header->record_size = sizeof(journal_record_t);
+  header->count = 0;
+  header->bus_id = bus_id;
+
+  *ret = file;
+  return 0;
+}
+
+// Returns false if src had to be truncated
+static bool copy_field(char* dst, size_t n, char const* src) {
+  if (src == nullptr) {
+    dst[0] = '\0';
+    return true;
+  }
+
+  size_t len = strnlen(src, n - 1);
+  memcpy(dst, src, len);
+  dst[len] = '\0';
+  return src[len] == '\0';
+}
+
+static int journal_compact(journal_t* j) {
+  int r;
+
+  journal_file_t old = j->file;
+  size_t old_count = j->count;
+
+  size_t capacity = old.capacity > JOURNAL_MIN_CAPACITY
+    ? old.capacity
+    : JOURNAL_MIN_CAPACITY;
+
+  r = journal_file_create(j->tmp_path, capacity, j->bus_id, &j->file);
+  if (r < 0) {
+    j->file = old;
+    return r;
+  }
+  j->count = 0;
+
+  j->compacting = true;
+  r = j->snapshot_cb(j, j->userdata);
+  j->compacting = false;
+  if (r < 0) goto fail;
+
+  // Leave room for at least as many updates as there are live records, so
+  // that compaction stays amortized O(1) per append
+  if (j->count > j->file.capacity / 2) {
+    r = journal_file_map(&j->file, j->file.capacity * 2);
+    if (r < 0) goto fail;
+  }
+
+  if (rename(j->tmp_path, j->path) < 0) {
+    r = -errno;
+    goto fail;
+  }
+
+  journal_file_close(&old);
+  return 0;
+
+fail:
+  journal_file_close(&j->file);
+  (void)unlink(j->tmp_path);
+  j->file = old;
+  j->count = old_count;
+  return r;
+}
+
+int journal_open(
+  char const* path,
+  sd_id128_t bus_id,
+  journal_snapshot_cb_t snapshot_cb,
+  void* userdata,
+  journal_t** ret
+) {
+  assert(path != nullptr);
+  assert(snapshot_cb != nullptr);
+  assert(ret != nullptr);
+
+  int r;
+
+  _cleanup_(journal_destroyp)
+  journal_t* j = calloc(1, sizeof(*j));
+  if (j == nullptr) return -ENOMEM;
+
+  j->file.fd = -1;
+  j->bus_id = bus_id;
+  j->snapshot_cb = snapshot_cb;
+  j->userdata = userdata;
+
+  j->path = strdup(path);
+  if (j->path == nullptr) return -ENOMEM;
+
+  size_t tmp_size = strlen(path) + sizeof(".tmp");
+  j->tmp_path = malloc(tmp_size);
+  if (j->tmp_path == nullptr) return -ENOMEM;
+  (void)snprintf(j->tmp_path, tmp_size, "%s.tmp", path);
+
+  r = journal_compact(j);
+  if (r < 0) return r;
+
+  *ret = j;
+  j = nullptr;
+  return 0;
+}
+
+void journal_destroy(journal_t* j) {
+  if (j == nullptr) return;
+
+  journal_file_close(&j->file);
+  free(j->path);
+  free(j->tmp_path);
+  free(j);
+}
+
+int journal_append(journal_t* j, journal_entry_t const* entry) {
+  assert(j != nullptr);
+  assert(entry != nullptr);
+  assert(entry->peer != nullptr);
+
+  int r;
+
+  if (j->count == j->file.capacity) {
+    if (!j->compacting) {
+      // The snapshot already reflects this entry
+      return journal_compact(j);
+    }
+
+    r = journal_file_map(&j->file, j->file.capacity * 2);
+    if (r < 0) return r;
+  }
+
+  journal_record_t* record = &journal_file_records(&j->file)[j->count];
+  *record = (journal_record_t){
+    .op = (uint8_t)entry->op,
+    .id = entry->id,
+    .tag = entry->tag,
+    .created = entry->created,
+    .deadline = entry->deadline,
+  };
+  bool fits = copy_field(record->peer, sizeof(record->peer), entry->peer);
+  fits &= copy_field(record->what, sizeof(record->what), entry->what);
+  fits &= copy_field(record->mode, sizeof(record->mode), entry->mode);
+  fits &= copy_field(record->who, sizeof(record->who), entry->who);
+  fits &= copy_field(record->why, sizeof(record->why), entry->why);
+  fits &= copy_field(
+    record->app_name,
+    sizeof(record->app_name),
+    entry->app_name
+  );
+  fits &= copy_field(record->reason, sizeof(record->reason), entry->reason);
+  record->truncated = !fits;
+
+  // Commit: the record has to be complete before the count covers it
+  j->count++;
+  __atomic_store_n(
+    &journal_file_header(&j->file)->count,
+    (uint64_t)j->count,
+    __ATOMIC_RELEASE
+  );
+  return 0;
+}
+
+size_t journal_record_count(journal_t* j) {
+  assert(j != nullptr);
+  return j->count;
+}
+
+int journal_replay(
+  char const* path,
+  sd_id128_t* ret_bus_id,
+  journal_replay_cb_t cb,
+  void* userdata
+) {
+  assert(path != nullptr);
+  assert(ret_bus_id != nullptr);
+  assert(cb != nullptr);
+
+  int r;
+
+  *ret_bus_id = SD_ID128_NULL;
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return errno == ENOENT ? 0 : -errno;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    r = -errno;
+    (void)close(fd);
+    return r;
+  }
+
+  size_t size = (size_t)st.st_size;
+  if (size < sizeof(journal_header_t)) {
+    (void)close(fd);
+    return -EBADMSG;
+  }
+
+  void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  (void)close(fd);
+  if (map == MAP_FAILED) {
+    return -errno;
+  }
+
+  auto header = (journal_header_t const*)map;
+  if (
+    memcmp(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0
+    || header->version != JOURNAL_VERSION
+    || header->record_size != sizeof(journal_record_t)
+  ) {
+    r = -EBADMSG;
+    goto out;
+  }
+
+  *ret_bus_id = header->bus_id;
+
+  size_t count = (size - sizeof(journal_header_t)) / sizeof(journal_record_t);
+  if (header->count < count) {
+    count = (size_t)header->count;
+  }
+
+  auto records = (journal_record_t const*)(
+    (uint8_t const*)map + sizeof(journal_header_t)
+  );
+
+  r = 0;
+  for (size_t i = 0; i < count; i++) {
+    // Work on a copy so the strings can be terminated no matter what's in
+    // the file
+    journal_record_t record = records[i];
+    record.peer[sizeof(record.peer) - 1] = '\0';
+    record.what[sizeof(record.what) - 1] = '\0';
+    record.mode[sizeof(record.mode) - 1] = '\0';
+    record.who[sizeof(record.who) - 1] = '\0';
+    record.why[sizeof(record.why) - 1] = '\0';
+    record.app_name[sizeof(record.app_name) - 1] = '\0';
+    record.reason[sizeof(record.reason) - 1] = '\0';
+
+    if (
+      record.op != JOURNAL_OP_ADD
+      && record.op != JOURNAL_OP_REMOVE
+      && record.op != JOURNAL_OP_PEER_GONE
+    ) {
+      r = -EBADMSG;
+      break;
+    }
+
+    journal_entry_t entry = {
+      .op = (journal_op_t)record.op,
+      .peer = record.peer,
+      .id = record.id,
+      .tag = record.tag,
+      .created = record.created,
+      .deadline = record.deadline,
+      .what = record.what,
+      .mode = record.mode,
+      .who = record.who,
+      .why = record.why,
+      .app_name = record.app_name,
+      .reason = record.reason,
+      .truncated = record.truncated != 0,
+    };
+    r = cb(&entry, userdata);
+    if (r < 0) break;
+  }
+
+out:
+  (void)munmap(map, size);
+  return r;
+}
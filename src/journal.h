@@ -0,0 +1,79 @@
+#ifndef SDIB_JOURNAL_H
+#define SDIB_JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <systemd/sd-id128.h>
+
+typedef struct journal journal_t;
+
+typedef enum journal_op {
+  JOURNAL_OP_ADD = 1,
+  JOURNAL_OP_REMOVE,
+  // The peer and all of its inhibitors are gone
+  JOURNAL_OP_PEER_GONE,
+} journal_op_t;
+
+// Strings longer than what fits in a record are truncated, which replay
+// flags
+typedef struct journal_entry {
+  journal_op_t op;
+  char const* peer;
+  uint32_t id;
+  uint32_t tag;
+  // Only meaningful for JOURNAL_OP_ADD. CLOCK_MONOTONIC, in microseconds;
+  // a deadline of 0 means none.
+  uint64_t created;
+  uint64_t deadline;
+  char const* what;
+  char const* mode;
+  char const* who;
+  char const* why;
+  char const* app_name;
+  char const* reason;
+  bool truncated;
+} journal_entry_t;
+
+typedef int (*journal_replay_cb_t)(
+  journal_entry_t const* entry,
+  void* userdata
+);
+
+// Writes the complete live state with journal_append(), as JOURNAL_OP_ADD
+// entries
+typedef int (*journal_snapshot_cb_t)(journal_t* j, void* userdata);
+
+// Feeds every committed record of the journal at path to cb, in order. A
+// missing journal is not an error. The id of the bus the journal was written
+// for is stored in ret_bus_id, or a null id if there was none.
+int journal_replay(
+  char const* path,
+  sd_id128_t* ret_bus_id,
+  journal_replay_cb_t cb,
+  void* userdata
+);
+
+// Starts a fresh journal at path from a snapshot of the current state, for
+// peers on the bus with the given id. The old file is atomically replaced
+// once the snapshot is complete.
+int journal_open(
+  char const* path,
+  sd_id128_t bus_id,
+  journal_snapshot_cb_t snapshot_cb,
+  void* userdata,
+  journal_t** ret
+);
+
+// The file is left behind on purpose: it's what lets the next instance
+// pick up where this one left off.
+void journal_destroy(journal_t* j);
+DEFINE_POINTER_CLEANUP_FUNC(journal_t, journal_destroy);
+
+// Entries must be appended after the state change they describe has been
+// applied. When the journal is full, it's compacted into a snapshot of the
+// (already updated) state instead.
+int journal_append(journal_t* j, journal_entry_t const* entry);
+
+size_t journal_record_count(journal_t* j);
+
+#endif
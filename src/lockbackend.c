@@ -0,0 +1,88 @@
+#include <assert.h>
+
+#include "lockbackend.h"
+
+int lock_backend_acquire(
+  lock_backend_t* b,
+  char const* what,
+  char const* mode,
+  char const* who,
+  char const* why
+) {
+  assert(b != nullptr);
+  return b->ops->acquire(b, what, mode, who, why);
+}
+
+int lock_backend_acquire_async(
+  lock_backend_t* b,
+  char const* what,
+  char const* mode,
+  char const* who,
+  char const* why,
+  lock_backend_cb_t cb,
+  void* userdata,
+  lock_backend_call_t** ret
+) {
+  assert(b != nullptr);
+  assert(cb != nullptr);
+  assert(ret != nullptr);
+  return b->ops->acquire_async(b, what, mode, who, why, cb, userdata, ret);
+}
+
+void lock_backend_acquire_batch(
+  lock_backend_t* b,
+  lock_backend_request_t* reqs,
+  size_t length,
+  lock_backend_cb_t cb
+) {
+  assert(b != nullptr);
+  assert(reqs != nullptr || length == 0);
+  assert(cb != nullptr);
+
+  if (b->ops->acquire_batch != nullptr) {
+    b->ops->acquire_batch(b, reqs, length, cb);
+    return;
+  }
+
+  for (size_t i = 0; i < length; i++) {
+    lock_backend_request_t* req = &reqs[i];
+    req->call = nullptr;
+    req->error = b->ops->acquire_async(
+      b,
+      req->what,
+      req->mode,
+      req->who,
+      req->why,
+      cb,
+      req->userdata,
+      &req->call
+    );
+  }
+}
+
+void lock_backend_cancel(lock_backend_t* b, lock_backend_call_t* call) {
+  assert(b != nullptr);
+  if (call == nullptr) return;
+  b->ops->cancel(b, call);
+}
+
+void lock_backend_release(lock_backend_t* b, int handle) {
+  assert(b != nullptr);
+  if (handle < 0) return;
+  b->ops->release(b, handle);
+}
+
+bool lock_backend_healthy(lock_backend_t* b) {
+  assert(b != nullptr);
+  return b->ops->healthy(b);
+}
+
+char const* lock_backend_name(lock_backend_t* b) {
+  assert(b != nullptr);
+  return b->ops->name;
+}
+
+void lock_backend_destroy(lock_backend_t* b) {
+  if (b == nullptr) return;
+  b->ops->destroy(b);
+}
@@ -0,0 +1,128 @@
+#ifndef SDIB_LOCKBACKEND_H
+#define SDIB_LOCKBACKEND_H
+
+#include <stdint.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+// Whatever actually takes the locks behind inhibitors. logind is the real
+// one; the null backend hands out fake locks, for benchmarking the bridge
+// (and testing it) without logind in the loop.
+//
+// Locks are identified by a handle, >= 0, that only means something to the
+// backend which handed it out. For logind it's the fd holding the lock.
+
+typedef struct lock_backend lock_backend_t;
+typedef struct lock_backend_call lock_backend_call_t;
+
+// r is the handle of the new lock, or a negative errno
+typedef void (*lock_backend_cb_t)(int r, void* userdata);
+
+// One of the locks taken by lock_backend_acquire_batch()
+typedef struct lock_backend_request {
+  char const* what;
+  char const* mode;
+  char const* who;
+  char const* why;
+  void* userdata;
+  // Set by the backend: the call in flight, or else why it couldn't be made
+  lock_backend_call_t* call;
+  int error;
+} lock_backend_request_t;
+
+typedef struct lock_backend_ops {
+  char const* name;
+  int (*acquire)(
+    lock_backend_t* b,
+    char const* what,
+    char const* mode,
+    char const* who,
+    char const* why
+  );
+  int (*acquire_async)(
+    lock_backend_t* b,
+    char const* what,
+    char const* mode,
+    char const* who,
+    char const* why,
+    lock_backend_cb_t cb,
+    void* userdata,
+    lock_backend_call_t** ret
+  );
+  // Optional; the requests are made one by one with acquire_async otherwise
+  void (*acquire_batch)(
+    lock_backend_t* b,
+    lock_backend_request_t* reqs,
+    size_t length,
+    lock_backend_cb_t cb
+  );
+  void (*cancel)(lock_backend_t* b, lock_backend_call_t* call);
+  void (*release)(lock_backend_t* b, int handle);
+  bool (*healthy)(lock_backend_t* b);
+  void (*destroy)(lock_backend_t* b);
+} lock_backend_ops_t;
+
+// Embedded at the start of each backend's own structure
+struct lock_backend {
+  lock_backend_ops_t const* ops;
+};
+
+// Blocks until the lock is taken
+int lock_backend_acquire(
+  lock_backend_t* b,
+  char const* what,
+  char const* mode,
+  char const* who,
+  char const* why
+);
+
+// Starts taking a lock without blocking. cb runs exactly once, from the event
+// loop, unless the call is cancelled first; the call is gone after either.
+int lock_backend_acquire_async(
+  lock_backend_t* b,
+  char const* what,
+  char const* mode,
+  char const* who,
+  char const* why,
+  lock_backend_cb_t cb,
+  void* userdata,
+  lock_backend_call_t** ret
+);
+// Same as lock_backend_acquire_async() for each request, with cb and the
+// request's userdata, but lets the backend share the work between them.
+// Every call can still be cancelled on its own.
+void lock_backend_acquire_batch(
+  lock_backend_t* b,
+  lock_backend_request_t* reqs,
+  size_t length,
+  lock_backend_cb_t cb
+);
+
+void lock_backend_cancel(lock_backend_t* b, lock_backend_call_t* call);
+
+void lock_backend_release(lock_backend_t* b, int handle);
+
+// Whether acquiring has any chance of working right now
+bool lock_backend_healthy(lock_backend_t* b);
+
+char const* lock_backend_name(lock_backend_t* b);
+
+void lock_backend_destroy(lock_backend_t* b);
+DEFINE_POINTER_CLEANUP_FUNC(lock_backend_t, lock_backend_destroy);
+
+lock_backend_t* lock_backend_logind_create(void);
+
+// The connection logind is reached through; nullptr while there is none.
+// Calls already in flight stay on the connection they were made on. Does
+// nothing for other backends.
+void lock_backend_logind_set_bus(lock_backend_t* b, sd_bus* system_bus);
+
+// Every acquisition takes latency_usec and fails with EIO failure_percent
+// percent of the time
+lock_backend_t* lock_backend_null_create(
+  sd_event* event,
+  uint64_t latency_usec,
+  unsigned failure_percent
+);
+
+#endif
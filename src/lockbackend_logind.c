@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <systemd/sd-bus.h>
+
+#include "lockbackend.h"
+
+typedef struct logind_backend {
+  lock_backend_t base;
+  sd_bus* system_bus;
+} logind_backend_t;
+
+struct lock_backend_call {
+  sd_bus_slot* slot;
+  lock_backend_cb_t cb;
+  void* userdata;
+};
+
+static lock_backend_ops_t const logind_ops;
+
+// The fd in a message goes away along with it
+static int logind_read_lock(sd_bus_message* m) {
+  int fd;
+  int r;
+
+  r = sd_bus_message_read_basic(m, 'h', &fd);
+  if (r < 0) return r;
+
+  fd = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+  if (fd < 0) return -errno;
+
+  return fd;
+}
+
+static int logind_acquire(
+  lock_backend_t* b,
+  char const* what,
+  char const* mode,
+  char const* who,
+  char const* why
+) {
+  auto lb = (logind_backend_t*)b;
+  int r;
+
+  if (lb->system_bus == nullptr) return -ENOTCONN;
+
+  _cleanup_(sd_bus_message_unrefp)
+  sd_bus_message* reply = nullptr;
+
+  r = sd_bus_call_method(
+    lb->system_bus,
+    "org.freedesktop.login1",
+    "/org/freedesktop/login1",
+    "org.freedesktop.login1.Manager",
+    "Inhibit",
+    nullptr,
+    &reply,
+    "ssss",
+    what,
+    who,
+    why,
+    mode
+  );
+  if (r < 0) return r;
+
+  return logind_read_lock(reply);
+}
+
+static int logind_on_reply(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* ret_error
+) {
+  (void)ret_error;
+
+  auto call = (lock_backend_call_t*)userdata;
+  int r;
+
+  r = sd_bus_message_get_errno(m);
+  if (r > 0) {
+    r = -r;
+  } else {
+    r = logind_read_lock(m);
+  }
+
+  // The call is over before anyone hears about it
+  auto cb = call->cb;
+  auto cb_userdata = call->userdata;
+  sd_bus_slot_unrefp(&call->slot);
+  free(call);
+
+  cb(r, cb_userdata);
+  return 0;
+}
+
+static int logind_acquire_async(
+  lock_backend_t* b,
+  char const* what,
+  char const* mode,
+  char const* who,
+  char const* why,
+  lock_backend_cb_t cb,
+  void* userdata,
+  lock_backend_call_t** ret
+) {
+  auto lb = (logind_backend_t*)b;
+  int r;
+
+  if (lb->system_bus == nullptr) return -ENOTCONN;
+
+  lock_backend_call_t* call = calloc(1, sizeof(*call));
+  if (call == nullptr) return -ENOMEM;
+
+  call->cb = cb;
+  call->userdata = userdata;
+
+  r = sd_bus_call_method_async(
+    lb->system_bus,
+    &call->slot,
+    "org.freedesktop.login1",
+    "/org/freedesktop/login1",
+    "org.freedesktop.login1.Manager",
+    "Inhibit",
+    logind_on_reply,
+    call,
+    "ssss",
+    what,
+    who,
+    why,
+    mode
+  );
+  if (r < 0) {
+    free(call);
+    return r;
+  }
+
+  *ret = call;
+  return 0;
+}
+
+static void logind_cancel(lock_backend_t* b, lock_backend_call_t* call) {
+  (void)b;
+
+  // Dropping the slot cancels the call; its handler won't run
+  sd_bus_slot_unrefp(&call->slot);
+  free(call);
+}
+
+static void logind_release(lock_backend_t* b, int handle) {
+  (void)b;
+  (void)close(handle);
+}
+
+static bool logind_healthy(lock_backend_t* b) {
+  auto lb = (logind_backend_t*)b;
+  return lb->system_bus != nullptr;
+}
+
+static void logind_destroy(lock_backend_t* b) {
+  auto lb = (logind_backend_t*)b;
+  sd_bus_unrefp(&lb->system_bus);
+  free(lb);
+}
+
+static lock_backend_ops_t const logind_ops = {
+  .name = "logind",
+  .acquire = logind_acquire,
+  .acquire_async = logind_acquire_async,
+  .cancel = logind_cancel,
+  .release = logind_release,
+  .healthy = logind_healthy,
+  .destroy = logind_destroy,
+};
+
+lock_backend_t* lock_backend_logind_create(void) {
+  logind_backend_t* lb = calloc(1, sizeof(*lb));
+  if (lb == nullptr) return nullptr;
+
+  lb->base.ops = &logind_ops;
+  return &lb->base;
+}
+
+void lock_backend_logind_set_bus(lock_backend_t* b, sd_bus* system_bus) {
+  assert(b != nullptr);
+
+  if (b->ops != &logind_ops) return;
+
+  auto lb = (logind_backend_t*)b;
+  if (lb->system_bus == system_bus) return;
+
+  // Pending calls hold a reference of their own through their slot
+  sd_bus_unrefp(&lb->system_bus);
+  if (system_bus != nullptr) {
+    lb->system_bus = sd_bus_ref(system_bus);
+  }
+}
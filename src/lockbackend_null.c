@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <systemd/sd-event.h>
+
+#include "lockbackend.h"
+
+typedef struct null_backend {
+  lock_backend_t base;
+  sd_event* event;
+  uint64_t latency_usec;
+  unsigned failure_percent;
+  // Failures are spread evenly rather than drawn at random, so that runs
+  // can be compared with each other
+  unsigned failure_acc;
+  int next_handle;
+} null_backend_t;
+
+// Calls made together are answered together, by a single event source
+typedef struct null_flight null_flight_t;
+
+struct lock_backend_call {
+  null_flight_t* flight;
+  // nullptr once the call has been answered or cancelled
+  lock_backend_cb_t cb;
+  void* userdata;
+};
+
+struct null_flight {
+  null_backend_t* nb;
+  sd_event_source* source;
+  // Calls still to be answered, plus one while they're being answered
+  size_t live;
+  size_t length;
+  lock_backend_call_t calls[];
+};
+
+static int null_outcome(null_backend_t* nb) {
+  nb->failure_acc += nb->failure_percent;
+  if (nb->failure_acc >= 100) {
+    nb->failure_acc -= 100;
+    return -EIO;
+  }
+
+  int handle = nb->next_handle;
+  nb->next_handle = handle == INT_MAX ? 0 : handle + 1;
+  return handle;
+}
+
+static int null_acquire(
+  lock_backend_t* b,
+  char const* what,
+  char const* mode,
+  char const* who,
+  char const* why
+) {
+  (void)what;
+  (void)mode;
+  (void)who;
+  (void)why;
+
+  auto nb = (null_backend_t*)b;
+
+  if (nb->latency_usec > 0) {
+    struct timespec ts = {
+      .tv_sec = (time_t)(nb->latency_usec / 1000000),
+      .tv_nsec = (long)(nb->latency_usec % 1000000) * 1000,
+    };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {}
+  }
+
+  return null_outcome(nb);
+}
+
+static void null_flight_unref(null_flight_t* flight) {
+  assert(flight->live > 0);
+  if (--flight->live > 0) return;
+
+  sd_event_source_disable_unrefp(&flight->source);
+  free(flight);
+}
+
+static int null_on_done(sd_event_source* s, void* userdata) {
+  (void)s;
+
+  auto flight = (null_flight_t*)userdata;
+
+  // Callbacks may cancel the calls that are still to come
+  flight->live++;
+  for (size_t i = 0; i < flight->length; i++) {
+    lock_backend_call_t* call = &flight->calls[i];
+    if (call->cb == nullptr) continue;
+
+    // The call is over before anyone hears about it
+    auto cb = call->cb;
+    call->cb = nullptr;
+    flight->live--;
+
+    cb(null_outcome(flight->nb), call->userdata);
+  }
+  null_flight_unref(flight);
+
+  return 0;
+}
+
+static int null_on_time(sd_event_source* s, uint64_t usec, void* userdata) {
+  (void)usec;
+  return null_on_done(s, userdata);
+}
+
+static int null_flight_start(
+  null_backend_t* nb,
+  size_t length,
+  null_flight_t** ret
+) {
+  int r;
+
+  null_flight_t* flight = calloc(
+    1,
+    sizeof(*flight) + length * sizeof(*flight->calls)
+  );
+  if (flight == nullptr) return -ENOMEM;
+
+  flight->nb = nb;
+  flight->length = length;
+
+  // Even without latency the reply comes from the event loop, as it would
+  // from logind
+  if (nb->latency_usec > 0) {
+    r = sd_event_add_time_relative(
+      nb->event,
+      &flight->source,
+      CLOCK_MONOTONIC,
+      nb->latency_usec,
+      1,
+      null_on_time,
+      flight
+    );
+  } else {
+    r = sd_event_add_defer(nb->event, &flight->source, null_on_done, flight);
+  }
+  if (r < 0) {
+    free(flight);
+    return r;
+  }
+
+  *ret = flight;
+  return 0;
+}
+
+static int null_acquire_async(
+  lock_backend_t* b,
+  char const* what,
+  char const* mode,
+  char const* who,
+  char const* why,
+  lock_backend_cb_t cb,
+  void* userdata,
+  lock_backend_call_t** ret
+) {
+  (void)what;
+  (void)mode;
+  (void)who;
+  (void)why;
+
+  auto nb = (null_backend_t*)b;
+  int r;
+
+  null_flight_t* flight;
+  r = null_flight_start(nb, 1, &flight);
+  if (r < 0) return r;
+
+  lock_backend_call_t* call = &flight->calls[0];
+  call->flight = flight;
+  call->cb = cb;
+  call->userdata = userdata;
+  flight->live = 1;
+
+  *ret = call;
+  return 0;
+}
+
+static void null_acquire_batch(
+  lock_backend_t* b,
+  lock_backend_request_t* reqs,
+  size_t length,
+  lock_backend_cb_t cb
+) {
+  auto nb = (null_backend_t*)b;
+  int r;
+
+  if (length == 0) return;
+
+  null_flight_t* flight;
+  r = null_flight_start(nb, length, &flight);
+  if (r < 0) {
+    for (size_t i = 0; i < length; i++) {
+      reqs[i].call = nullptr;
+      reqs[i].error = r;
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < length; i++) {
+    lock_backend_call_t* call = &flight->calls[i];
+    call->flight = flight;
+    call->cb = cb;
+    call->userdata = reqs[i].userdata;
+    reqs[i].call = call;
+    reqs[i].error = 0;
+  }
+  flight->live = length;
+}
+
+static void null_cancel(lock_backend_t* b, lock_backend_call_t* call) {
+  (void)b;
+
+  assert(call->cb != nullptr);
+  call->cb = nullptr;
+  null_flight_unref(call->flight);
+}
+
+static void null_release(lock_backend_t* b, int handle) {
+  (void)b;
+  (void)handle;
+}
+
+static bool null_healthy(lock_backend_t* b) {
+  (void)b;
+  return true;
+}
+
+static void null_destroy(lock_backend_t* b) {
+  auto nb = (null_backend_t*)b;
+  sd_event_unrefp(&nb->event);
+  free(nb);
+}
+
+static lock_backend_ops_t const null_ops = {
+  .name = "null",
+  .acquire = null_acquire,
+  .acquire_async = null_acquire_async,
+  .acquire_batch = null_acquire_batch,
+  .cancel = null_cancel,
+  .release = null_release,
+  .healthy = null_healthy,
+  .destroy = null_destroy,
+};
+
+lock_backend_t* lock_backend_null_create(
+  sd_event* event,
+  uint64_t latency_usec,
+  unsigned failure_percent
+) {
+  assert(event != nullptr);
+  assert(failure_percent <= 100);
+
+  null_backend_t* nb = calloc(1, sizeof(*nb));
+  if (nb == nullptr) return nullptr;
+
+  nb->base.ops = &null_ops;
+  nb->event = sd_event_ref(event);
+  nb->latency_usec = latency_usec;
+  nb->failure_percent = failure_percent;
+  return &nb->base;
+}
@@ -1,25 +1,493 @@
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <getopt.h>
 #include <stdio.h>
+#include <string.h>
 #include <signal.h>
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/stat.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include <systemd/sd-daemon.h>
 #include <systemd/sd-bus.h>
+#include <systemd/sd-login.h>
 
 #include "inhibitman.h"
+#include "lockbackend.h"
 #include "htable.h"
+#include "policy.h"
+#include "journal.h"
+#include "recorder.h"
+#include "capture.h"
+#include "trace.h"
 
-typedef struct bus_peer {
+static inline void freep(void* p) {
+  free(*(void**)p);
+}
+
+typedef struct max_inhibit {
+  // nullptr matches any app_name
+  char const* app_name;
+  uint64_t usec;
+} max_inhibit_t;
+
+// D-Bus interfaces inhibitors can be requested through. All of them share
+// the same peers and inhibitors; each one hands out its own cookies.
+typedef enum frontend {
+  FRONTEND_SCREENSAVER,
+  FRONTEND_POWER_MANAGEMENT,
+  FRONTEND_GNOME_SESSION,
+  _FRONTEND_MAX,
+} frontend_t;
+
+typedef struct options {
+  max_inhibit_t* max_inhibit;
+  size_t max_inhibit_length;
+  char const* policy_path;
+  // nullptr disables the state journal. In system mode, this is a
+  // directory holding one journal per user.
+  char const* journal_path;
+  // Bitmask of enabled frontends
+  uint32_t frontends;
+  // Where to record client traffic to, if anywhere
+  char const* capture_path;
+  // Serve the user bus of every logged-in user, rather than our own
+  bool system;
+  // What takes the actual locks: "logind" or "null"
+  char const* backend;
+  // For the null backend
+  uint64_t backend_latency_usec;
+  unsigned backend_failure_percent;
+} options_t;
+
+static void options_free(options_t* opts) {
+  for (size_t i = 0; i < opts->max_inhibit_length; i++) {
+    free((void*)opts->max_inhibit[i].app_name);
+  }
+  free(opts->max_inhibit);
+  opts->max_inhibit = nullptr;
+  opts->max_inhibit_length = 0;
+  free((void*)opts->journal_path);
+  opts->journal_path = nullptr;
+}
+
+static int options_add_max_inhibit(options_t* opts, char const* arg) {
+  char const* app_name = nullptr;
+  char const* seconds = arg;
+
+  char const* sep = strrchr(arg, '=');
+  if (sep != nullptr) {
+    app_name = arg;
+    seconds = sep + 1;
+  }
+
+  char* end;
+  errno = 0;
+  unsigned long long n = strtoull(seconds, &end, 10);
+  if (
+    errno != 0
+    || *seconds == '\0'
+    || *end != '\0'
+    || n > UINT64_MAX / 1000000
+  ) {
+    return -EINVAL;
+  }
+
+  void* items = reallocarray(
+    opts->max_inhibit,
+    opts->max_inhibit_length + 1,
+    sizeof(*opts->max_inhibit)
+  );
+  if (items == nullptr) return -ENOMEM;
+  opts->max_inhibit = items;
+
+  max_inhibit_t* item = &opts->max_inhibit[opts->max_inhibit_length];
+  item->app_name = nullptr;
+  item->usec = n * 1000000;
+  if (app_name != nullptr) {
+    item->app_name = strndup(app_name, sep - app_name);
+    if (item->app_name == nullptr) return -ENOMEM;
+  }
+
+  opts->max_inhibit_length++;
+  return 0;
+}
+
+// Returns the maximum inhibit duration for app_name, or 0 if unlimited.
+// The last matching option wins.
+static uint64_t options_get_max_inhibit(
+  options_t const* opts,
+  char const* app_name
+) {
+  for (size_t i = opts->max_inhibit_length; i > 0; i--) {
+    max_inhibit_t const* item = &opts->max_inhibit[i - 1];
+    if (item->app_name == nullptr || strcmp(item->app_name, app_name) == 0) {
+      return item->usec;
+    }
+  }
+
+  return 0;
+}
+
+typedef struct bus_context bus_context_t;
+typedef struct bus_peer bus_peer_t;
+
+// What every user bus the process serves has in common: the event loop, the
+// system bus connection, the lock backend and the policy. There is one bus
+// context per user bus, i.e. just one unless in --system mode.
+typedef struct bridge {
+  options_t const* opts;
+  sd_event* event;
+  sd_bus* system_bus;
+  lock_backend_t* backend;
+  sd_event_source* reconnect_source;
+  uint64_t reconnect_delay;
+  policy_t* policy;
+  sd_event_source* sighup_source;
+  sd_event_source* sigusr1_source;
+  bus_context_t** contexts;
+  size_t contexts_length;
+  // --system: retries for users whose bus wasn't up yet when they showed up
+  sd_event_source* attach_source;
+  unsigned attach_retries;
+  // Contexts whose user bus went away are destroyed from here, rather than
+  // from one of their own bus callbacks
+  sd_event_source* reap_source;
+  capture_t* capture;
+  // Gives memory back after a burst, once things have quieted down; see
+  // bridge_on_compact()
+  sd_event_source* compact_source;
+  // Inhibitor changes since the compaction timer was armed
+  uint64_t compact_changes;
+} bridge_t;
+
+// A RequestName call in flight
+typedef struct bus_name_request {
+  bus_context_t* ctx;
+  sd_bus_slot* slot;
+} bus_name_request_t;
+
+struct bus_context {
+  bridge_t* bridge;
+  uid_t uid;
+  // Set once the context is to be dropped; see bridge_on_reap()
+  bool closing;
+  // The user bus went away, taking every peer on it along
+  bool disconnected;
+  htable_t* peers;
+  // The same peers, ordered by name, for ListInhibitors to page through
+  bus_peer_t** ordered_peers;
+  size_t ordered_peers_length;
+  size_t ordered_peers_capacity;
+  sd_bus* user_bus;
+  // Total number of inhibitors across all peers
+  uint32_t inhibitor_count;
+  // Last state broadcast to clients; see bus_context_flush_notify()
+  uint32_t emitted_count;
+  // Flush the changes once nothing more urgent is pending, or NOTIFY_DELAY
+  // after the first one if clients keep the bridge busy for that long
+  sd_event_source* notify_defer_source;
+  sd_event_source* notify_source;
+  // Changes since the last broadcast; non-zero while one is scheduled
+  uint32_t pending_changes;
+  // Broadcasts that went out, and the changes folded into them
+  uint32_t notify_flushes;
+  uint64_t notify_changes;
+  inhibitman_recovery_t* recovery;
+  uint64_t recovery_start;
+  uint32_t recoveries;
+  uint64_t last_recovery_usec;
+  // Locks that could not be re-acquired, over all recoveries. Those are
+  // tried again after retry_delay, until they all make it.
+  uint32_t recovery_failures;
+  sd_event_source* retry_source;
+  uint64_t retry_delay;
+  // Deadlines of inhibitors with a maximum duration
+  timerwheel_t* wheel;
+  sd_event_source* wheel_source;
+  // Lets a restarted instance pick up the inhibitors of this one
+  journal_t* journal;
+  char* journal_path;
+  // Attaching to the user bus is done without blocking; see
+  // bus_context_attach(). The bus id is known once the first reply is in.
+  sd_bus_slot* attach_slot;
+  bus_name_request_t name_requests[_FRONTEND_MAX];
+  sd_id128_t bus_id;
+  // Peers that left the bus, cleaned up once there's nothing more urgent
+  char** gone;
+  size_t gone_length;
+  sd_event_source* cleanup_source;
+};
+
+// An Inhibit call that hasn't been replied to yet
+typedef struct pending_inhibit {
+  sd_bus_message* m;
+  frontend_t frontend;
+  // Point into m
+  char const* app_name;
+  char const* reason;
+  // What the call resolves to; see bus_context_resolve_inhibit(). These
+  // point into m, the policy or attributed, or are static.
+  char const* what;
+  char const* mode;
+  char const* who;
+  char const* why;
+  char* attributed;
+  // When the call was handed to inhibitman, as per recorder_now()
+  uint64_t started;
+} pending_inhibit_t;
+
+static void pending_inhibit_clear(pending_inhibit_t* call) {
+  free(call->attributed);
+  call->attributed = nullptr;
+}
+
+struct bus_peer {
   char const* name;
   inhibitman_t* im;
-} bus_peer_t;
+  bus_context_t* ctx;
+  // Sender credentials, looked up once when the peer is first seen. While
+  // the lookup is in flight, Inhibit calls are parked in `pending`.
+  sd_bus_slot* creds_slot;
+  pid_t pid;
+  char const* comm;
+  char const* unit;
+  pending_inhibit_t* pending;
+  size_t pending_length;
+  // Parked calls that have been handed to inhibitman_add_batch()
+  pending_inhibit_t* draining;
+  inhibitman_request_t* draining_reqs;
+  size_t draining_length;
+};
+
+static void bus_peer_on_expired(
+  inhibitman_t* im,
+  inhibitman_entry_t const* entry,
+  void* userdata
+);
+
+static int bus_context_resolve_inhibit(
+  bus_context_t* ctx,
+  bus_peer_t* peer,
+  pending_inhibit_t* call
+);
+
+static int bus_context_finish_inhibit(
+  bus_context_t* ctx,
+  bus_peer_t* peer,
+  pending_inhibit_t const* call,
+  int error,
+  uint32_t id
+);
+
+static bool bus_context_get_peer(
+  bus_context_t* ctx,
+  char const* name,
+  bus_peer_t** peer
+);
+static void bus_context_capture_forget(bus_context_t* ctx, char const* peer);
+
+static char* read_comm(pid_t pid) {
+  char path[64];
+  (void)snprintf(path, sizeof(path), "/proc/%d/comm", (int)pid);
+
+  FILE* f = fopen(path, "re");
+  if (f == nullptr) return nullptr;
+
+  char buf[64];
+  char* comm = nullptr;
+  if (fgets(buf, sizeof(buf), f) != nullptr) {
+    buf[strcspn(buf, "\n")] = '\0';
+    comm = strdup(buf);
+  }
+
+  (void)fclose(f);
+  return comm;
+}
+
+static void bus_peer_free_draining(bus_peer_t* peer) {
+  for (size_t i = 0; i < peer->draining_length; i++) {
+    sd_bus_message_unrefp(&peer->draining[i].m);
+    pending_inhibit_clear(&peer->draining[i]);
+  }
+  free(peer->draining);
+  free(peer->draining_reqs);
+  peer->draining = nullptr;
+  peer->draining_reqs = nullptr;
+  peer->draining_length = 0;
+}
+
+static void bus_peer_on_drained(
+  inhibitman_t* im,
+  inhibitman_request_t* reqs,
+  size_t length,
+  void* userdata
+) {
+  (void)im;
+
+  auto peer = (bus_peer_t*)userdata;
+  int r;
+
+  for (size_t i = 0; i < length; i++) {
+    r = bus_context_finish_inhibit(
+      peer->ctx,
+      peer,
+      &peer->draining[i],
+      reqs[i].error,
+      reqs[i].id
+    );
+    if (r < 0) {
+      (void)sd_bus_reply_method_errno(peer->draining[i].m, r, nullptr);
+    }
+  }
+
+  bus_peer_free_draining(peer);
+}
+
+// Everything that piled up while the credentials were being looked up goes
+// to logind in one pipelined batch, rather than one blocking call at a time
+static void bus_peer_drain(bus_peer_t* peer) {
+  int r;
+
+  // Hand the pending list over first: resolving can't add to it anymore,
+  // but it can fail and reply, which must not see a half-drained array.
+  pending_inhibit_t* pending = peer->pending;
+  size_t length = peer->pending_length;
+  peer->pending = nullptr;
+  peer->pending_length = 0;
+
+  if (length == 0) {
+    free(pending);
+    return;
+  }
+
+  inhibitman_request_t* reqs = calloc(length, sizeof(*reqs));
+  uint64_t now = recorder_now();
+
+  size_t n = 0;
+  for (size_t i = 0; i < length; i++) {
+    r = reqs == nullptr
+      ? -ENOMEM
+      : bus_context_resolve_inhibit(peer->ctx, peer, &pending[i]);
+    if (r <= 0) {
+      if (r < 0) {
+        (void)sd_bus_reply_method_errno(pending[i].m, r, nullptr);
+      }
+      sd_bus_message_unrefp(&pending[i].m);
+      pending_inhibit_clear(&pending[i]);
+      continue;
+    }
+
+    pending[n] = pending[i];
+    pending[n].started = now;
+    reqs[n] = (inhibitman_request_t){
+      .what = pending[n].what,
+      .mode = pending[n].mode,
+      .who = pending[n].who,
+      .why = pending[n].why,
+      .app_name = pending[n].app_name,
+      .reason = pending[n].reason,
+      .tag = pending[n].frontend,
+    };
+    n++;
+  }
+
+  assert(peer->draining == nullptr);
+  peer->draining = pending;
+  peer->draining_reqs = reqs;
+  peer->draining_length = n;
+
+  r = inhibitman_add_batch(peer->im, reqs, n, bus_peer_on_drained, peer);
+  if (r < 0) {
+    for (size_t i = 0; i < n; i++) {
+      (void)sd_bus_reply_method_errno(pending[i].m, r, nullptr);
+    }
+    bus_peer_free_draining(peer);
+  }
+}
+
+static int bus_peer_on_creds(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* ret_error
+) {
+  (void)ret_error;
+
+  auto peer = (bus_peer_t*)userdata;
+  int r;
+
+  sd_bus_slot_unrefp(&peer->creds_slot);
+
+  uint32_t pid;
+  r = -sd_bus_message_get_errno(m);
+  if (r == 0) {
+    r = sd_bus_message_read_basic(m, 'u', &pid);
+  }
+
+  if (r < 0) {
+    // Attribution is best-effort; carry on without it
+    fprintf(
+      stderr,
+      SD_WARNING "failed to look up peer credentials: %s\n"
+      SD_WARNING "  name=%s\n",
+      strerror(-r),
+      peer->name
+    );
+  } else {
+    char* unit = nullptr;
+    // Apps launched from a user session live in user units
+    if (sd_pid_get_user_unit((pid_t)pid, &unit) < 0) {
+      (void)sd_pid_get_unit((pid_t)pid, &unit);
+    }
+
+    peer->pid = (pid_t)pid;
+    peer->comm = read_comm((pid_t)pid);
+    peer->unit = unit;
+  }
+
+  bus_peer_drain(peer);
+  return 0;
+}
+
+static int bus_peer_defer_inhibit(
+  bus_peer_t* peer,
+  sd_bus_message* m,
+  frontend_t frontend,
+  char const* what,
+  char const* app_name,
+  char const* reason
+) {
+  void* pending = reallocarray(
+    peer->pending,
+    peer->pending_length + 1,
+    sizeof(*peer->pending)
+  );
+  if (pending == nullptr) return -ENOMEM;
+  peer->pending = pending;
+
+  peer->pending[peer->pending_length++] = (pending_inhibit_t){
+    .m = sd_bus_message_ref(m),
+    .frontend = frontend,
+    .what = what,
+    .app_name = app_name,
+    .reason = reason,
+  };
+  return 0;
+}
 
-static bus_peer_t* bus_peer_create(char const* name, sd_bus* system_bus) {
+static bus_peer_t* bus_peer_create(char const* name, bus_context_t* ctx) {
   assert(name != nullptr);
-  assert(system_bus != nullptr);
+  assert(ctx != nullptr);
 
+  int r;
   bus_peer_t* peer = nullptr;
   inhibitman_t* im = nullptr;
   char* peer_name = nullptr;
@@ -27,7 +495,7 @@ static bus_peer_t* bus_peer_create(char const* name, sd_bus* system_bus) {
   peer = calloc(1, sizeof(*peer));
   if (peer == nullptr) goto fail;
 
-  im = inhibitman_create(system_bus);
+  im = inhibitman_create(ctx->bridge->backend);
   if (im == nullptr) goto fail;
 
   peer_name = strdup(name);
@@ -35,6 +503,32 @@ static bus_peer_t* bus_peer_create(char const* name, sd_bus* system_bus) {
 
   peer->name = peer_name;
   peer->im = im;
+  peer->ctx = ctx;
+  inhibitman_set_expire_cb(im, bus_peer_on_expired, peer);
+  TRACE(peer_create, peer, peer->name);
+
+  // Only the first call from a peer has to wait for this round trip
+  r = sd_bus_call_method_async(
+    ctx->user_bus,
+    &peer->creds_slot,
+    "org.freedesktop.DBus",
+    "/org/freedesktop/DBus",
+    "org.freedesktop.DBus",
+    "GetConnectionUnixProcessID",
+    bus_peer_on_creds,
+    peer,
+    "s",
+    name
+  );
+  if (r < 0) {
+    fprintf(
+      stderr,
+      SD_WARNING "failed to look up peer credentials: %s\n"
+      SD_WARNING "  name=%s\n",
+      strerror(-r),
+      name
+    );
+  }
 
   return peer;
 
@@ -47,22 +541,62 @@ fail:
 
 static void bus_peer_destroy(bus_peer_t* peer) {
   if (peer == nullptr) return;
+  // Probes identify the peer by address, which is gone by the end
+  auto key = (uintptr_t)peer;
+  TRACE(peer_destroy_entry, key, peer->name, inhibitman_count(peer->im));
   fprintf(
     stderr,
     SD_DEBUG "destroying peer\n"
     SD_DEBUG "  name=%s\n",
     peer->name
   );
+  bus_context_capture_forget(peer->ctx, peer->name);
+  sd_bus_slot_unrefp(&peer->creds_slot);
+  for (size_t i = 0; i < peer->pending_length; i++) {
+    // Nobody's left to reply to
+    sd_bus_message_unrefp(&peer->pending[i].m);
+  }
+  free(peer->pending);
+  // Cancels the batch, if any, so draining can't be touched anymore
   inhibitman_destroyp(&peer->im);
+  bus_peer_free_draining(peer);
+  free((void*)peer->comm);
+  free((void*)peer->unit);
   free((void*)peer->name);
   free(peer);
+  TRACE(peer_destroy_return, key);
 }
 DEFINE_POINTER_CLEANUP_FUNC(bus_peer_t, bus_peer_destroy);
 
-typedef struct bus_context {
-  htable_t* peers;
-  sd_bus* system_bus;
-} bus_context_t;
+static uint64_t const RECONNECT_DELAY_MIN = 100 * 1000;
+static uint64_t const RECONNECT_DELAY_MAX = 30 * 1000 * 1000;
+static uint64_t const RETRY_DELAY_MIN = 1000 * 1000;
+static uint64_t const RETRY_DELAY_MAX = 60 * 1000 * 1000;
+static uint64_t const WHEEL_TICK = 1000 * 1000;
+static uint64_t const NOTIFY_DELAY = 10 * 1000;
+static uint64_t const NOTIFY_ACCURACY = 1000;
+static uint64_t const ATTACH_RETRY_DELAY = 1000 * 1000;
+static unsigned const ATTACH_RETRIES_MAX = 30;
+static uint64_t const COMPACT_INTERVAL = 30 * 1000 * 1000;
+static uint64_t const COMPACT_ACCURACY = 5 * 1000 * 1000;
+// Fewer inhibitor changes than this over COMPACT_INTERVAL count as idle
+static uint64_t const COMPACT_IDLE_CHANGES = 30;
+
+// Event sources are dispatched in priority order, so that client requests
+// never queue up behind logind replies, and logind replies never queue up
+// behind bookkeeping:
+// - client: the user bus, where Inhibit/UnInhibit calls come in
+// - logind: the system bus and reconnection
+// - housekeeping: peer cleanup, expiry, change signals, policy reloads. Just
+//   below logind rather than idle, which would wait for as long as clients
+//   keep the bridge busy.
+// - idle: compaction, which is only worth it once clients have calmed down
+enum {
+  PRIORITY_CLIENT = SD_EVENT_PRIORITY_IMPORTANT,
+  PRIORITY_LOGIND = SD_EVENT_PRIORITY_NORMAL,
+  PRIORITY_HOUSEKEEPING = SD_EVENT_PRIORITY_NORMAL + 1,
+  PRIORITY_IDLE = SD_EVENT_PRIORITY_IDLE,
+};
 
 static uint64_t peers_htable_hash(void const* in) {
   uint64_t hash = 0xcbf29ce484222325u;
@@ -102,16 +636,49 @@ static htable_callbacks_t peers_htable_callbacks = {
   .vfree = peers_htable_vfree,
 };
 
-static bus_context_t* bus_context_create(sd_bus* system_bus) {
-  assert(system_bus != nullptr);
+static int bus_context_on_notify(
+  sd_event_source* s,
+  uint64_t usec,
+  void* userdata
+);
+static int bus_context_on_notify_defer(sd_event_source* s, void* userdata);
+static int bus_context_on_cleanup(sd_event_source* s, void* userdata);
+
+static bus_context_t* bus_context_create(
+  bridge_t* bridge,
+  uid_t uid,
+  sd_bus* user_bus
+) {
+  assert(bridge != nullptr);
+  assert(user_bus != nullptr);
+
+  int r;
+  uint64_t now;
 
+  sd_event* event = bridge->event;
+  options_t const* opts = bridge->opts;
   bus_context_t* ctx = nullptr;
   htable_t* ht = nullptr;
-  system_bus = sd_bus_ref(system_bus);
 
   ctx = calloc(1, sizeof(*ctx));
   if (ctx == nullptr) goto fail;
 
+  if (opts->journal_path != nullptr && opts->system) {
+    size_t len = strlen(opts->journal_path) + sizeof("/4294967295.journal");
+    ctx->journal_path = malloc(len);
+    if (ctx->journal_path == nullptr) goto fail;
+    (void)snprintf(
+      ctx->journal_path,
+      len,
+      "%s/%u.journal",
+      opts->journal_path,
+      (unsigned)uid
+    );
+  } else if (opts->journal_path != nullptr) {
+    ctx->journal_path = strdup(opts->journal_path);
+    if (ctx->journal_path == nullptr) goto fail;
+  }
+
   ht = htable_create(
     peers_htable_hash,
     peers_htable_keq,
@@ -119,286 +686,3189 @@ static bus_context_t* bus_context_create(sd_bus* system_bus) {
   );
   if (ht == nullptr) goto fail;
 
+  // Change notifications are coalesced: whatever happens until the loop
+  // runs out of client calls (or for NOTIFY_DELAY, if it doesn't) is
+  // broadcast once.
+  r = sd_event_add_defer(
+    event,
+    &ctx->notify_defer_source,
+    bus_context_on_notify_defer,
+    ctx
+  );
+  if (r < 0) goto fail;
+
+  r = sd_event_source_set_priority(
+    ctx->notify_defer_source,
+    PRIORITY_HOUSEKEEPING
+  );
+  if (r < 0) goto fail;
+
+  r = sd_event_source_set_enabled(ctx->notify_defer_source, SD_EVENT_OFF);
+  if (r < 0) goto fail;
+
+  r = sd_event_add_time_relative(
+    event,
+    &ctx->notify_source,
+    CLOCK_MONOTONIC,
+    NOTIFY_DELAY,
+    NOTIFY_ACCURACY,
+    bus_context_on_notify,
+    ctx
+  );
+  if (r < 0) goto fail;
+
+  // Takes turns with client calls, which would otherwise hold it back for
+  // as long as they keep coming
+  r = sd_event_source_set_priority(ctx->notify_source, PRIORITY_CLIENT);
+  if (r < 0) goto fail;
+
+  r = sd_event_source_set_enabled(ctx->notify_source, SD_EVENT_OFF);
+  if (r < 0) goto fail;
+
+  r = sd_event_add_defer(
+    event,
+    &ctx->cleanup_source,
+    bus_context_on_cleanup,
+    ctx
+  );
+  if (r < 0) goto fail;
+
+  r = sd_event_source_set_priority(
+    ctx->cleanup_source,
+    PRIORITY_HOUSEKEEPING
+  );
+  if (r < 0) goto fail;
+
+  r = sd_event_source_set_enabled(ctx->cleanup_source, SD_EVENT_OFF);
+  if (r < 0) goto fail;
+
+  r = sd_event_now(event, CLOCK_MONOTONIC, &now);
+  if (r < 0) goto fail;
+
+  ctx->wheel = timerwheel_create(WHEEL_TICK, now);
+  if (ctx->wheel == nullptr) goto fail;
+
+  ctx->bridge = bridge;
+  ctx->uid = uid;
+  ctx->retry_delay = RETRY_DELAY_MIN;
   ctx->peers = ht;
-  ctx->system_bus = system_bus;
+  ctx->user_bus = sd_bus_ref(user_bus);
   return ctx;
 
 fail:
+  if (ctx != nullptr) {
+    sd_event_source_disable_unrefp(&ctx->notify_defer_source);
+    sd_event_source_disable_unrefp(&ctx->notify_source);
+    sd_event_source_disable_unrefp(&ctx->cleanup_source);
+    timerwheel_destroyp(&ctx->wheel);
+    free(ctx->journal_path);
+  }
   free(ctx);
   htable_destroyp(&ht);
-  sd_bus_unrefp(&system_bus);
   return nullptr;
 }
 
 static void bus_context_destroy(bus_context_t* ctx) {
   if (ctx == nullptr) return;
+  sd_bus_slot_unrefp(&ctx->attach_slot);
+  for (size_t i = 0; i < _FRONTEND_MAX; i++) {
+    sd_bus_slot_unrefp(&ctx->name_requests[i].slot);
+  }
+  // Destroying the peers cancels any pending recovery
   htable_destroyp(&ctx->peers);
-  sd_bus_unrefp(&ctx->system_bus);
+  free(ctx->ordered_peers);
+  sd_event_source_disable_unrefp(&ctx->retry_source);
+  sd_event_source_disable_unrefp(&ctx->notify_defer_source);
+  sd_event_source_disable_unrefp(&ctx->notify_source);
+  sd_event_source_disable_unrefp(&ctx->cleanup_source);
+  for (size_t i = 0; i < ctx->gone_length; i++) {
+    free(ctx->gone[i]);
+  }
+  free(ctx->gone);
+  sd_event_source_disable_unrefp(&ctx->wheel_source);
+  timerwheel_destroyp(&ctx->wheel);
+  journal_destroyp(&ctx->journal);
+  free(ctx->journal_path);
+  // The vtables and matches registered on the user bus point at us, so the
+  // connection can't outlive the context
+  sd_bus_flush_close_unrefp(&ctx->user_bus);
   free(ctx);
 }
 DEFINE_POINTER_CLEANUP_FUNC(bus_context_t, bus_context_destroy);
 
-static bool bus_context_get_peer(
-  bus_context_t* ctx,
-  char const* name,
-  bus_peer_t** peer
-) {
-  assert(ctx != nullptr);
-  assert(name != nullptr);
+static int bridge_on_reap(sd_event_source* s, void* userdata);
+static int bridge_on_compact(
+  sd_event_source* s,
+  uint64_t usec,
+  void* userdata
+);
 
-  return htable_get(ctx->peers, name, (void**)peer);
+static bridge_t* bridge_create(sd_event* event, options_t const* opts) {
+  assert(event != nullptr);
+  assert(opts != nullptr);
+
+  int r;
+
+  bridge_t* bridge = calloc(1, sizeof(*bridge));
+  if (bridge == nullptr) return nullptr;
+
+  if (strcmp(opts->backend, "null") == 0) {
+    bridge->backend = lock_backend_null_create(
+      event,
+      opts->backend_latency_usec,
+      opts->backend_failure_percent
+    );
+  } else {
+    bridge->backend = lock_backend_logind_create();
+  }
+  if (bridge->backend == nullptr) goto fail;
+
+  r = sd_event_add_defer(event, &bridge->reap_source, bridge_on_reap, bridge);
+  if (r < 0) goto fail;
+
+  r = sd_event_source_set_priority(
+    bridge->reap_source,
+    PRIORITY_HOUSEKEEPING
+  );
+  if (r < 0) goto fail;
+
+  r = sd_event_source_set_enabled(bridge->reap_source, SD_EVENT_OFF);
+  if (r < 0) goto fail;
+
+  r = sd_event_add_time_relative(
+    event,
+    &bridge->compact_source,
+    CLOCK_MONOTONIC,
+    COMPACT_INTERVAL,
+    COMPACT_ACCURACY,
+    bridge_on_compact,
+    bridge
+  );
+  if (r < 0) goto fail;
+
+  r = sd_event_source_set_priority(bridge->compact_source, PRIORITY_IDLE);
+  if (r < 0) goto fail;
+
+  // Armed by the first inhibitor change
+  r = sd_event_source_set_enabled(bridge->compact_source, SD_EVENT_OFF);
+  if (r < 0) goto fail;
+
+  bridge->opts = opts;
+  bridge->event = sd_event_ref(event);
+  bridge->reconnect_delay = RECONNECT_DELAY_MIN;
+  return bridge;
+
+fail:
+  sd_event_source_disable_unrefp(&bridge->reap_source);
+  sd_event_source_disable_unrefp(&bridge->compact_source);
+  lock_backend_destroyp(&bridge->backend);
+  free(bridge);
+  return nullptr;
 }
 
-static int bus_context_get_or_create_peer(
-  bus_context_t* ctx,
-  char const* name,
-  bus_peer_t** peer
-) {
+static void bridge_destroy(bridge_t* bridge) {
+  if (bridge == nullptr) return;
+  for (size_t i = 0; i < bridge->contexts_length; i++) {
+    bus_context_destroy(bridge->contexts[i]);
+  }
+  free(bridge->contexts);
+  sd_event_source_disable_unrefp(&bridge->reconnect_source);
+  sd_event_source_disable_unrefp(&bridge->sighup_source);
+  sd_event_source_disable_unrefp(&bridge->sigusr1_source);
+  sd_event_source_disable_unrefp(&bridge->attach_source);
+  sd_event_source_disable_unrefp(&bridge->reap_source);
+  sd_event_source_disable_unrefp(&bridge->compact_source);
+  policy_destroyp(&bridge->policy);
+  capture_closep(&bridge->capture);
+  lock_backend_destroyp(&bridge->backend);
+  sd_bus_flush_close_unrefp(&bridge->system_bus);
+  sd_event_unrefp(&bridge->event);
+  free(bridge);
+}
+DEFINE_POINTER_CLEANUP_FUNC(bridge_t, bridge_destroy);
+
+// Resident set size in KiB, or 0 if unknown
+static size_t rss_kib(void) {
+  FILE* f = fopen("/proc/self/statm", "re");
+  if (f == nullptr) return 0;
+
+  unsigned long pages;
+  int n = fscanf(f, "%*s %lu", &pages);
+  (void)fclose(f);
+  if (n != 1) return 0;
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (page_size <= 0) return 0;
+
+  return pages * (size_t)page_size / 1024;
+}
+
+static void bus_context_compact(bus_context_t* ctx) {
   assert(ctx != nullptr);
-  assert(name != nullptr);
-  assert(peer != nullptr);
 
-  if (!htable_get(ctx->peers, name, (void**)peer)) {
-    *peer = bus_peer_create(name, ctx->system_bus);
-    if (*peer == nullptr) {
-      return -ENOMEM;
+  _cleanup_(htable_enum_destroyp)
+  htable_enum_t* he = htable_enum_create(ctx->peers);
+  if (he != nullptr) {
+    bus_peer_t* peer;
+    while (htable_enum_next(he, nullptr, (void**)&peer)) {
+      inhibitman_compact(peer->im);
     }
+  }
+
+  htable_compact(ctx->peers);
+
+  if (ctx->ordered_peers_length == 0) {
+    free(ctx->ordered_peers);
+    ctx->ordered_peers = nullptr;
+    ctx->ordered_peers_capacity = 0;
+  } else if (ctx->ordered_peers_length < ctx->ordered_peers_capacity) {
+    void* peers = reallocarray(
+      ctx->ordered_peers,
+      ctx->ordered_peers_length,
+      sizeof(*ctx->ordered_peers)
+    );
+    // Keeping the larger array is just as good
+    if (peers != nullptr) {
+      ctx->ordered_peers = peers;
+      ctx->ordered_peers_capacity = ctx->ordered_peers_length;
+    }
+  }
+}
+
+// Neither the heap nor the tables ever shrink on their own, so a burst of
+// inhibitors would otherwise leave RSS at its peak for good. Compaction waits
+// for a quiet COMPACT_INTERVAL, since it's wasted work while the burst is
+// still going on.
+static int bridge_on_compact(
+  sd_event_source* s,
+  uint64_t usec,
+  void* userdata
+) {
+  (void)usec;
+
+  auto bridge = (bridge_t*)userdata;
+  int r;
+
+  if (bridge->compact_changes >= COMPACT_IDLE_CHANGES) {
+    bridge->compact_changes = 0;
+    r = sd_event_source_set_time_relative(s, COMPACT_INTERVAL);
+    if (r < 0) return r;
+    return sd_event_source_set_enabled(s, SD_EVENT_ONESHOT);
+  }
+  bridge->compact_changes = 0;
+
+  size_t before = rss_kib();
 
-    htable_insert(ctx->peers, (void*)name, *peer);
+  size_t peers = 0;
+  size_t buckets = 0;
+  for (size_t i = 0; i < bridge->contexts_length; i++) {
+    bus_context_compact(bridge->contexts[i]);
+    peers += htable_count(bridge->contexts[i]->peers);
+    buckets += htable_capacity(bridge->contexts[i]->peers);
   }
+#ifdef __GLIBC__
+  (void)malloc_trim(0);
+#endif
+
+  // scripts/footprint.sh reads this
+  fprintf(
+    stderr,
+    SD_INFO "compacted state\n"
+    SD_INFO "  rss_before_kib=%zu\n"
+    SD_INFO "  rss_after_kib=%zu\n"
+    SD_INFO "  peers=%zu\n"
+    SD_INFO "  peer_buckets=%zu\n",
+    before,
+    rss_kib(),
+    peers,
+    buckets
+  );
 
+  // Stays off until the next change
   return 0;
 }
 
-static bool bus_context_remove_peer(
-  bus_context_t* ctx,
-  char const* name
-) {
+static void bridge_add_changes(bridge_t* bridge, uint32_t changes) {
+  bridge->compact_changes += changes;
+
+  int enabled;
+  if (sd_event_source_get_enabled(bridge->compact_source, &enabled) < 0) {
+    return;
+  }
+  if (enabled != SD_EVENT_OFF) return;
+
+  (void)sd_event_source_set_time_relative(
+    bridge->compact_source,
+    COMPACT_INTERVAL
+  );
+  (void)sd_event_source_set_enabled(bridge->compact_source, SD_EVENT_ONESHOT);
+}
+
+static void bus_context_add_count(bus_context_t* ctx, int64_t delta) {
   assert(ctx != nullptr);
-  assert(name != nullptr);
+  assert((int64_t)ctx->inhibitor_count + delta >= 0);
 
-  bus_peer_t* peer;
-  if (htable_remove(ctx->peers, name, (void**)&peer)) {
-    if (inhibitman_active(peer->im)) {
-      fprintf(
+  ctx->inhibitor_count += delta;
+  if (ctx->pending_changes++ > 0) return;
+
+  (void)sd_event_source_set_enabled(
+    ctx->notify_defer_source,
+    SD_EVENT_ONESHOT
+  );
+  (void)sd_event_source_set_time_relative(ctx->notify_source, NOTIFY_DELAY);
+  (void)sd_event_source_set_enabled(ctx->notify_source, SD_EVENT_ONESHOT);
+}
+
+static void bus_context_journal(
+  bus_context_t* ctx,
+  journal_entry_t const* entry
+) {
+  if (ctx->journal == nullptr) return;
+
+  int r = journal_append(ctx->journal, entry);
+  if (r < 0) {
+    fprintf(
+      stderr,
+      SD_WARNING "failed to write state journal: %s\n"
+      SD_WARNING "  name=%s\n",
+      strerror(-r),
+      entry->peer
+    );
+  }
+}
+
+static void bus_context_journal_add(
+  bus_context_t* ctx,
+  bus_peer_t* peer,
+  uint32_t id
+) {
+  inhibitman_entry_t entry;
+  if (!inhibitman_lookup(peer->im, id, &entry)) return;
+
+  bus_context_journal(ctx, &(journal_entry_t){
+    .op = JOURNAL_OP_ADD,
+    .peer = peer->name,
+    .id = entry.id,
+    .tag = entry.tag,
+    .created = entry.created,
+    .deadline = entry.deadline,
+    .what = entry.what,
+    .mode = entry.mode,
+    .who = entry.who,
+    .why = entry.why,
+    .app_name = entry.app_name,
+    .reason = entry.reason,
+  });
+}
+
+static void bus_context_capture(
+  bus_context_t* ctx,
+  char const* peer,
+  capture_record_t* record
+) {
+  bridge_t* bridge = ctx->bridge;
+  if (bridge->capture == nullptr) return;
+
+  int r = capture_write(bridge->capture, ctx->uid, peer, record);
+  if (r < 0) {
+    fprintf(
+      stderr,
+      SD_WARNING "failed to write capture, stopping: %s\n"
+      SD_WARNING "  path=%s\n",
+      strerror(-r),
+      bridge->opts->capture_path
+    );
+    capture_closep(&bridge->capture);
+    return;
+  }
+
+  // Peers keep their number for as long as the bridge knows them (see
+  // bus_peer_destroy()); calls from anyone else are one-offs. Inhibit calls
+  // are captured before their peer is created.
+  if (
+    record->op != CAPTURE_INHIBIT
+    && !bus_context_get_peer(ctx, peer, nullptr)
+  ) {
+    bus_context_capture_forget(ctx, peer);
+  }
+}
+
+static void bus_context_capture_forget(bus_context_t* ctx, char const* peer) {
+  capture_t* capture = ctx->bridge->capture;
+  if (capture == nullptr) return;
+
+  capture_forget_peer(capture, ctx->uid, peer);
+}
+
+static void bus_context_capture_inhibit(
+  bus_context_t* ctx,
+  sd_bus_message* m,
+  frontend_t frontend,
+  char const* app_name,
+  char const* reason,
+  uint32_t flags
+) {
+  if (ctx->bridge->capture == nullptr) return;
+
+  uint64_t serial = 0;
+  (void)sd_bus_message_get_cookie(m, &serial);
+
+  bus_context_capture(ctx, sd_bus_message_get_sender(m), &(capture_record_t){
+    .op = CAPTURE_INHIBIT,
+    .frontend = (uint8_t)frontend,
+    .serial = (uint32_t)serial,
+    .app_name = app_name,
+    .reason = reason,
+    .flags = flags,
+  });
+}
+
+static int bus_context_on_wheel(
+  sd_event_source* s,
+  uint64_t usec,
+  void* userdata
+);
+
+static int bus_context_arm_wheel(bus_context_t* ctx) {
+  assert(ctx != nullptr);
+
+  int r;
+  uint64_t deadline;
+
+  if (!timerwheel_next(ctx->wheel, &deadline)) {
+    if (ctx->wheel_source == nullptr) return 0;
+    return sd_event_source_set_enabled(ctx->wheel_source, SD_EVENT_OFF);
+  }
+
+  if (ctx->wheel_source == nullptr) {
+    r = sd_event_add_time(
+      ctx->bridge->event,
+      &ctx->wheel_source,
+      CLOCK_MONOTONIC,
+      deadline,
+      WHEEL_TICK,
+      bus_context_on_wheel,
+      ctx
+    );
+    if (r < 0) return r;
+
+    return sd_event_source_set_priority(
+      ctx->wheel_source,
+      PRIORITY_HOUSEKEEPING
+    );
+  }
+
+  r = sd_event_source_set_time(ctx->wheel_source, deadline);
+  if (r < 0) return r;
+
+  return sd_event_source_set_enabled(ctx->wheel_source, SD_EVENT_ONESHOT);
+}
+
+// A single time source drives every inhibitor deadline; it is only ever
+// armed for the earliest one.
+static int bus_context_on_wheel(
+  sd_event_source* s,
+  uint64_t usec,
+  void* userdata
+) {
+  (void)s;
+
+  auto ctx = (bus_context_t*)userdata;
+
+  uint64_t now;
+  if (sd_event_now(ctx->bridge->event, CLOCK_MONOTONIC, &now) < 0) {
+    now = usec;
+  }
+
+  timerwheel_advance(ctx->wheel, now);
+  return bus_context_arm_wheel(ctx);
+}
+
+static void bus_peer_on_expired(
+  inhibitman_t* im,
+  inhibitman_entry_t const* entry,
+  void* userdata
+) {
+  (void)im;
+
+  auto peer = (bus_peer_t*)userdata;
+
+  fprintf(
+    stderr,
+    SD_INFO "inhibitor expired\n"
+    SD_INFO "  name=%s\n"
+    SD_INFO "  app_name=%s\n"
+    SD_INFO "  reason=%s\n"
+    SD_INFO "  cookie=%u\n",
+    peer->name,
+    entry->app_name,
+    entry->reason,
+    entry->id
+  );
+
+  bus_context_add_count(peer->ctx, -1);
+
+  // This runs right before the inhibitor is dropped, so a compaction
+  // triggered here can still carry it over; it would expire again as soon
+  // as it's restored.
+  bus_context_journal(peer->ctx, &(journal_entry_t){
+    .op = JOURNAL_OP_REMOVE,
+    .peer = peer->name,
+    .id = entry->id,
+    .tag = entry->tag,
+  });
+}
+
+// Position of the first peer in ordered_peers whose name doesn't sort before
+// name
+static size_t bus_context_peer_rank(bus_context_t* ctx, char const* name) {
+  size_t lo = 0;
+  size_t hi = ctx->ordered_peers_length;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (strcmp(ctx->ordered_peers[mid]->name, name) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static int bus_context_order_peer(bus_context_t* ctx, bus_peer_t* peer) {
+  if (ctx->ordered_peers_length == ctx->ordered_peers_capacity) {
+    size_t capacity = ctx->ordered_peers_capacity > 0
+      ? ctx->ordered_peers_capacity * 2
+      : 16;
+    void* peers = reallocarray(
+      ctx->ordered_peers,
+      capacity,
+      sizeof(*ctx->ordered_peers)
+    );
+    if (peers == nullptr) return -ENOMEM;
+    ctx->ordered_peers = peers;
+    ctx->ordered_peers_capacity = capacity;
+  }
+
+  size_t i = bus_context_peer_rank(ctx, peer->name);
+  memmove(
+    &ctx->ordered_peers[i + 1],
+    &ctx->ordered_peers[i],
+    (ctx->ordered_peers_length - i) * sizeof(*ctx->ordered_peers)
+  );
+  ctx->ordered_peers[i] = peer;
+  ctx->ordered_peers_length++;
+  return 0;
+}
+
+static void bus_context_unorder_peer(bus_context_t* ctx, bus_peer_t* peer) {
+  size_t i = bus_context_peer_rank(ctx, peer->name);
+  assert(i < ctx->ordered_peers_length && ctx->ordered_peers[i] == peer);
+
+  ctx->ordered_peers_length--;
+  memmove(
+    &ctx->ordered_peers[i],
+    &ctx->ordered_peers[i + 1],
+    (ctx->ordered_peers_length - i) * sizeof(*ctx->ordered_peers)
+  );
+}
+
+static bool bus_context_get_peer(
+  bus_context_t* ctx,
+  char const* name,
+  bus_peer_t** peer
+) {
+  assert(ctx != nullptr);
+  assert(name != nullptr);
+
+  return htable_get(ctx->peers, name, (void**)peer);
+}
+
+static int bus_context_get_or_create_peer(
+  bus_context_t* ctx,
+  char const* name,
+  bus_peer_t** peer
+) {
+  assert(ctx != nullptr);
+  assert(name != nullptr);
+  assert(peer != nullptr);
+
+  if (!htable_get(ctx->peers, name, (void**)peer)) {
+    if (!lock_backend_healthy(ctx->bridge->backend)) {
+      // Still waiting to reconnect
+      return -ENOTCONN;
+    }
+
+    *peer = bus_peer_create(name, ctx);
+    if (*peer == nullptr) {
+      return -ENOMEM;
+    }
+
+    if (bus_context_order_peer(ctx, *peer) < 0) {
+      bus_peer_destroyp(peer);
+      return -ENOMEM;
+    }
+
+    if (!htable_insert(ctx->peers, (void*)name, *peer)) {
+      bus_context_unorder_peer(ctx, *peer);
+      bus_peer_destroyp(peer);
+      return -ENOMEM;
+    }
+  }
+
+  return 0;
+}
+
+static bool bus_context_remove_peer(
+  bus_context_t* ctx,
+  char const* name
+) {
+  assert(ctx != nullptr);
+  assert(name != nullptr);
+
+  bus_peer_t* peer;
+  if (htable_remove(ctx->peers, name, (void**)&peer)) {
+    bus_context_unorder_peer(ctx, peer);
+    size_t count = inhibitman_count(peer->im);
+    recorder_record(
+      RECORDER_PEER_GONE,
+      ctx->uid,
+      name,
+      0,
+      0,
+      count < INT32_MAX ? (int32_t)count : INT32_MAX
+    );
+    if (count > 0) {
+      bus_context_add_count(ctx, -(int64_t)count);
+      fprintf(
         stderr,
         SD_DEBUG "cleaning up lingering inhibitors\n"
         SD_DEBUG "  name=%s\n",
         name
       );
     }
-    bus_peer_destroyp(&peer);
-    return true;
+    bus_peer_destroyp(&peer);
+    bus_context_journal(ctx, &(journal_entry_t){
+      .op = JOURNAL_OP_PEER_GONE,
+      .peer = name,
+    });
+    return true;
+  }
+
+  return false;
+}
+
+// Unique names are never reused, so a peer that left can't come back
+// before its cleanup runs
+static int bus_context_queue_remove_peer(
+  bus_context_t* ctx,
+  char const* name
+) {
+  void* gone = reallocarray(
+    ctx->gone,
+    ctx->gone_length + 1,
+    sizeof(*ctx->gone)
+  );
+  if (gone == nullptr) return -ENOMEM;
+  ctx->gone = gone;
+
+  char* copy = strdup(name);
+  if (copy == nullptr) return -ENOMEM;
+
+  ctx->gone[ctx->gone_length++] = copy;
+  return sd_event_source_set_enabled(ctx->cleanup_source, SD_EVENT_ONESHOT);
+}
+
+static int bus_context_on_cleanup(sd_event_source* s, void* userdata) {
+  (void)s;
+
+  auto ctx = (bus_context_t*)userdata;
+
+  for (size_t i = 0; i < ctx->gone_length; i++) {
+    (void)bus_context_remove_peer(ctx, ctx->gone[i]);
+    free(ctx->gone[i]);
+  }
+
+  free(ctx->gone);
+  ctx->gone = nullptr;
+  ctx->gone_length = 0;
+  return 0;
+}
+
+static int bus_context_start_recovery(bus_context_t* ctx, bool retry);
+
+static int bus_context_on_retry(
+  sd_event_source* s,
+  uint64_t usec,
+  void* userdata
+) {
+  (void)s;
+  (void)usec;
+
+  auto ctx = (bus_context_t*)userdata;
+
+  // Everything gets re-acquired once logind is back anyway
+  if (!lock_backend_healthy(ctx->bridge->backend)) return 0;
+
+  return bus_context_start_recovery(ctx, true);
+}
+
+static int bus_context_schedule_retry(bus_context_t* ctx) {
+  assert(ctx != nullptr);
+
+  int r;
+
+  if (ctx->retry_source == nullptr) {
+    r = sd_event_add_time_relative(
+      ctx->bridge->event,
+      &ctx->retry_source,
+      CLOCK_MONOTONIC,
+      ctx->retry_delay,
+      0,
+      bus_context_on_retry,
+      ctx
+    );
+    if (r < 0) return r;
+
+    r = sd_event_source_set_priority(ctx->retry_source, PRIORITY_LOGIND);
+  } else {
+    r = sd_event_source_set_time_relative(ctx->retry_source, ctx->retry_delay);
+    if (r < 0) return r;
+
+    r = sd_event_source_set_enabled(ctx->retry_source, SD_EVENT_ONESHOT);
+  }
+  if (r < 0) return r;
+
+  ctx->retry_delay *= 2;
+  if (ctx->retry_delay > RETRY_DELAY_MAX) {
+    ctx->retry_delay = RETRY_DELAY_MAX;
+  }
+  return 0;
+}
+
+static void bus_context_on_recovered(
+  size_t acquired,
+  size_t failed,
+  void* userdata
+) {
+  auto ctx = (bus_context_t*)userdata;
+  int r;
+
+  ctx->recovery = nullptr;
+
+  uint64_t now;
+  if (sd_event_now(ctx->bridge->event, CLOCK_MONOTONIC, &now) < 0) {
+    now = ctx->recovery_start;
+  }
+
+  ctx->recoveries++;
+  ctx->last_recovery_usec = now - ctx->recovery_start;
+  if (failed > UINT32_MAX - ctx->recovery_failures) {
+    ctx->recovery_failures = UINT32_MAX;
+  } else {
+    ctx->recovery_failures += (uint32_t)failed;
+  }
+
+  fprintf(
+    stderr,
+    SD_INFO "re-acquired inhibitors\n"
+    SD_INFO "  acquired=%zu\n"
+    SD_INFO "  failed=%zu\n"
+    SD_INFO "  duration_usec=%" PRIu64 "\n",
+    acquired,
+    failed,
+    ctx->last_recovery_usec
+  );
+
+  if (failed == 0) {
+    ctx->retry_delay = RETRY_DELAY_MIN;
+    return;
+  }
+
+  if (ctx->closing) return;
+
+  fprintf(
+    stderr,
+    SD_WARNING "retrying failed inhibitors\n"
+    SD_WARNING "  retry_usec=%" PRIu64 "\n",
+    ctx->retry_delay
+  );
+  r = bus_context_schedule_retry(ctx);
+  if (r < 0) {
+    fprintf(
+      stderr,
+      SD_ERR "failed to schedule retry: %s\n",
+      strerror(-r)
+    );
+  }
+}
+
+// With retry set, only the locks that are held by nobody are taken again
+static int bus_context_start_recovery(bus_context_t* ctx, bool retry) {
+  assert(ctx != nullptr);
+  assert(lock_backend_healthy(ctx->bridge->backend));
+
+  int r;
+
+  _cleanup_(htable_enum_destroyp)
+  htable_enum_t* he = htable_enum_create(ctx->peers);
+  if (he == nullptr) return -ENOMEM;
+
+  // A recovery that is still in flight gets superseded: the inhibitors it
+  // was waiting on are re-issued below, which completes it early.
+  inhibitman_recovery_t* rec = inhibitman_recovery_create(
+    bus_context_on_recovered,
+    ctx
+  );
+  if (rec == nullptr) return -ENOMEM;
+
+  ctx->recovery = rec;
+  r = sd_event_now(ctx->bridge->event, CLOCK_MONOTONIC, &ctx->recovery_start);
+  if (r < 0) {
+    ctx->recovery_start = 0;
+  }
+
+  bus_peer_t* peer;
+  while (htable_enum_next(he, nullptr, (void**)&peer)) {
+    if (retry) {
+      (void)inhibitman_retry(peer->im, rec);
+    } else {
+      (void)inhibitman_reacquire(peer->im, rec);
+    }
+  }
+
+  inhibitman_recovery_seal(rec);
+  return 0;
+}
+
+static int bus_context_recover(bus_context_t* ctx) {
+  assert(ctx != nullptr);
+
+  // Whatever was waiting for a retry is taken again right away
+  if (ctx->retry_source != nullptr) {
+    (void)sd_event_source_set_enabled(ctx->retry_source, SD_EVENT_OFF);
+  }
+  ctx->retry_delay = RETRY_DELAY_MIN;
+
+  return bus_context_start_recovery(ctx, false);
+}
+
+static int bridge_recover(bridge_t* bridge) {
+  assert(bridge != nullptr);
+
+  int r;
+
+  for (size_t i = 0; i < bridge->contexts_length; i++) {
+    bus_context_t* ctx = bridge->contexts[i];
+    if (ctx->closing) continue;
+
+    r = bus_context_recover(ctx);
+    if (r < 0) return r;
+  }
+
+  return 0;
+}
+
+static int bridge_sync_users(bridge_t* bridge);
+static int bridge_connect_system(bridge_t* bridge);
+
+static int bridge_on_reconnect(
+  sd_event_source* s,
+  uint64_t usec,
+  void* userdata
+) {
+  (void)s;
+  (void)usec;
+
+  auto bridge = (bridge_t*)userdata;
+  int r;
+
+  r = bridge_connect_system(bridge);
+  if (r < 0) {
+    fprintf(
+      stderr,
+      SD_WARNING "failed to reconnect to system bus: %s\n"
+      SD_WARNING "  retry_usec=%" PRIu64 "\n",
+      strerror(-r),
+      bridge->reconnect_delay
+    );
+
+    r = sd_event_source_set_time_relative(s, bridge->reconnect_delay);
+    if (r < 0) return r;
+
+    bridge->reconnect_delay *= 2;
+    if (bridge->reconnect_delay > RECONNECT_DELAY_MAX) {
+      bridge->reconnect_delay = RECONNECT_DELAY_MAX;
+    }
+
+    return sd_event_source_set_enabled(s, SD_EVENT_ONESHOT);
+  }
+
+  bridge->reconnect_delay = RECONNECT_DELAY_MIN;
+  fprintf(stderr, SD_INFO "reconnected to system bus\n");
+
+  r = bridge_recover(bridge);
+  if (r < 0) return r;
+
+  // Sessions may have come and gone while we weren't listening
+  if (bridge->opts->system) {
+    return bridge_sync_users(bridge);
+  }
+
+  return 0;
+}
+
+static int bridge_schedule_reconnect(bridge_t* bridge) {
+  assert(bridge != nullptr);
+
+  int r;
+
+  if (bridge->reconnect_source == nullptr) {
+    r = sd_event_add_time_relative(
+      bridge->event,
+      &bridge->reconnect_source,
+      CLOCK_MONOTONIC,
+      bridge->reconnect_delay,
+      0,
+      bridge_on_reconnect,
+      bridge
+    );
+    if (r < 0) return r;
+
+    return sd_event_source_set_priority(
+      bridge->reconnect_source,
+      PRIORITY_LOGIND
+    );
+  }
+
+  r = sd_event_source_set_time_relative(
+    bridge->reconnect_source,
+    bridge->reconnect_delay
+  );
+  if (r < 0) return r;
+
+  return sd_event_source_set_enabled(
+    bridge->reconnect_source,
+    SD_EVENT_ONESHOT
+  );
+}
+
+static int system_bus_on_disconnected(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* ret_error
+) {
+  (void)m;
+  (void)ret_error;
+
+  auto bridge = (bridge_t*)userdata;
+
+  fprintf(stderr, SD_WARNING "lost connection to system bus\n");
+
+  // Calls still in flight hang on to the old connection until they're
+  // cancelled; it's closed for good once the last reference goes away.
+  lock_backend_logind_set_bus(bridge->backend, nullptr);
+  sd_bus_unrefp(&bridge->system_bus);
+
+  return bridge_schedule_reconnect(bridge);
+}
+
+static int system_bus_on_logind_owner_changed(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* ret_error
+) {
+  (void)ret_error;
+
+  int r;
+  auto bridge = (bridge_t*)userdata;
+
+  char* name;
+  char* old_owner;
+  char* new_owner;
+
+  r = sd_bus_message_read(m, "sss", &name, &old_owner, &new_owner);
+  if (r < 0) return r;
+
+  if (strcmp(new_owner, "") == 0) {
+    // Our fds are useless now, but there's nothing to re-acquire them from
+    // until logind comes back.
+    fprintf(stderr, SD_WARNING "logind disappeared from the system bus\n");
+    return 0;
+  }
+
+  fprintf(
+    stderr,
+    SD_INFO "logind (re)appeared on the system bus\n"
+    SD_INFO "  owner=%s\n",
+    new_owner
+  );
+
+  r = bridge_recover(bridge);
+  if (r < 0) return r;
+
+  if (bridge->opts->system) {
+    return bridge_sync_users(bridge);
+  }
+
+  return 0;
+}
+
+// SessionNew/SessionRemoved only serve as a hint that the set of logged-in
+// users may have changed; the actual list comes from sd_get_uids()
+static int system_bus_on_session_changed(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* ret_error
+) {
+  (void)m;
+  (void)ret_error;
+
+  auto bridge = (bridge_t*)userdata;
+
+  bridge->attach_retries = 0;
+  return bridge_sync_users(bridge);
+}
+
+static int bridge_connect_system(bridge_t* bridge) {
+  assert(bridge != nullptr);
+
+  int r;
+
+  _cleanup_(sd_bus_flush_close_unrefp)
+  sd_bus* system_bus = nullptr;
+
+  r = sd_bus_open_system(&system_bus);
+  if (r < 0) return r;
+
+  r = sd_bus_attach_event(system_bus, bridge->event, PRIORITY_LOGIND);
+  if (r < 0) return r;
+
+  r = sd_bus_match_signal(
+    system_bus,
+    nullptr,
+    nullptr,
+    "/org/freedesktop/DBus/Local",
+    "org.freedesktop.DBus.Local",
+    "Disconnected",
+    system_bus_on_disconnected,
+    bridge
+  );
+  if (r < 0) return r;
+
+  r = sd_bus_add_match(
+    system_bus,
+    nullptr,
+    "type='signal',"
+    "sender='org.freedesktop.DBus',"
+    "path='/org/freedesktop/DBus',"
+    "interface='org.freedesktop.DBus',"
+    "member='NameOwnerChanged',"
+    "arg0='org.freedesktop.login1'",
+    system_bus_on_logind_owner_changed,
+    bridge
+  );
+  if (r < 0) return r;
+
+  if (bridge->opts->system) {
+    static char const* const members[] = {"SessionNew", "SessionRemoved"};
+    for (size_t i = 0; i < sizeof(members) / sizeof(*members); i++) {
+      r = sd_bus_match_signal(
+        system_bus,
+        nullptr,
+        "org.freedesktop.login1",
+        "/org/freedesktop/login1",
+        "org.freedesktop.login1.Manager",
+        members[i],
+        system_bus_on_session_changed,
+        bridge
+      );
+      if (r < 0) return r;
+    }
+  }
+
+  sd_bus_flush_close_unrefp(&bridge->system_bus);
+  bridge->system_bus = system_bus;
+  system_bus = nullptr;
+  lock_backend_logind_set_bus(bridge->backend, bridge->system_bus);
+
+  return 0;
+}
+
+static int bus_context_snapshot(journal_t* j, void* userdata) {
+  auto ctx = (bus_context_t*)userdata;
+  int r;
+
+  _cleanup_(htable_enum_destroyp)
+  htable_enum_t* he = htable_enum_create(ctx->peers);
+  if (he == nullptr) return -ENOMEM;
+
+  bus_peer_t* peer;
+  while (htable_enum_next(he, nullptr, (void**)&peer)) {
+    size_t pos = 0;
+    inhibitman_entry_t entry;
+    while (inhibitman_next(peer->im, &pos, &entry)) {
+      r = journal_append(j, &(journal_entry_t){
+        .op = JOURNAL_OP_ADD,
+        .peer = peer->name,
+        .id = entry.id,
+        .tag = entry.tag,
+        .created = entry.created,
+        .deadline = entry.deadline,
+        .what = entry.what,
+        .mode = entry.mode,
+        .who = entry.who,
+        .why = entry.why,
+        .app_name = entry.app_name,
+        .reason = entry.reason,
+      });
+      if (r < 0) return r;
+    }
+  }
+
+  return 0;
+}
+
+static int bus_context_on_journal_entry(
+  journal_entry_t const* entry,
+  void* userdata
+) {
+  auto ctx = (bus_context_t*)userdata;
+  int r;
+
+  bus_peer_t* peer;
+  switch (entry->op) {
+    case JOURNAL_OP_ADD: {
+      if (entry->truncated) {
+        fprintf(
+          stderr,
+          SD_WARNING "restoring inhibitor with strings cut short\n"
+          SD_WARNING "  name=%s\n"
+          SD_WARNING "  cookie=%u\n"
+          SD_WARNING "  what=%s\n"
+          SD_WARNING "  who=%s\n",
+          entry->peer,
+          entry->id,
+          entry->what,
+          entry->who
+        );
+      }
+
+      r = bus_context_get_or_create_peer(ctx, entry->peer, &peer);
+      if (r < 0) return r;
+
+      r = inhibitman_restore(peer->im, &(inhibitman_entry_t){
+        .id = entry->id,
+        .tag = entry->tag,
+        .what = entry->what,
+        .mode = entry->mode,
+        .who = entry->who,
+        .why = entry->why,
+        .app_name = entry->app_name,
+        .reason = entry->reason,
+        .created = entry->created,
+      });
+      if (r < 0) {
+        fprintf(
+          stderr,
+          SD_WARNING "failed to restore inhibitor: %s\n"
+          SD_WARNING "  name=%s\n"
+          SD_WARNING "  cookie=%u\n",
+          strerror(-r),
+          entry->peer,
+          entry->id
+        );
+        return 0;
+      }
+
+      bus_context_add_count(ctx, 1);
+      if (entry->deadline > 0) {
+        (void)inhibitman_set_deadline(
+          peer->im,
+          entry->id,
+          ctx->wheel,
+          entry->deadline
+        );
+      }
+      break;
+    }
+    case JOURNAL_OP_REMOVE: {
+      if (
+        bus_context_get_peer(ctx, entry->peer, &peer)
+        && inhibitman_remove(peer->im, entry->id, entry->tag)
+      ) {
+        bus_context_add_count(ctx, -1);
+      }
+      break;
+    }
+    case JOURNAL_OP_PEER_GONE: {
+      (void)bus_context_remove_peer(ctx, entry->peer);
+      break;
+    }
+  }
+
+  return 0;
+}
+
+static int bus_name_cmp(void const* a, void const* b) {
+  return strcmp(*(char const* const*)a, *(char const* const*)b);
+}
+
+// Drops restored peers that left the bus while we weren't watching, i.e.
+// aren't among names (as returned by ListNames), or all of them if there are
+// no names to go by: the bus itself is a different one
+static int bus_context_prune_peers(
+  bus_context_t* ctx,
+  sd_bus_message* names,
+  size_t* pruned
+) {
+  int r;
+  char const** owners = nullptr;
+  size_t owners_length = 0;
+  char** gone = nullptr;
+  size_t gone_length = 0;
+  _cleanup_(htable_enum_destroyp) htable_enum_t* he = nullptr;
+
+  if (names != nullptr) {
+    r = sd_bus_message_enter_container(names, 'a', "s");
+    if (r < 0) return r;
+
+    char const* name;
+    while ((r = sd_bus_message_read_basic(names, 's', &name)) > 0) {
+      void* new_owners = reallocarray(
+        owners,
+        owners_length + 1,
+        sizeof(*owners)
+      );
+      if (new_owners == nullptr) {
+        r = -ENOMEM;
+        goto out;
+      }
+      owners = new_owners;
+      owners[owners_length++] = name;
+    }
+    if (r < 0) goto out;
+
+    qsort(owners, owners_length, sizeof(*owners), bus_name_cmp);
+  }
+
+  he = htable_enum_create(ctx->peers);
+  if (he == nullptr) {
+    r = -ENOMEM;
+    goto out;
+  }
+
+  void const* name;
+  while (htable_enum_next(he, &name, nullptr)) {
+    if (
+      names != nullptr
+      && bsearch(
+        &name,
+        owners,
+        owners_length,
+        sizeof(*owners),
+        bus_name_cmp
+      ) != nullptr
+    ) {
+      continue;
+    }
+
+    void* new_gone = reallocarray(gone, gone_length + 1, sizeof(*gone));
+    if (new_gone == nullptr) {
+      r = -ENOMEM;
+      goto out;
+    }
+    gone = new_gone;
+
+    gone[gone_length] = strdup(name);
+    if (gone[gone_length] == nullptr) {
+      r = -ENOMEM;
+      goto out;
+    }
+    gone_length++;
+  }
+
+  // Not while enumerating
+  for (size_t i = 0; i < gone_length; i++) {
+    (void)bus_context_remove_peer(ctx, gone[i]);
+  }
+
+  *pruned = gone_length;
+  r = 0;
+
+out:
+  for (size_t i = 0; i < gone_length; i++) {
+    free(gone[i]);
+  }
+  free(gone);
+  free(owners);
+  return r;
+}
+
+static int bus_context_publish(bus_context_t* ctx);
+
+// Gives up on the user bus, once the reason has been logged: the whole
+// process in user mode, or just the context with --system
+static void bus_context_fail_attach(bus_context_t* ctx, int r) {
+  if (!ctx->bridge->opts->system) {
+    (void)sd_event_exit(ctx->bridge->event, r);
+    return;
+  }
+
+  ctx->closing = true;
+  (void)sd_event_source_set_enabled(
+    ctx->bridge->reap_source,
+    SD_EVENT_ONESHOT
+  );
+}
+
+static void bus_context_fail_restore(bus_context_t* ctx, int r) {
+  fprintf(
+    stderr,
+    SD_ERR "failed to attach to user bus: %s\n"
+    SD_ERR "  uid=%u\n",
+    strerror(-r),
+    (unsigned)ctx->uid
+  );
+  bus_context_fail_attach(ctx, r);
+}
+
+// Starts a fresh journal from whatever was restored and pruned, re-acquires
+// the locks, and lets clients in
+static int bus_context_finish_restore(bus_context_t* ctx, size_t pruned) {
+  int r;
+  char const* path = ctx->journal_path;
+
+  // Not worth refusing to start over; we just won't survive a crash
+  r = journal_open(
+    path,
+    ctx->bus_id,
+    bus_context_snapshot,
+    ctx,
+    &ctx->journal
+  );
+  if (r < 0) {
+    fprintf(
+      stderr,
+      SD_WARNING "failed to open state journal: %s\n"
+      SD_WARNING "  path=%s\n",
+      strerror(-r),
+      path
+    );
+  }
+
+  if (ctx->inhibitor_count > 0) {
+    fprintf(
+      stderr,
+      SD_INFO "restored inhibitors from state journal\n"
+      SD_INFO "  inhibitors=%" PRIu32 "\n"
+      SD_INFO "  pruned_peers=%zu\n",
+      ctx->inhibitor_count,
+      pruned
+    );
+
+    r = bus_context_arm_wheel(ctx);
+    if (r < 0) return r;
+
+    r = bus_context_recover(ctx);
+    if (r < 0) return r;
+  }
+
+  return bus_context_publish(ctx);
+}
+
+static int bus_context_on_names(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* ret_error
+) {
+  (void)ret_error;
+
+  auto ctx = (bus_context_t*)userdata;
+  int r;
+
+  sd_bus_slot_unrefp(&ctx->attach_slot);
+
+  size_t pruned = 0;
+  r = -sd_bus_message_get_errno(m);
+  if (r == 0) {
+    r = bus_context_prune_peers(ctx, m, &pruned);
+  }
+  if (r == 0) {
+    r = bus_context_finish_restore(ctx, pruned);
+  }
+  if (r < 0) {
+    bus_context_fail_restore(ctx, r);
+  }
+
+  return 0;
+}
+
+static int bus_context_on_bus_id(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* ret_error
+) {
+  (void)ret_error;
+
+  auto ctx = (bus_context_t*)userdata;
+  int r;
+  char const* path = ctx->journal_path;
+
+  sd_bus_slot_unrefp(&ctx->attach_slot);
+
+  char const* id;
+  r = -sd_bus_message_get_errno(m);
+  if (r == 0) {
+    r = sd_bus_message_read_basic(m, 's', &id);
+  }
+  if (r >= 0) {
+    r = sd_id128_from_string(id, &ctx->bus_id);
+  }
+  if (r < 0) goto fail;
+
+  sd_id128_t journal_bus_id;
+  r = journal_replay(
+    path,
+    &journal_bus_id,
+    bus_context_on_journal_entry,
+    ctx
+  );
+  if (r < 0) {
+    // Whatever was read so far is kept
+    fprintf(
+      stderr,
+      SD_WARNING "failed to read state journal: %s\n"
+      SD_WARNING "  path=%s\n",
+      strerror(-r),
+      path
+    );
+  }
+
+  // Unique names are handed out again from scratch when the bus restarts,
+  // so the same name may well belong to someone else by now
+  bool bus_changed = !sd_id128_equal(ctx->bus_id, journal_bus_id);
+  if (bus_changed && htable_count(ctx->peers) > 0) {
+    fprintf(
+      stderr,
+      SD_INFO "state journal is from another bus, dropping its inhibitors\n"
+      SD_INFO "  path=%s\n",
+      path
+    );
+  }
+
+  if (bus_changed || htable_count(ctx->peers) == 0) {
+    size_t pruned = 0;
+    r = bus_context_prune_peers(ctx, nullptr, &pruned);
+    if (r < 0) goto fail;
+
+    r = bus_context_finish_restore(ctx, pruned);
+    if (r < 0) goto fail;
+    return 0;
+  }
+
+  // Whoever is still around is on this list; whoever leaves after the match
+  // on NameOwnerChanged was installed is caught by it, since the bus answers
+  // in order
+  r = sd_bus_call_method_async(
+    ctx->user_bus,
+    &ctx->attach_slot,
+    "org.freedesktop.DBus",
+    "/org/freedesktop/DBus",
+    "org.freedesktop.DBus",
+    "ListNames",
+    bus_context_on_names,
+    ctx,
+    ""
+  );
+  if (r < 0) goto fail;
+
+  return 0;
+
+fail:
+  bus_context_fail_restore(ctx, r);
+  return 0;
+}
+
+// Rebuilds the peers and cookies of the previous instance from its journal,
+// then starts a fresh journal from the result. Only the locks of peers that
+// are still around get re-acquired. This takes a couple of round trips to
+// the bus, after which bus_context_publish() carries on.
+static int bus_context_restore(bus_context_t* ctx) {
+  assert(ctx != nullptr);
+  assert(ctx->journal == nullptr);
+
+  if (ctx->journal_path == nullptr) {
+    return bus_context_publish(ctx);
+  }
+
+  // The journal belongs to a bus, as told by its id
+  return sd_bus_call_method_async(
+    ctx->user_bus,
+    &ctx->attach_slot,
+    "org.freedesktop.DBus",
+    "/org/freedesktop/DBus",
+    "org.freedesktop.DBus",
+    "GetId",
+    bus_context_on_bus_id,
+    ctx,
+    ""
+  );
+}
+
+static int bridge_load_policy(bridge_t* bridge) {
+  assert(bridge != nullptr);
+
+  int r;
+
+  if (bridge->opts->policy_path == nullptr) {
+    return 0;
+  }
+
+  policy_t* policy;
+  r = policy_load(bridge->opts->policy_path, &policy);
+  if (r < 0) return r;
+
+  // Existing inhibitors were vetted by the old policy and are left alone
+  policy_destroyp(&bridge->policy);
+  bridge->policy = policy;
+
+  fprintf(
+    stderr,
+    SD_INFO "loaded policy\n"
+    SD_INFO "  path=%s\n"
+    SD_INFO "  rules=%zu\n",
+    bridge->opts->policy_path,
+    policy_rule_count(policy)
+  );
+
+  return 0;
+}
+
+static int bridge_on_sighup(
+  sd_event_source* s,
+  struct signalfd_siginfo const* si,
+  void* userdata
+) {
+  (void)s;
+  (void)si;
+
+  auto bridge = (bridge_t*)userdata;
+
+  // On failure, the previous policy stays in effect
+  (void)bridge_load_policy(bridge);
+  return 0;
+}
+
+static int bridge_on_sigusr1(
+  sd_event_source* s,
+  struct signalfd_siginfo const* si,
+  void* userdata
+) {
+  (void)s;
+  (void)si;
+  (void)userdata;
+
+  fprintf(stderr, SD_INFO "flight recorder dump\n");
+
+  size_t pos = 0;
+  recorder_event_t event;
+  while (recorder_next(&pos, &event)) {
+    fprintf(
+      stderr,
+      SD_INFO "  usec=%" PRIu64 " event=%s uid=%" PRIu32 " peer=%s"
+      " cookie=%" PRIu32 " duration_usec=%" PRIu32 " result=%" PRId32 "\n",
+      event.timestamp,
+      recorder_type_name(event.type),
+      event.uid,
+      event.peer,
+      event.cookie,
+      event.duration_usec,
+      event.result
+    );
+  }
+
+  fprintf(
+    stderr,
+    SD_INFO "end of flight recorder dump\n"
+    SD_INFO "  events=%zu\n",
+    pos
+  );
+  return 0;
+}
+
+static int setup_signal_handlers(sd_event* event) {
+  assert(event != nullptr);
+
+  int r;
+  sigset_t ss;
+
+  if (
+    sigemptyset(&ss) < 0
+    || sigaddset(&ss, SIGTERM) < 0
+    || sigaddset(&ss, SIGINT) < 0
+    || sigaddset(&ss, SIGHUP) < 0
+    || sigaddset(&ss, SIGUSR1) < 0
+  ) {
+    goto fail;
+  }
+
+  if (sigprocmask(SIG_BLOCK, &ss, nullptr) < 0) {
+    goto fail;
+  }
+
+  r = sd_event_add_signal(event, nullptr, SIGTERM, nullptr, nullptr);
+  if (r < 0) goto fail;
+
+  r = sd_event_add_signal(event, nullptr, SIGINT, nullptr, nullptr);
+  if (r < 0) goto fail;
+
+  return 0;
+
+fail:
+  return 1;
+}
+
+// Describes the inhibitor to logind as "app_name (comm, unit)", so that
+// `systemd-inhibit --list` shows which process is actually behind it.
+static char* bus_peer_attribute(bus_peer_t* peer, char const* app_name) {
+  if (peer->comm == nullptr && peer->unit == nullptr) {
+    return nullptr;
+  }
+
+  char const* comm = peer->comm != nullptr ? peer->comm : "";
+  char const* unit = peer->unit != nullptr ? peer->unit : "";
+  char const* sep = peer->comm != nullptr && peer->unit != nullptr ? ", " : "";
+
+  int len = snprintf(nullptr, 0, "%s (%s%s%s)", app_name, comm, sep, unit);
+  if (len < 0) return nullptr;
+
+  char* who = malloc((size_t)len + 1);
+  if (who == nullptr) return nullptr;
+
+  (void)snprintf(who, (size_t)len + 1, "%s (%s%s%s)", app_name, comm, sep, unit);
+  return who;
+}
+
+// Applies the policy and attribution to an Inhibit call. Returns 0 if the
+// call has already been answered (i.e. denied).
+static int bus_context_resolve_inhibit(
+  bus_context_t* ctx,
+  bus_peer_t* peer,
+  pending_inhibit_t* call
+) {
+  char const* sender = peer->name;
+
+  call->who = call->app_name;
+  call->why = call->reason;
+  call->mode = "block";
+  bool remapped = false;
+  if (ctx->bridge->policy != nullptr) {
+    char const* const fields[_POLICY_FIELD_MAX] = {
+      [POLICY_FIELD_SENDER] = sender,
+      [POLICY_FIELD_APP_NAME] = call->app_name,
+      [POLICY_FIELD_REASON] = call->reason,
+      [POLICY_FIELD_COMM] = peer->comm,
+      [POLICY_FIELD_UNIT] = peer->unit,
+    };
+
+    policy_decision_t decision;
+    policy_eval(ctx->bridge->policy, fields, &decision);
+    switch (decision.action) {
+      case POLICY_ACTION_ALLOW: {
+        if (decision.what != nullptr) call->what = decision.what;
+        if (decision.mode != nullptr) call->mode = decision.mode;
+        break;
+      }
+      case POLICY_ACTION_DENY: {
+        fprintf(
+          stderr,
+          SD_DEBUG "inhibit: denied by policy\n"
+          SD_DEBUG "  name=%s\n"
+          SD_DEBUG "  app_name=%s\n"
+          SD_DEBUG "  reason=%s\n",
+          sender,
+          call->app_name,
+          call->reason
+        );
+        recorder_record(RECORDER_INHIBIT, ctx->uid, sender, 0, 0, -EPERM);
+        int r = sd_bus_reply_method_errnof(call->m, EPERM, "denied by policy");
+        return r < 0 ? r : 0;
+      }
+      case POLICY_ACTION_REMAP: {
+        if (decision.who != nullptr) {
+          call->who = decision.who;
+          remapped = true;
+        }
+        if (decision.why != nullptr) call->why = decision.why;
+        if (decision.what != nullptr) call->what = decision.what;
+        if (decision.mode != nullptr) call->mode = decision.mode;
+        break;
+      }
+    }
+  }
+
+  // An explicit who from the policy is used as-is
+  if (!remapped) {
+    call->attributed = bus_peer_attribute(peer, call->app_name);
+    if (call->attributed != nullptr) call->who = call->attributed;
+  }
+
+  return 1;
+}
+
+// Replies to a resolved Inhibit call, once inhibitman has dealt with it
+static int bus_context_finish_inhibit(
+  bus_context_t* ctx,
+  bus_peer_t* peer,
+  pending_inhibit_t const* call,
+  int error,
+  uint32_t id
+) {
+  int r;
+  char const* sender = peer->name;
+
+  uint64_t duration = recorder_now() - call->started;
+  recorder_record(
+    RECORDER_INHIBIT,
+    ctx->uid,
+    sender,
+    id,
+    duration < UINT32_MAX ? (uint32_t)duration : UINT32_MAX,
+    error
+  );
+
+  if (error < 0) {
+    fprintf(
+      stderr,
+      SD_ERR "inhibit: %s\n"
+      SD_ERR "  name=%s\n"
+      SD_ERR "  app_name=%s\n"
+      SD_ERR "  reason=%s\n",
+      strerror(-error),
+      sender,
+      call->app_name,
+      call->reason
+    );
+    return sd_bus_reply_method_errnof(
+      call->m,
+      error,
+      "failed to add inhibitor: %m"
+    );
+  }
+
+  bus_context_add_count(ctx, 1);
+
+  uint64_t max_usec = options_get_max_inhibit(
+    ctx->bridge->opts,
+    call->app_name
+  );
+  if (max_usec > 0) {
+    uint64_t now;
+    r = sd_event_now(ctx->bridge->event, CLOCK_MONOTONIC, &now);
+    if (r >= 0) {
+      r = inhibitman_set_deadline(peer->im, id, ctx->wheel, now + max_usec);
+    }
+    if (r >= 0) {
+      r = bus_context_arm_wheel(ctx);
+    }
+    if (r < 0) {
+      fprintf(
+        stderr,
+        SD_WARNING "failed to set inhibitor deadline: %s\n"
+        SD_WARNING "  name=%s\n"
+        SD_WARNING "  cookie=%u\n",
+        strerror(-r),
+        sender,
+        id
+      );
+    }
+  }
+
+  bus_context_journal_add(ctx, peer, id);
+
+  if (ctx->bridge->capture != nullptr) {
+    uint64_t serial = 0;
+    (void)sd_bus_message_get_cookie(call->m, &serial);
+    bus_context_capture(ctx, sender, &(capture_record_t){
+      .op = CAPTURE_INHIBITED,
+      .frontend = (uint8_t)call->frontend,
+      .serial = (uint32_t)serial,
+      .cookie = id,
+    });
+  }
+
+  fprintf(
+    stderr,
+    SD_DEBUG "inhibit\n"
+    SD_DEBUG "  name=%s\n"
+    SD_DEBUG "  app_name=%s\n"
+    SD_DEBUG "  reason=%s\n"
+    SD_DEBUG "  what=%s\n"
+    SD_DEBUG "  mode=%s\n"
+    SD_DEBUG "  who=%s\n"
+    SD_DEBUG "  why=%s\n"
+    SD_DEBUG "  cookie=%u\n",
+    sender,
+    call->app_name,
+    call->reason,
+    call->what,
+    call->mode,
+    call->who,
+    call->why,
+    id
+  );
+
+  return sd_bus_reply_method_return(call->m, "u", id);
+}
+
+static int bus_context_inhibit(
+  bus_context_t* ctx,
+  bus_peer_t* peer,
+  sd_bus_message* m,
+  frontend_t frontend,
+  char const* what,
+  char const* app_name,
+  char const* reason
+) {
+  int r;
+
+  _cleanup_(pending_inhibit_clear)
+  pending_inhibit_t call = {
+    .m = m,
+    .frontend = frontend,
+    .what = what,
+    .app_name = app_name,
+    .reason = reason,
+  };
+
+  r = bus_context_resolve_inhibit(ctx, peer, &call);
+  if (r <= 0) return r;
+
+  inhibitman_request_t req = {
+    .what = call.what,
+    .mode = call.mode,
+    .who = call.who,
+    .why = call.why,
+    .app_name = call.app_name,
+    .reason = call.reason,
+    .tag = frontend,
+  };
+  call.started = recorder_now();
+  r = inhibitman_add(peer->im, &req);
+  return bus_context_finish_inhibit(ctx, peer, &call, r, req.id);
+}
+
+static frontend_t frontend_from_message(sd_bus_message* m);
+
+static int bus_context_handle_inhibit(
+  bus_context_t* ctx,
+  sd_bus_message* m,
+  frontend_t frontend,
+  char const* what,
+  char const* app_name,
+  char const* reason
+) {
+  int r;
+
+  char const* sender = sd_bus_message_get_sender(m);
+  TRACE(inhibit_entry, m, sender, app_name);
+
+  bus_peer_t* peer;
+  r = bus_context_get_or_create_peer(ctx, sender, &peer);
+  if (r < 0) {
+    // Captured already, but there's no peer to forget it along with
+    bus_context_capture_forget(ctx, sender);
+    goto out;
+  }
+
+  if (peer->creds_slot != nullptr) {
+    // Replied to once the peer's credentials are in
+    r = bus_peer_defer_inhibit(peer, m, frontend, what, app_name, reason);
+    if (r < 0) goto out;
+    TRACE(inhibit_deferred, m, sender);
+    r = 1;
+    goto out;
+  }
+
+  r = bus_context_inhibit(
+    ctx,
+    peer,
+    m,
+    frontend,
+    what,
+    app_name,
+    reason
+  );
+
+out:
+  TRACE(inhibit_return, m, r);
+  return r;
+}
+
+// Inhibit(s app_name, s reason) -> u cookie; shared by the freedesktop
+// ScreenSaver and PowerManagement interfaces
+static int method_inhibit(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* err
+) {
+  (void)err;
+
+  int r;
+  auto ctx = (bus_context_t*)userdata;
+
+  char* app_name;
+  r = sd_bus_message_read_basic(m, 's', &app_name);
+  if (r < 0) return r;
+
+  char* reason;
+  r = sd_bus_message_read_basic(m, 's', &reason);
+  if (r < 0) return r;
+
+  frontend_t frontend = frontend_from_message(m);
+  bus_context_capture_inhibit(ctx, m, frontend, app_name, reason, 0);
+
+  return bus_context_handle_inhibit(
+    ctx,
+    m,
+    frontend,
+    "idle",
+    app_name,
+    reason
+  );
+}
+
+// org.gnome.SessionManager inhibit flags
+enum {
+  GSM_INHIBIT_LOGOUT = 1 << 0,
+  GSM_INHIBIT_SWITCH_USER = 1 << 1,
+  GSM_INHIBIT_SUSPEND = 1 << 2,
+  GSM_INHIBIT_IDLE = 1 << 3,
+  GSM_INHIBIT_AUTOMOUNT = 1 << 4,
+};
+
+static uint32_t const GSM_INHIBIT_SUPPORTED = GSM_INHIBIT_IDLE
+  | GSM_INHIBIT_SUSPEND;
+
+static int method_gsm_inhibit(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* err
+) {
+  (void)err;
+
+  int r;
+  auto ctx = (bus_context_t*)userdata;
+
+  char* app_id;
+  uint32_t toplevel_xid;
+  char* reason;
+  uint32_t flags;
+  r = sd_bus_message_read(m, "susu", &app_id, &toplevel_xid, &reason, &flags);
+  if (r < 0) return r;
+
+  bus_context_capture_inhibit(
+    ctx,
+    m,
+    FRONTEND_GNOME_SESSION,
+    app_id,
+    reason,
+    flags
+  );
+
+  if ((flags & GSM_INHIBIT_SUPPORTED) == 0) {
+    return sd_bus_reply_method_errnof(
+      m,
+      EOPNOTSUPP,
+      "unsupported inhibit flags: %u",
+      flags
+    );
+  }
+
+  // Policy what= still takes precedence over this
+  char const* what = "idle";
+  if ((flags & GSM_INHIBIT_SUSPEND) != 0) {
+    what = (flags & GSM_INHIBIT_IDLE) != 0 ? "idle:sleep" : "sleep";
+  }
+
+  return bus_context_handle_inhibit(
+    ctx,
+    m,
+    FRONTEND_GNOME_SESSION,
+    what,
+    app_id,
+    reason
+  );
+}
+
+// UnInhibit(u cookie); cookies are only valid for the interface (and peer)
+// that handed them out
+static int method_uninhibit(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* err
+) {
+  (void)err;
+
+  auto ctx = (bus_context_t*)userdata;
+  int r;
+
+  char const* sender = sd_bus_message_get_sender(m);
+  frontend_t frontend = frontend_from_message(m);
+
+  uint32_t id;
+  r = sd_bus_message_read_basic(m, 'u', &id);
+  if (r < 0) return r;
+
+  TRACE(uninhibit_entry, m, sender, id);
+  bus_context_capture(ctx, sender, &(capture_record_t){
+    .op = CAPTURE_UNINHIBIT,
+    .frontend = (uint8_t)frontend,
+    .cookie = id,
+  });
+
+  bus_peer_t* peer;
+  if (!bus_context_get_peer(ctx, sender, &peer)) {
+    goto invalid;
+  }
+
+  if (!inhibitman_remove(peer->im, id, frontend)) {
+    goto invalid;
+  }
+  recorder_record(RECORDER_UNINHIBIT, ctx->uid, sender, id, 0, 0);
+
+  bus_context_add_count(ctx, -1);
+  bus_context_journal(ctx, &(journal_entry_t){
+    .op = JOURNAL_OP_REMOVE,
+    .peer = peer->name,
+    .id = id,
+    .tag = frontend,
+  });
+
+  fprintf(
+    stderr,
+    SD_DEBUG "uninhibit\n"
+    SD_DEBUG "  peer=%s\n"
+    SD_DEBUG "  cookie=%u\n",
+    sender,
+    id
+  );
+
+  r = sd_bus_reply_method_return(m, "");
+  TRACE(uninhibit_return, m, r);
+  return r;
+
+invalid:
+  recorder_record(RECORDER_UNINHIBIT, ctx->uid, sender, id, 0, -EINVAL);
+  fprintf(
+    stderr,
+    SD_ERR "uninhibit: invalid cookie\n"
+    SD_ERR "  peer=%s\n"
+    SD_ERR "  cookie=%u\n",
+    sender,
+    id
+  );
+  r = sd_bus_reply_method_errnof(m, EINVAL, "invalid cookie");
+  TRACE(uninhibit_return, m, r);
+  return r;
+}
+
+// ScreenSaver.GetActive and PowerManagement.HasInhibit
+static int method_get_active(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* err
+) {
+  (void)err;
+
+  auto ctx = (bus_context_t*)userdata;
+
+  // We don't drive a screensaver; report whether anything is inhibited
+  // instead, from the cached aggregate rather than by walking the peers.
+  return sd_bus_reply_method_return(m, "b", ctx->inhibitor_count > 0);
+}
+
+static int method_gsm_is_inhibited(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* err
+) {
+  (void)err;
+
+  auto ctx = (bus_context_t*)userdata;
+  int r;
+
+  uint32_t flags;
+  r = sd_bus_message_read_basic(m, 'u', &flags);
+  if (r < 0) return r;
+
+  return sd_bus_reply_method_return(
+    m,
+    "b",
+    (flags & GSM_INHIBIT_SUPPORTED) != 0 && ctx->inhibitor_count > 0
+  );
+}
+
+static sd_bus_vtable const bus_vtable_screensaver[] = {
+  SD_BUS_VTABLE_START(0),
+  SD_BUS_METHOD_WITH_ARGS(
+    "Inhibit",
+    SD_BUS_ARGS(
+      "s", app_name,
+      "s", reason
+    ),
+    SD_BUS_RESULT("u", cookie),
+    method_inhibit,
+    0
+  ),
+  SD_BUS_METHOD_WITH_ARGS(
+    "UnInhibit",
+    SD_BUS_ARGS("u", cookie),
+    SD_BUS_NO_RESULT,
+    method_uninhibit,
+    0
+  ),
+  SD_BUS_METHOD_WITH_ARGS(
+    "GetActive",
+    SD_BUS_NO_ARGS,
+    SD_BUS_RESULT("b", active),
+    method_get_active,
+    0
+  ),
+  SD_BUS_SIGNAL_WITH_ARGS(
+    "ActiveChanged",
+    SD_BUS_ARGS("b", active),
+    0
+  ),
+  SD_BUS_VTABLE_END,
+};
+
+static sd_bus_vtable const bus_vtable_power_management[] = {
+  SD_BUS_VTABLE_START(0),
+  SD_BUS_METHOD_WITH_ARGS(
+    "Inhibit",
+    SD_BUS_ARGS(
+      "s", application,
+      "s", reason
+    ),
+    SD_BUS_RESULT("u", cookie),
+    method_inhibit,
+    0
+  ),
+  SD_BUS_METHOD_WITH_ARGS(
+    "UnInhibit",
+    SD_BUS_ARGS("u", cookie),
+    SD_BUS_NO_RESULT,
+    method_uninhibit,
+    0
+  ),
+  SD_BUS_METHOD_WITH_ARGS(
+    "HasInhibit",
+    SD_BUS_NO_ARGS,
+    SD_BUS_RESULT("b", has_inhibit),
+    method_get_active,
+    0
+  ),
+  SD_BUS_SIGNAL_WITH_ARGS(
+    "HasInhibitChanged",
+    SD_BUS_ARGS("b", has_inhibit),
+    0
+  ),
+  SD_BUS_VTABLE_END,
+};
+
+static sd_bus_vtable const bus_vtable_gnome_session[] = {
+  SD_BUS_VTABLE_START(0),
+  SD_BUS_METHOD_WITH_ARGS(
+    "Inhibit",
+    SD_BUS_ARGS(
+      "s", app_id,
+      "u", toplevel_xid,
+      "s", reason,
+      "u", flags
+    ),
+    SD_BUS_RESULT("u", inhibit_cookie),
+    method_gsm_inhibit,
+    0
+  ),
+  SD_BUS_METHOD_WITH_ARGS(
+    "Uninhibit",
+    SD_BUS_ARGS("u", inhibit_cookie),
+    SD_BUS_NO_RESULT,
+    method_uninhibit,
+    0
+  ),
+  SD_BUS_METHOD_WITH_ARGS(
+    "IsInhibited",
+    SD_BUS_ARGS("u", flags),
+    SD_BUS_RESULT("b", is_inhibited),
+    method_gsm_is_inhibited,
+    0
+  ),
+  SD_BUS_VTABLE_END,
+};
+
+typedef struct frontend_desc {
+  // As accepted by --frontend
+  char const* name;
+  char const* bus_name;
+  char const* path;
+  char const* interface;
+  sd_bus_vtable const* vtable;
+  // Emitted with the new state whenever the bridge goes from having no
+  // inhibitors to having some or back; nullptr if the interface has none
+  char const* active_signal;
+} frontend_desc_t;
+
+static frontend_desc_t const FRONTENDS[_FRONTEND_MAX] = {
+  [FRONTEND_SCREENSAVER] = {
+    .name = "screensaver",
+    .bus_name = "org.freedesktop.ScreenSaver",
+    .path = "/org/freedesktop/ScreenSaver",
+    .interface = "org.freedesktop.ScreenSaver",
+    .vtable = bus_vtable_screensaver,
+    .active_signal = "ActiveChanged",
+  },
+  [FRONTEND_POWER_MANAGEMENT] = {
+    .name = "power-management",
+    .bus_name = "org.freedesktop.PowerManagement",
+    .path = "/org/freedesktop/PowerManagement/Inhibit",
+    .interface = "org.freedesktop.PowerManagement.Inhibit",
+    .vtable = bus_vtable_power_management,
+    .active_signal = "HasInhibitChanged",
+  },
+  [FRONTEND_GNOME_SESSION] = {
+    .name = "gnome-session",
+    .bus_name = "org.gnome.SessionManager",
+    .path = "/org/gnome/SessionManager",
+    .interface = "org.gnome.SessionManager",
+    .vtable = bus_vtable_gnome_session,
+    .active_signal = nullptr,
+  },
+};
+
+static frontend_t frontend_from_message(sd_bus_message* m) {
+  char const* interface = sd_bus_message_get_interface(m);
+  if (interface != nullptr) {
+    for (size_t i = 0; i < _FRONTEND_MAX; i++) {
+      if (strcmp(FRONTENDS[i].interface, interface) == 0) {
+        return (frontend_t)i;
+      }
+    }
+  }
+
+  // Only reachable through one of the vtables above
+  assert(false);
+  return FRONTEND_SCREENSAVER;
+}
+
+// sd-bus writes every message out with its own sendmsg() and dispatches a
+// single incoming message per event loop iteration, so a burst of calls
+// costs a reply each no matter what. The change signals are what can be
+// saved on: rather than one per call, they go out once per burst.
+static void bus_context_flush_notify(bus_context_t* ctx) {
+  int r;
+
+  // Whichever source got here first, the other one has nothing left to do
+  (void)sd_event_source_set_enabled(ctx->notify_defer_source, SD_EVENT_OFF);
+  (void)sd_event_source_set_enabled(ctx->notify_source, SD_EVENT_OFF);
+
+  bool active = ctx->inhibitor_count > 0;
+  bool was_active = ctx->emitted_count > 0;
+
+  uint32_t changes = ctx->pending_changes;
+  ctx->pending_changes = 0;
+  bridge_add_changes(ctx->bridge, changes);
+
+  if (ctx->inhibitor_count == ctx->emitted_count) {
+    // Whatever happened in the meantime cancelled out
+    return;
+  }
+  ctx->emitted_count = ctx->inhibitor_count;
+  ctx->notify_flushes++;
+  ctx->notify_changes += changes;
+
+  r = sd_bus_emit_properties_changed(
+    ctx->user_bus,
+    "/io/github/notpeelz/SdInhibitBridge1",
+    "io.github.notpeelz.SdInhibitBridge1",
+    "InhibitorCount",
+    nullptr
+  );
+  if (r < 0) goto fail;
+
+  if (active != was_active) {
+    for (size_t i = 0; i < _FRONTEND_MAX; i++) {
+      frontend_desc_t const* desc = &FRONTENDS[i];
+      if ((ctx->bridge->opts->frontends & (1u << i)) == 0) continue;
+      if (desc->active_signal == nullptr) continue;
+
+      r = sd_bus_emit_signal(
+        ctx->user_bus,
+        desc->path,
+        desc->interface,
+        desc->active_signal,
+        "b",
+        active
+      );
+      if (r < 0) goto fail;
+    }
+  }
+
+  return;
+
+fail:
+  fprintf(
+    stderr,
+    SD_WARNING "failed to emit change notification: %s\n",
+    strerror(-r)
+  );
+}
+
+static int bus_context_on_notify_defer(sd_event_source* s, void* userdata) {
+  (void)s;
+
+  bus_context_flush_notify((bus_context_t*)userdata);
+  return 0;
+}
+
+static int bus_context_on_notify(
+  sd_event_source* s,
+  uint64_t usec,
+  void* userdata
+) {
+  (void)s;
+  (void)usec;
+
+  bus_context_flush_notify((bus_context_t*)userdata);
+  return 0;
+}
+
+static uint32_t const LIST_PAGE_MAX = 1024;
+
+// Inhibitors are listed ordered by (peer, cookie), and a page picks up right
+// after the last one of the previous page. Unlike an offset, that position
+// stays meaningful when inhibitors come and go between pages: nothing is
+// listed twice, and nothing that stays around is skipped.
+static int method_list_inhibitors(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* err
+) {
+  (void)err;
+
+  auto ctx = (bus_context_t*)userdata;
+  int r;
+
+  char const* after_peer;
+  uint32_t after_cookie;
+  uint32_t limit;
+  r = sd_bus_message_read(m, "suu", &after_peer, &after_cookie, &limit);
+  if (r < 0) return r;
+
+  // Pages are capped so that a huge dump is spread over several calls (and
+  // event loop iterations) instead of stalling everyone else.
+  if (limit == 0 || limit > LIST_PAGE_MAX) {
+    limit = LIST_PAGE_MAX;
+  }
+
+  uint64_t now;
+  r = sd_event_now(ctx->bridge->event, CLOCK_MONOTONIC, &now);
+  if (r < 0) return r;
+
+  _cleanup_(sd_bus_message_unrefp)
+  sd_bus_message* reply = nullptr;
+
+  r = sd_bus_message_new_method_return(m, &reply);
+  if (r < 0) return r;
+
+  r = sd_bus_message_open_container(reply, 'a', "(sussst)");
+  if (r < 0) return r;
+
+  uint32_t n = 0;
+  char const* last_peer = "";
+  uint32_t last_cookie = 0;
+  // Picks up at the cursor's peer, if it's still around, or the one that
+  // now takes its place
+  for (
+    size_t i = bus_context_peer_rank(ctx, after_peer);
+    i < ctx->ordered_peers_length && n < limit;
+    i++
+  ) {
+    bus_peer_t* peer = ctx->ordered_peers[i];
+
+    // Cookies start at 1, and positions are cookies minus one
+    size_t pos = strcmp(peer->name, after_peer) == 0 ? after_cookie : 0;
+    inhibitman_entry_t entry;
+    while (n < limit && inhibitman_next(peer->im, &pos, &entry)) {
+      r = sd_bus_message_append(
+        reply,
+        "(sussst)",
+        peer->name,
+        entry.id,
+        entry.tag < _FRONTEND_MAX ? FRONTENDS[entry.tag].name : "",
+        entry.app_name,
+        entry.reason,
+        now > entry.created ? now - entry.created : 0
+      );
+      if (r < 0) return r;
+
+      n++;
+      last_peer = peer->name;
+      last_cookie = entry.id;
+    }
+  }
+
+  r = sd_bus_message_close_container(reply);
+  if (r < 0) return r;
+
+  // A short page means we've reached the end
+  if (n < limit) {
+    last_peer = "";
+    last_cookie = 0;
+  }
+  r = sd_bus_message_append(reply, "su", last_peer, last_cookie);
+  if (r < 0) return r;
+
+  return sd_bus_send(nullptr, reply, nullptr);
+}
+
+// Only the events of the caller's own user bus are handed out
+static int method_dump_events(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* err
+) {
+  (void)err;
+
+  auto ctx = (bus_context_t*)userdata;
+  int r;
+
+  _cleanup_(sd_bus_message_unrefp)
+  sd_bus_message* reply = nullptr;
+
+  r = sd_bus_message_new_method_return(m, &reply);
+  if (r < 0) return r;
+
+  r = sd_bus_message_open_container(reply, 'a', "(tssuui)");
+  if (r < 0) return r;
+
+  size_t pos = 0;
+  recorder_event_t event;
+  while (recorder_next(&pos, &event)) {
+    if (event.uid != ctx->uid) continue;
+
+    r = sd_bus_message_append(
+      reply,
+      "(tssuui)",
+      event.timestamp,
+      recorder_type_name(event.type),
+      event.peer,
+      event.cookie,
+      event.duration_usec,
+      event.result
+    );
+    if (r < 0) return r;
+  }
+
+  r = sd_bus_message_close_container(reply);
+  if (r < 0) return r;
+
+  return sd_bus_send(nullptr, reply, nullptr);
+}
+
+static sd_bus_vtable const bus_vtable_bridge[] = {
+  SD_BUS_VTABLE_START(0),
+  SD_BUS_PROPERTY(
+    "InhibitorCount",
+    "u",
+    nullptr,
+    offsetof(bus_context_t, inhibitor_count),
+    SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE
+  ),
+  SD_BUS_PROPERTY(
+    "NotifyFlushes",
+    "u",
+    nullptr,
+    offsetof(bus_context_t, notify_flushes),
+    0
+  ),
+  SD_BUS_PROPERTY(
+    "NotifyChanges",
+    "t",
+    nullptr,
+    offsetof(bus_context_t, notify_changes),
+    0
+  ),
+  SD_BUS_PROPERTY(
+    "Recoveries",
+    "u",
+    nullptr,
+    offsetof(bus_context_t, recoveries),
+    0
+  ),
+  SD_BUS_PROPERTY(
+    "LastRecoveryUSec",
+    "t",
+    nullptr,
+    offsetof(bus_context_t, last_recovery_usec),
+    0
+  ),
+  SD_BUS_PROPERTY(
+    "RecoveryFailures",
+    "u",
+    nullptr,
+    offsetof(bus_context_t, recovery_failures),
+    0
+  ),
+  SD_BUS_METHOD_WITH_ARGS(
+    "ListInhibitors",
+    SD_BUS_ARGS(
+      "s", after_peer,
+      "u", after_cookie,
+      "u", limit
+    ),
+    SD_BUS_RESULT(
+      "a(sussst)", inhibitors,
+      "s", next_peer,
+      "u", next_cookie
+    ),
+    method_list_inhibitors,
+    0
+  ),
+  SD_BUS_METHOD_WITH_ARGS(
+    "DumpEvents",
+    SD_BUS_NO_ARGS,
+    SD_BUS_RESULT("a(tssuui)", events),
+    method_dump_events,
+    0
+  ),
+  SD_BUS_VTABLE_END,
+};
+
+static int bus_on_name_owner_changed(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* ret_error
+) {
+  (void)ret_error;
+
+  int r;
+  auto ctx = (bus_context_t*)userdata;
+
+  char* name;
+  char* old_owner;
+  char* new_owner;
+
+  r = sd_bus_message_read_basic(m, 's', &name);
+  if (r < 0) return r;
+
+  r = sd_bus_message_read_basic(m, 's', &old_owner);
+  if (r < 0) return r;
+
+  r = sd_bus_message_read_basic(m, 's', &new_owner);
+  if (r < 0) return r;
+
+  if (!bus_context_get_peer(ctx, name, nullptr)) {
+    return 0;
+  }
+
+  if (strcmp(name, old_owner) == 0 && strcmp(new_owner, "") == 0) {
+    // The peer disappeared from the bus
+    bus_context_capture(ctx, name, &(capture_record_t){
+      .op = CAPTURE_PEER_GONE,
+    });
+    r = bus_context_queue_remove_peer(ctx, name);
+    if (r < 0) {
+      (void)bus_context_remove_peer(ctx, name);
+    }
+  }
+
+  return 0;
+}
+
+static int user_bus_on_disconnected(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* ret_error
+) {
+  (void)m;
+  (void)ret_error;
+
+  auto ctx = (bus_context_t*)userdata;
+
+  fprintf(
+    stderr,
+    SD_INFO "lost connection to user bus\n"
+    SD_INFO "  uid=%u\n",
+    (unsigned)ctx->uid
+  );
+
+  // We're being called from the user bus itself
+  ctx->closing = true;
+  ctx->disconnected = true;
+  return sd_event_source_set_enabled(
+    ctx->bridge->reap_source,
+    SD_EVENT_ONESHOT
+  );
+}
+
+// RequestName replies
+enum {
+  BUS_NAME_PRIMARY_OWNER = 1,
+  BUS_NAME_ALREADY_OWNER = 4,
+};
+
+static int bus_context_on_name(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* ret_error
+) {
+  (void)ret_error;
+
+  auto req = (bus_name_request_t*)userdata;
+  bus_context_t* ctx = req->ctx;
+  size_t i = req - ctx->name_requests;
+
+  sd_bus_slot_unrefp(&req->slot);
+
+  // Unlike sd_bus_request_name(), we get the bus' own answer
+  uint32_t ret;
+  int r = -sd_bus_message_get_errno(m);
+  if (r == 0) {
+    r = sd_bus_message_read_basic(m, 'u', &ret);
+  }
+  if (
+    r >= 0
+    && ret != BUS_NAME_PRIMARY_OWNER
+    && ret != BUS_NAME_ALREADY_OWNER
+  ) {
+    r = -EEXIST;
+  }
+  if (r < 0) {
+    fprintf(
+      stderr,
+      SD_ERR "failed to acquire name %s: %s\n"
+      SD_ERR "  uid=%u\n",
+      FRONTENDS[i].bus_name,
+      strerror(-r),
+      (unsigned)ctx->uid
+    );
+    bus_context_fail_attach(ctx, r);
+  }
+
+  return 0;
+}
+
+// Registers the objects and takes the bus names, once the state journal has
+// been picked up
+static int bus_context_publish(bus_context_t* ctx) {
+  int r;
+  options_t const* opts = ctx->bridge->opts;
+
+  for (size_t i = 0; i < _FRONTEND_MAX; i++) {
+    if ((opts->frontends & (1u << i)) == 0) continue;
+
+    r = sd_bus_add_object_vtable(
+      ctx->user_bus,
+      nullptr,
+      FRONTENDS[i].path,
+      FRONTENDS[i].interface,
+      FRONTENDS[i].vtable,
+      ctx
+    );
+    if (r < 0) return r;
+  }
+
+  r = sd_bus_add_object_vtable(
+    ctx->user_bus,
+    nullptr,
+    "/io/github/notpeelz/SdInhibitBridge1",
+    "io.github.notpeelz.SdInhibitBridge1",
+    bus_vtable_bridge,
+    ctx
+  );
+  if (r < 0) return r;
+
+  for (size_t i = 0; i < _FRONTEND_MAX; i++) {
+    if ((opts->frontends & (1u << i)) == 0) continue;
+
+    bus_name_request_t* req = &ctx->name_requests[i];
+    req->ctx = ctx;
+    r = sd_bus_request_name_async(
+      ctx->user_bus,
+      &req->slot,
+      FRONTENDS[i].bus_name,
+      0,
+      bus_context_on_name,
+      req
+    );
+    if (r < 0) return r;
+  }
+
+  return 0;
+}
+
+// Starts serving the context's user bus: picks up the state journal, then
+// registers the objects and takes the bus names. None of it blocks; with
+// --system, a user bus that is slow to answer doesn't hold up the others.
+// Failures past this point are taken care of by bus_context_fail_attach().
+static int bus_context_attach(bus_context_t* ctx) {
+  assert(ctx != nullptr);
+
+  int r;
+  options_t const* opts = ctx->bridge->opts;
+
+  r = sd_bus_match_signal_async(
+    ctx->user_bus,
+    nullptr,
+    "org.freedesktop.DBus",
+    "/org/freedesktop/DBus",
+    "org.freedesktop.DBus",
+    "NameOwnerChanged",
+    bus_on_name_owner_changed,
+    nullptr,
+    ctx
+  );
+  if (r < 0) return r;
+
+  // In user mode, there's nothing left to do once the user bus is gone; the
+  // process gets torn down along with the rest of the session
+  if (opts->system) {
+    r = sd_bus_match_signal_async(
+      ctx->user_bus,
+      nullptr,
+      nullptr,
+      "/org/freedesktop/DBus/Local",
+      "org.freedesktop.DBus.Local",
+      "Disconnected",
+      user_bus_on_disconnected,
+      nullptr,
+      ctx
+    );
+    if (r < 0) return r;
+  }
+
+  // Peers that vanish after this are caught by the match above
+  return bus_context_restore(ctx);
+}
+
+static int bridge_add_context(
+  bridge_t* bridge,
+  uid_t uid,
+  sd_bus* user_bus,
+  bus_context_t** ret
+) {
+  assert(bridge != nullptr);
+  assert(user_bus != nullptr);
+
+  void* contexts = reallocarray(
+    bridge->contexts,
+    bridge->contexts_length + 1,
+    sizeof(*bridge->contexts)
+  );
+  if (contexts == nullptr) return -ENOMEM;
+  bridge->contexts = contexts;
+
+  bus_context_t* ctx = bus_context_create(bridge, uid, user_bus);
+  if (ctx == nullptr) return -ENOMEM;
+
+  bridge->contexts[bridge->contexts_length++] = ctx;
+  if (ret != nullptr) {
+    *ret = ctx;
+  }
+  return 0;
+}
+
+static bool bridge_get_context(
+  bridge_t* bridge,
+  uid_t uid,
+  bus_context_t** ret
+) {
+  for (size_t i = 0; i < bridge->contexts_length; i++) {
+    if (bridge->contexts[i]->uid == uid) {
+      if (ret != nullptr) {
+        *ret = bridge->contexts[i];
+      }
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Contexts are only ever destroyed from here, so that no callback has one
+// pulled out from under it
+static int bridge_on_reap(sd_event_source* s, void* userdata) {
+  (void)s;
+
+  auto bridge = (bridge_t*)userdata;
+
+  bool resync = false;
+  size_t n = 0;
+  for (size_t i = 0; i < bridge->contexts_length; i++) {
+    bus_context_t* ctx = bridge->contexts[i];
+    if (!ctx->closing) {
+      bridge->contexts[n++] = ctx;
+      continue;
+    }
+    resync = resync || ctx->disconnected;
+
+    // Unique names are only unique for the lifetime of a bus, so the peers
+    // in the journal can't be told apart from the ones of the next bus
+    if (ctx->disconnected && ctx->journal_path != nullptr) {
+      (void)unlink(ctx->journal_path);
+    }
+
+    fprintf(
+      stderr,
+      SD_INFO "detached from user bus\n"
+      SD_INFO "  uid=%u\n",
+      (unsigned)ctx->uid
+    );
+    bus_context_destroy(ctx);
+  }
+  bridge->contexts_length = n;
+
+  // The user may still be around, e.g. if only their bus was restarted.
+  // Contexts that failed to attach are left be until the next session
+  // change, rather than retried in a loop.
+  if (resync && bridge->opts->system && bridge->system_bus != nullptr) {
+    return bridge_sync_users(bridge);
+  }
+
+  return 0;
+}
+
+// The user's primary and supplementary groups, as from their passwd and group
+// entries
+static int user_get_groups(
+  uid_t uid,
+  gid_t* ret_gid,
+  gid_t** ret_groups,
+  size_t* ret_length
+) {
+  errno = 0;
+  struct passwd* pw = getpwuid(uid);
+  if (pw == nullptr) {
+    return errno != 0 ? -errno : -ESRCH;
+  }
+
+  gid_t* groups = nullptr;
+  int n = 16;
+  while (true) {
+    void* new_groups = reallocarray(groups, (size_t)n, sizeof(*groups));
+    if (new_groups == nullptr) {
+      free(groups);
+      return -ENOMEM;
+    }
+    groups = new_groups;
+
+    int length = n;
+    if (getgrouplist(pw->pw_name, pw->pw_gid, groups, &length) >= 0) {
+      n = length;
+      break;
+    }
+    // Tells how many it needs
+    n = length > n ? length : n * 2;
   }
 
-  return false;
+  *ret_gid = pw->pw_gid;
+  *ret_groups = groups;
+  *ret_length = (size_t)n;
+  return 0;
 }
 
-static int setup_signal_handlers(sd_event* event) {
-  assert(event != nullptr);
-
+static int bridge_open_user_bus(uid_t uid, sd_bus** ret) {
   int r;
-  sigset_t ss;
 
-  if (
-    sigemptyset(&ss) < 0
-    || sigaddset(&ss, SIGTERM) < 0
-    || sigaddset(&ss, SIGINT) < 0
-  ) {
-    goto fail;
-  }
+  char address[64];
+  (void)snprintf(
+    address,
+    sizeof(address),
+    "unix:path=/run/user/%u/bus",
+    (unsigned)uid
+  );
 
-  if (sigprocmask(SIG_BLOCK, &ss, nullptr) < 0) {
-    goto fail;
+  _cleanup_(sd_bus_flush_close_unrefp)
+  sd_bus* bus = nullptr;
+
+  r = sd_bus_new(&bus);
+  if (r < 0) return r;
+
+  r = sd_bus_set_address(bus, address);
+  if (r < 0) return r;
+
+  r = sd_bus_set_bus_client(bus, true);
+  if (r < 0) return r;
+
+  gid_t gid;
+  _cleanup_(freep)
+  gid_t* groups = nullptr;
+  size_t groups_length;
+  r = user_get_groups(uid, &gid, &groups, &groups_length);
+  if (r < 0) return r;
+
+  int n = getgroups(0, nullptr);
+  if (n < 0) return -errno;
+
+  _cleanup_(freep)
+  gid_t* saved_groups = calloc(n > 0 ? (size_t)n : 1, sizeof(*saved_groups));
+  if (saved_groups == nullptr) return -ENOMEM;
+
+  n = getgroups(n, saved_groups);
+  if (n < 0) return -errno;
+
+  gid_t saved_gid = getegid();
+
+  // A user bus only lets in its own user, as told by the credentials of the
+  // connecting socket. Those are taken on connect(), which sd_bus_start()
+  // does before returning, so we only need to be the user for that long,
+  // groups included: the bus sees those too.
+  if (setgroups(groups_length, groups) < 0) return -errno;
+  if (setegid(gid) < 0) {
+    r = -errno;
+    goto restore_groups;
+  }
+  if (seteuid(uid) < 0) {
+    r = -errno;
+    goto restore_gid;
   }
 
-  r = sd_event_add_signal(event, nullptr, SIGTERM, nullptr, nullptr);
-  if (r < 0) goto fail;
+  r = sd_bus_start(bus);
 
-  r = sd_event_add_signal(event, nullptr, SIGINT, nullptr, nullptr);
-  if (r < 0) goto fail;
+  // None of these can fail: the real uid is still root
+  if (seteuid(0) < 0) abort();
+restore_gid:
+  if (setegid(saved_gid) < 0) abort();
+restore_groups:
+  if (setgroups((size_t)n, saved_groups) < 0) abort();
 
-  return 0;
+  if (r < 0) return r;
 
-fail:
-  return 1;
+  *ret = bus;
+  bus = nullptr;
+  return 0;
 }
 
-static int method_inhibit(
-  sd_bus_message* m,
-  void* userdata,
-  sd_bus_error* err
-) {
-  (void)err;
+static int bridge_attach_user(bridge_t* bridge, uid_t uid) {
+  assert(bridge != nullptr);
 
   int r;
-  auto ctx = (bus_context_t*)userdata;
 
-  char const* sender = sd_bus_message_get_sender(m);
+  _cleanup_(sd_bus_flush_close_unrefp)
+  sd_bus* user_bus = nullptr;
 
-  char* app_name;
-  r = sd_bus_message_read_basic(m, 's', &app_name);
+  r = bridge_open_user_bus(uid, &user_bus);
   if (r < 0) return r;
 
-  char* reason;
-  r = sd_bus_message_read_basic(m, 's', &reason);
+  r = sd_bus_attach_event(user_bus, bridge->event, PRIORITY_CLIENT);
   if (r < 0) return r;
 
-  bus_peer_t* peer;
-  r = bus_context_get_or_create_peer(ctx, sender, &peer);
+  bus_context_t* ctx;
+  r = bridge_add_context(bridge, uid, user_bus, &ctx);
   if (r < 0) return r;
 
-  uint32_t id;
-  r = inhibitman_add(peer->im, app_name, reason, &id);
+  r = bus_context_attach(ctx);
   if (r < 0) {
-    fprintf(
-      stderr,
-      SD_ERR "inhibit: %s\n"
-      SD_ERR "  name=%s\n"
-      SD_ERR "  app_name=%s\n"
-      SD_ERR "  reason=%s\n",
-      strerror(-r),
-      sender,
-      app_name,
-      reason
-    );
-    return sd_bus_reply_method_errnof(m, r, "failed to add inhibitor: %m");
+    // Drop it right away: nothing can have been dispatched on it yet
+    bridge->contexts_length--;
+    bus_context_destroy(ctx);
+    return r;
   }
 
   fprintf(
     stderr,
-    SD_DEBUG "inhibit\n"
-    SD_DEBUG "  name=%s\n"
-    SD_DEBUG "  app_name=%s\n"
-    SD_DEBUG "  reason=%s\n"
-    SD_DEBUG "  cookie=%u\n",
-    sender,
-    app_name,
-    reason,
-    id
+    SD_INFO "attached to user bus\n"
+    SD_INFO "  uid=%u\n",
+    (unsigned)uid
   );
+  return 0;
+}
 
-  return sd_bus_reply_method_return(m, "u", id);
+// Whether the user has a session. Lingering users keep their user bus
+// around, but nobody is there to be kept from going idle.
+static bool user_is_logged_in(uid_t uid) {
+  _cleanup_(freep)
+  char* state = nullptr;
+
+  if (sd_uid_get_state(uid, &state) < 0) {
+    return false;
+  }
+
+  return strcmp(state, "online") == 0 || strcmp(state, "active") == 0;
 }
 
-static int method_uninhibit(
-  sd_bus_message* m,
-  void* userdata,
-  sd_bus_error* err
+static int bridge_on_attach_retry(
+  sd_event_source* s,
+  uint64_t usec,
+  void* userdata
 ) {
-  (void)err;
+  (void)s;
+  (void)usec;
 
-  auto ctx = (bus_context_t*)userdata;
-  int r;
+  auto bridge = (bridge_t*)userdata;
 
-  char const* sender = sd_bus_message_get_sender(m);
+  // Picked up again once we're reconnected
+  if (bridge->system_bus == nullptr) {
+    return 0;
+  }
 
-  uint32_t id;
-  r = sd_bus_message_read_basic(m, 'u', &id);
-  if (r < 0) return r;
+  return bridge_sync_users(bridge);
+}
 
-  bus_peer_t* peer;
-  if (!bus_context_get_peer(ctx, sender, &peer)) {
-    goto invalid;
-  }
+static int bridge_schedule_attach_retry(bridge_t* bridge) {
+  assert(bridge != nullptr);
 
-  if (!inhibitman_remove(peer->im, id)) {
-    goto invalid;
+  int r;
+
+  if (bridge->attach_retries >= ATTACH_RETRIES_MAX) {
+    fprintf(stderr, SD_WARNING "giving up on attaching to user buses\n");
+    return 0;
   }
+  bridge->attach_retries++;
 
-  fprintf(
-    stderr,
-    SD_DEBUG "uninhibit\n"
-    SD_DEBUG "  peer=%s\n"
-    SD_DEBUG "  cookie=%u\n",
-    sender,
-    id
-  );
+  if (bridge->attach_source == nullptr) {
+    r = sd_event_add_time_relative(
+      bridge->event,
+      &bridge->attach_source,
+      CLOCK_MONOTONIC,
+      ATTACH_RETRY_DELAY,
+      0,
+      bridge_on_attach_retry,
+      bridge
+    );
+    if (r < 0) return r;
 
-  return sd_bus_reply_method_return(m, "");
+    return sd_event_source_set_priority(
+      bridge->attach_source,
+      PRIORITY_HOUSEKEEPING
+    );
+  }
 
-invalid:
-  fprintf(
-    stderr,
-    SD_ERR "uninhibit: invalid cookie\n"
-    SD_ERR "  peer=%s\n"
-    SD_ERR "  cookie=%u\n",
-    sender,
-    id
+  r = sd_event_source_set_time_relative(
+    bridge->attach_source,
+    ATTACH_RETRY_DELAY
   );
-  return sd_bus_reply_method_errnof(m, EINVAL, "invalid cookie");
-}
+  if (r < 0) return r;
 
-static sd_bus_vtable const bus_vtable_screensaver[] = {
-  SD_BUS_VTABLE_START(0),
-  SD_BUS_METHOD_WITH_ARGS(
-    "Inhibit",
-    SD_BUS_ARGS(
-      "s", app_name,
-      "s", reason
-    ),
-    SD_BUS_RESULT("u", cookie),
-    method_inhibit,
-    0
-  ),
-  SD_BUS_METHOD_WITH_ARGS(
-    "UnInhibit",
-    SD_BUS_ARGS("u", cookie),
-    SD_BUS_NO_RESULT,
-    method_uninhibit,
-    0
-  ),
-  SD_BUS_VTABLE_END,
-};
+  return sd_event_source_set_enabled(bridge->attach_source, SD_EVENT_ONESHOT);
+}
 
-static int bus_on_name_owner_changed(
-  sd_bus_message* m,
-  void* userdata,
-  sd_bus_error* ret_error
-) {
-  (void)ret_error;
+// Makes the set of contexts match the set of logged-in users
+static int bridge_sync_users(bridge_t* bridge) {
+  assert(bridge != nullptr);
+  assert(bridge->opts->system);
 
   int r;
-  auto ctx = (bus_context_t*)userdata;
 
-  char* name;
-  char* old_owner;
-  char* new_owner;
+  _cleanup_(freep)
+  uid_t* uids = nullptr;
 
-  r = sd_bus_message_read_basic(m, 's', &name);
-  if (r < 0) return r;
+  int n = sd_get_uids(&uids);
+  if (n < 0) return n;
 
-  r = sd_bus_message_read_basic(m, 's', &old_owner);
-  if (r < 0) return r;
+  for (size_t i = 0; i < bridge->contexts_length; i++) {
+    bus_context_t* ctx = bridge->contexts[i];
+    if (ctx->closing || user_is_logged_in(ctx->uid)) continue;
 
-  r = sd_bus_message_read_basic(m, 's', &new_owner);
-  if (r < 0) return r;
+    ctx->closing = true;
+    r = sd_event_source_set_enabled(bridge->reap_source, SD_EVENT_ONESHOT);
+    if (r < 0) return r;
+  }
 
-  if (!bus_context_get_peer(ctx, name, nullptr)) {
-    return 0;
+  bool retry = false;
+  for (int i = 0; i < n; i++) {
+    // A context that's still being reaped is taken care of once it's gone;
+    // see bridge_on_reap()
+    if (bridge_get_context(bridge, uids[i], nullptr)) continue;
+    if (!user_is_logged_in(uids[i])) continue;
+
+    r = bridge_attach_user(bridge, uids[i]);
+    if (r == -ENOENT || r == -ECONNREFUSED) {
+      // The user's bus isn't up yet; logind announces the session before
+      // the user manager has had a chance to start it
+      retry = true;
+    } else if (r < 0) {
+      fprintf(
+        stderr,
+        SD_WARNING "failed to attach to user bus: %s\n"
+        SD_WARNING "  uid=%u\n",
+        strerror(-r),
+        (unsigned)uids[i]
+      );
+    }
   }
 
-  if (strcmp(name, old_owner) == 0 && strcmp(new_owner, "") == 0) {
-    // The peer disappeared from the bus
-    (void)bus_context_remove_peer(ctx, name);
+  if (!retry) {
+    bridge->attach_retries = 0;
+    return 0;
   }
 
-  return 0;
+  return bridge_schedule_attach_retry(bridge);
 }
 
 static struct option long_options[] = {
   {"help", no_argument, nullptr, 'h'},
   {"version", no_argument, nullptr, 'V'},
+  {"max-inhibit", required_argument, nullptr, 't'},
+  {"policy", required_argument, nullptr, 'p'},
+  {"frontend", required_argument, nullptr, 'f'},
+  {"journal", required_argument, nullptr, 'j'},
+  {"no-journal", no_argument, nullptr, 'J'},
+  {"system", no_argument, nullptr, 'S'},
+  {"capture", required_argument, nullptr, 'c'},
+  {"backend", required_argument, nullptr, 'B'},
+  {"backend-latency", required_argument, nullptr, 'L'},
+  {"backend-failures", required_argument, nullptr, 'F'},
   {0},
 };
 
 static char usage[] = {
   "Usage: sd-inhibit-bridge [options]\n"
   "\n"
-  "  -h, --help    "
+  "  -h, --help                              "
   "Print help\n"
-  "  -V, --version "
+  "  -V, --version                           "
   "Print version\n"
+  "  -t, --max-inhibit=[APP_NAME=]SECONDS    "
+  "Release inhibitors after SECONDS\n"
+  "                                          "
+  "(for APP_NAME only if given; repeatable)\n"
+  "  -p, --policy=PATH                       "
+  "Filter inhibitors through a policy file\n"
+  "                                          "
+  "(reloaded on SIGHUP)\n"
+  "  -f, --frontend=NAME                     "
+  "Also serve the power-management or\n"
+  "                                          "
+  "gnome-session interface (repeatable)\n"
+  "  -j, --journal=PATH                      "
+  "Where to keep the state journal (default:\n"
+  "                                          "
+  "$XDG_RUNTIME_DIR/sd-inhibit-bridge.journal)\n"
+  "      --no-journal                        "
+  "Don't keep a state journal\n"
+  "  -c, --capture=PATH                      "
+  "Record client traffic to PATH, for\n"
+  "                                          "
+  "sd-inhibit-bridge-replay\n"
+  "      --system                            "
+  "Serve the user bus of every logged-in user\n"
+  "                                          "
+  "from a single instance (as root; the journal\n"
+  "                                          "
+  "is a directory, default: "
+  "/run/sd-inhibit-bridge)\n"
+  "      --backend=NAME                      "
+  "Take locks from logind (default) or null,\n"
+  "                                          "
+  "which only pretends to, for benchmarks\n"
+  "      --backend-latency=USEC              "
+  "Delay every null backend lock by USEC\n"
+  "      --backend-failures=PERCENT          "
+  "Fail PERCENT of null backend locks\n"
 };
 
 int main(int argc, char** argv) {
@@ -407,21 +3877,26 @@ int main(int argc, char** argv) {
 
   int r;
 
-  _cleanup_(sd_bus_flush_close_unrefp)
-  sd_bus* user_bus = nullptr;
+  _cleanup_(options_free)
+  options_t opts = {
+    .frontends = 1u << FRONTEND_SCREENSAVER,
+    .backend = "logind",
+  };
 
   _cleanup_(sd_bus_flush_close_unrefp)
-  sd_bus* system_bus = nullptr;
+  sd_bus* user_bus = nullptr;
 
-  _cleanup_(bus_context_destroyp)
-  bus_context_t* ctx = nullptr;
+  _cleanup_(bridge_destroyp)
+  bridge_t* bridge = nullptr;
 
   _cleanup_(sd_event_unrefp)
   sd_event* event = nullptr;
 
+  bool journal = true;
+
   optind = 1;
   while (true) {
-    int c = getopt_long(argc, argv, "hVv", long_options, nullptr);
+    int c = getopt_long(argc, argv, "hVvt:p:f:j:c:", long_options, nullptr);
     if (c < 0) {
       break;
     }
@@ -435,6 +3910,91 @@ int main(int argc, char** argv) {
         fprintf(stderr, "%s", usage);
         goto exit;
       }
+      case 't': {
+        r = options_add_max_inhibit(&opts, optarg);
+        if (r < 0) {
+          fprintf(
+            stderr,
+            SD_ERR "invalid --max-inhibit value: %s\n",
+            optarg
+          );
+          goto fail;
+        }
+        break;
+      }
+      case 'p': {
+        opts.policy_path = optarg;
+        break;
+      }
+      case 'f': {
+        size_t i = 0;
+        while (i < _FRONTEND_MAX && strcmp(FRONTENDS[i].name, optarg) != 0) {
+          i++;
+        }
+        if (i == _FRONTEND_MAX) {
+          fprintf(stderr, SD_ERR "unknown frontend: %s\n", optarg);
+          goto fail;
+        }
+        opts.frontends |= 1u << i;
+        break;
+      }
+      case 'j': {
+        free((void*)opts.journal_path);
+        opts.journal_path = strdup(optarg);
+        if (opts.journal_path == nullptr) goto fail;
+        journal = true;
+        break;
+      }
+      case 'J': {
+        journal = false;
+        break;
+      }
+      case 'S': {
+        opts.system = true;
+        break;
+      }
+      case 'c': {
+        opts.capture_path = optarg;
+        break;
+      }
+      case 'B': {
+        if (strcmp(optarg, "logind") != 0 && strcmp(optarg, "null") != 0) {
+          fprintf(stderr, SD_ERR "unknown backend: %s\n", optarg);
+          goto fail;
+        }
+        opts.backend = optarg;
+        break;
+      }
+      case 'L': {
+        char* end;
+        errno = 0;
+        unsigned long long n = strtoull(optarg, &end, 10);
+        if (errno != 0 || *optarg == '\0' || *end != '\0') {
+          fprintf(
+            stderr,
+            SD_ERR "invalid --backend-latency value: %s\n",
+            optarg
+          );
+          goto fail;
+        }
+        opts.backend_latency_usec = n;
+        break;
+      }
+      case 'F': {
+        char* end;
+        errno = 0;
+        unsigned long n = strtoul(optarg, &end, 10);
+        if (errno != 0 || *optarg == '\0' || *end != '\0' || n > 100) {
+          fprintf(
+            stderr,
+            SD_ERR "invalid --backend-failures value: %s\n",
+            optarg
+          );
+          goto fail;
+        }
+        opts.backend_failure_percent = (unsigned)n;
+        break;
+      }
       default: {
         fprintf(stderr, "%s", usage);
         goto fail;
@@ -447,74 +4007,140 @@ int main(int argc, char** argv) {
     goto fail;
   }
 
+  if (opts.system && geteuid() != 0) {
+    fprintf(stderr, SD_ERR "--system requires root\n");
+    goto fail;
+  }
+
+  if (!journal) {
+    free((void*)opts.journal_path);
+    opts.journal_path = nullptr;
+  } else if (opts.system) {
+    if (opts.journal_path == nullptr) {
+      opts.journal_path = strdup("/run/sd-inhibit-bridge");
+      if (opts.journal_path == nullptr) goto fail;
+    }
+
+    if (mkdir(opts.journal_path, 0700) < 0 && errno != EEXIST) {
+      fprintf(
+        stderr,
+        SD_WARNING "failed to create journal directory: %s\n"
+        SD_WARNING "  path=%s\n",
+        strerror(errno),
+        opts.journal_path
+      );
+      free((void*)opts.journal_path);
+      opts.journal_path = nullptr;
+    }
+  } else if (opts.journal_path == nullptr) {
+    char const* runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir != nullptr && runtime_dir[0] == '/') {
+      size_t len = strlen(runtime_dir) + sizeof("/sd-inhibit-bridge.journal");
+      char* path = malloc(len);
+      if (path == nullptr) goto fail;
+      (void)snprintf(path, len, "%s/sd-inhibit-bridge.journal", runtime_dir);
+      opts.journal_path = path;
+    }
+  }
+
   r = sd_event_default(&event);
   if (r < 0) goto fail;
 
   r = setup_signal_handlers(event);
   if (r != 0) goto fail;
 
-  r = sd_bus_open_user(&user_bus);
-  if (r < 0) {
-    fprintf(
-      stderr,
-      SD_ERR "failed to connect to user bus: %s\n",
-      strerror(-r)
-    );
-    goto fail;
-  }
+  bridge = bridge_create(event, &opts);
+  if (bridge == nullptr) goto fail;
 
-  r = sd_bus_open_system(&system_bus);
-  if (r < 0) {
-    fprintf(
-      stderr,
-      SD_ERR "failed to connect to system bus: %s\n",
-      strerror(-r)
-    );
-    goto fail;
+  if (opts.capture_path != nullptr) {
+    r = capture_open(opts.capture_path, &bridge->capture);
+    if (r < 0) {
+      fprintf(
+        stderr,
+        SD_ERR "failed to open capture: %s\n"
+        SD_ERR "  path=%s\n",
+        strerror(-r),
+        opts.capture_path
+      );
+      goto fail;
+    }
   }
 
-  r = sd_bus_attach_event(system_bus, event, SD_EVENT_PRIORITY_NORMAL);
+  r = bridge_load_policy(bridge);
   if (r < 0) goto fail;
 
-  r = sd_bus_attach_event(user_bus, event, SD_EVENT_PRIORITY_NORMAL);
+  r = sd_event_add_signal(
+    event,
+    &bridge->sighup_source,
+    SIGHUP,
+    bridge_on_sighup,
+    bridge
+  );
   if (r < 0) goto fail;
 
-  ctx = bus_context_create(system_bus);
-  if (ctx == nullptr) goto fail;
+  r = sd_event_source_set_priority(
+    bridge->sighup_source,
+    PRIORITY_HOUSEKEEPING
+  );
+  if (r < 0) goto fail;
 
-  r = sd_bus_match_signal(
-    user_bus,
-    nullptr,
-    "org.freedesktop.DBus",
-    "/org/freedesktop/DBus",
-    "org.freedesktop.DBus",
-    "NameOwnerChanged",
-    bus_on_name_owner_changed,
-    ctx
+  r = sd_event_add_signal(
+    event,
+    &bridge->sigusr1_source,
+    SIGUSR1,
+    bridge_on_sigusr1,
+    bridge
   );
   if (r < 0) goto fail;
 
-  r = sd_bus_add_object_vtable(
-    user_bus,
-    nullptr,
-    "/org/freedesktop/ScreenSaver",
-    "org.freedesktop.ScreenSaver",
-    bus_vtable_screensaver,
-    ctx
+  r = sd_event_source_set_priority(
+    bridge->sigusr1_source,
+    PRIORITY_HOUSEKEEPING
   );
   if (r < 0) goto fail;
 
-  r = sd_bus_request_name(user_bus, "org.freedesktop.ScreenSaver", 0);
+  r = bridge_connect_system(bridge);
   if (r < 0) {
     fprintf(
       stderr,
-      SD_ERR "failed to acquire name %s: %s\n",
-      "org.freedesktop.ScreenSaver",
+      SD_ERR "failed to connect to system bus: %s\n",
       strerror(-r)
     );
     goto fail;
   }
 
+  if (opts.system) {
+    r = bridge_sync_users(bridge);
+    if (r < 0) {
+      fprintf(
+        stderr,
+        SD_ERR "failed to enumerate users: %s\n",
+        strerror(-r)
+      );
+      goto fail;
+    }
+  } else {
+    r = sd_bus_open_user(&user_bus);
+    if (r < 0) {
+      fprintf(
+        stderr,
+        SD_ERR "failed to connect to user bus: %s\n",
+        strerror(-r)
+      );
+      goto fail;
+    }
+
+    r = sd_bus_attach_event(user_bus, event, PRIORITY_CLIENT);
+    if (r < 0) goto fail;
+
+    bus_context_t* ctx;
+    r = bridge_add_context(bridge, getuid(), user_bus, &ctx);
+    if (r < 0) goto fail;
+
+    r = bus_context_attach(ctx);
+    if (r < 0) goto fail;
+  }
+
   r = sd_event_loop(event);
   if (r < 0) {
     fprintf(
@@ -0,0 +1,655 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <assert.h>
+#include <errno.h>
+#include <systemd/sd-daemon.h>
+
+#include "policy.h"
+
+// Rules are compiled into one prefix trie per field, keyed on the literal
+// part of each pattern (everything before the first glob metacharacter).
+// Matching a string walks its trie once, collecting the rules that match
+// into a bitset; the winning rule is the first one set in the intersection
+// of every field's bitset.
+
+typedef struct rule {
+  policy_action_t action;
+  char const* who;
+  char const* why;
+  char const* what;
+  char const* mode;
+} rule_t;
+
+typedef struct tail {
+  size_t rule;
+  // Glob for the rest of the string, starting with a metacharacter
+  char const* pattern;
+} tail_t;
+
+typedef struct trie_node trie_node_t;
+struct trie_node {
+  unsigned char c;
+  trie_node_t* child;
+  trie_node_t* sibling;
+  // Rules whose pattern is exactly the path to this node
+  size_t* exact;
+  size_t exact_length;
+  // Rules whose pattern continues with a glob from this node
+  tail_t* tails;
+  size_t tails_length;
+};
+
+typedef struct field_index {
+  trie_node_t root;
+  // Rules that don't constrain this field
+  uint64_t* any;
+} field_index_t;
+
+struct policy {
+  rule_t* rules;
+  size_t rules_length;
+  size_t words;
+  field_index_t fields[_POLICY_FIELD_MAX];
+  // Per-evaluation bitsets, kept around to avoid allocating on every call
+  uint64_t* match;
+  uint64_t* scratch;
+};
+
+static char const* const FIELD_NAMES[_POLICY_FIELD_MAX] = {
+  [POLICY_FIELD_SENDER] = "sender",
+  [POLICY_FIELD_APP_NAME] = "app_name",
+  [POLICY_FIELD_REASON] = "reason",
+  [POLICY_FIELD_COMM] = "comm",
+  [POLICY_FIELD_UNIT] = "unit",
+};
+
+static char const GLOB_CHARS[] = "*?[\\";
+
+// What logind accepts in Inhibit()
+static char const* const WHATS[] = {
+  "shutdown",
+  "sleep",
+  "idle",
+  "handle-power-key",
+  "handle-suspend-key",
+  "handle-hibernate-key",
+  "handle-lid-switch",
+};
+
+static char const* const MODES[] = {
+  "block",
+  "block-weak",
+  "delay",
+};
+
+static void trie_node_free_children(trie_node_t* node) {
+  trie_node_t* child = node->child;
+  while (child != nullptr) {
+    trie_node_t* sibling = child->sibling;
+    trie_node_free_children(child);
+    free(child);
+    child = sibling;
+  }
+
+  for (size_t i = 0; i < node->tails_length; i++) {
+    free((void*)node->tails[i].pattern);
+  }
+  free(node->tails);
+  free(node->exact);
+}
+
+static trie_node_t* trie_node_get_child(trie_node_t* node, unsigned char c) {
+  for (trie_node_t* child = node->child; child != nullptr; child = child->sibling) {
+    if (child->c == c) {
+      return child;
+    }
+  }
+
+  return nullptr;
+}
+
+static int trie_insert(trie_node_t* root, char const* pattern, size_t rule) {
+  size_t literal = strcspn(pattern, GLOB_CHARS);
+
+  trie_node_t* node = root;
+  for (size_t i = 0; i < literal; i++) {
+    auto c = (unsigned char)pattern[i];
+    trie_node_t* child = trie_node_get_child(node, c);
+    if (child == nullptr) {
+      child = calloc(1, sizeof(*child));
+      if (child == nullptr) return -ENOMEM;
+      child->c = c;
+      child->sibling = node->child;
+      node->child = child;
+    }
+    node = child;
+  }
+
+  if (pattern[literal] == '\0') {
+    void* exact = reallocarray(
+      node->exact,
+      node->exact_length + 1,
+      sizeof(*node->exact)
+    );
+    if (exact == nullptr) return -ENOMEM;
+    node->exact = exact;
+    node->exact[node->exact_length++] = rule;
+    return 0;
+  }
+
+  void* tails = reallocarray(
+    node->tails,
+    node->tails_length + 1,
+    sizeof(*node->tails)
+  );
+  if (tails == nullptr) return -ENOMEM;
+  node->tails = tails;
+
+  char* tail = strdup(&pattern[literal]);
+  if (tail == nullptr) return -ENOMEM;
+
+  node->tails[node->tails_length++] = (tail_t){
+    .rule = rule,
+    .pattern = tail,
+  };
+  return 0;
+}
+
+static inline void bitset_set(uint64_t* bits, size_t idx) {
+  bits[idx / 64] |= 1ull << (idx % 64);
+}
+
+static void trie_match(
+  trie_node_t* root,
+  char const* s,
+  uint64_t* bits
+) {
+  trie_node_t* node = root;
+  for (size_t i = 0;; i++) {
+    for (size_t j = 0; j < node->tails_length; j++) {
+      tail_t const* tail = &node->tails[j];
+      // A lone '*' (i.e. a prefix match) is by far the most common tail
+      if (
+        strcmp(tail->pattern, "*") == 0
+        || fnmatch(tail->pattern, &s[i], 0) == 0
+      ) {
+        bitset_set(bits, tail->rule);
+      }
+    }
+
+    if (s[i] == '\0') {
+      for (size_t j = 0; j < node->exact_length; j++) {
+        bitset_set(bits, node->exact[j]);
+      }
+      return;
+    }
+
+    node = trie_node_get_child(node, (unsigned char)s[i]);
+    if (node == nullptr) return;
+  }
+}
+
+void policy_destroy(policy_t* p) {
+  if (p == nullptr) return;
+
+  for (size_t i = 0; i < p->rules_length; i++) {
+    free((void*)p->rules[i].who);
+    free((void*)p->rules[i].why);
+    free((void*)p->rules[i].what);
+    free((void*)p->rules[i].mode);
+  }
+  free(p->rules);
+
+  for (size_t i = 0; i < _POLICY_FIELD_MAX; i++) {
+    trie_node_free_children(&p->fields[i].root);
+    free(p->fields[i].any);
+  }
+
+  free(p->match);
+  free(p->scratch);
+  free(p);
+}
+
+size_t policy_rule_count(policy_t* p) {
+  assert(p != nullptr);
+  return p->rules_length;
+}
+
+// Splits off the next whitespace-separated token, unquoting it in place.
+// Double quotes group whitespace; backslash escapes the next character
+// inside quotes.
+static int next_token(char** cursor, char** token) {
+  char* s = *cursor;
+  while (isspace((unsigned char)*s)) s++;
+
+  if (*s == '\0') {
+    *cursor = s;
+    return 0;
+  }
+
+  char* out = s;
+  *token = s;
+  bool quoted = false;
+  while (*s != '\0' && (quoted || !isspace((unsigned char)*s))) {
+    if (*s == '"') {
+      quoted = !quoted;
+      s++;
+      continue;
+    }
+
+    if (quoted && *s == '\\' && s[1] != '\0') {
+      s++;
+    }
+
+    *out++ = *s++;
+  }
+
+  if (quoted) {
+    return -EINVAL;
+  }
+
+  if (*s != '\0') s++;
+  *out = '\0';
+  *cursor = s;
+  return 1;
+}
+
+typedef struct parsed_rule {
+  policy_action_t action;
+  char const* patterns[_POLICY_FIELD_MAX];
+  char const* who;
+  char const* why;
+  char const* what;
+  char const* mode;
+} parsed_rule_t;
+
+// Returns the index of s in set, or -1
+static int index_of(
+  char const* s,
+  size_t len,
+  char const* const* set,
+  size_t n
+) {
+  for (size_t i = 0; i < n; i++) {
+    if (strlen(set[i]) == len && strncmp(s, set[i], len) == 0) {
+      return (int)i;
+    }
+  }
+
+  return -1;
+}
+
+static bool is_one_of(
+  char const* s,
+  size_t len,
+  char const* const* set,
+  size_t n
+) {
+  return index_of(s, len, set, n) >= 0;
+}
+
+// what= is a colon-separated list, like logind's. Delay locks only exist
+// for shutdown and sleep; logind refuses anything else.
+static bool validate_lock(
+  char const* what,
+  char const* mode,
+  char const** err
+) {
+  if (what != nullptr) {
+    // Each kind at most once, which also bounds the length of what
+    unsigned seen = 0;
+    char const* s = what;
+    do {
+      size_t len = strcspn(s, ":");
+      int idx = index_of(s, len, WHATS, sizeof(WHATS) / sizeof(*WHATS));
+      if (idx < 0) {
+        *err = "unknown what";
+        return false;
+      }
+      if (seen & 1u << idx) {
+        *err = "duplicate what";
+        return false;
+      }
+      seen |= 1u << idx;
+
+      bool delayable = (len == 5 && strncmp(s, "sleep", len) == 0)
+        || (len == 8 && strncmp(s, "shutdown", len) == 0);
+      if (!delayable && mode != nullptr && strcmp(mode, "delay") == 0) {
+        *err = "mode=delay only applies to sleep and shutdown";
+        return false;
+      }
+
+      s += len;
+    } while (*s++ == ':');
+  }
+
+  if (mode != nullptr) {
+    if (!is_one_of(mode, strlen(mode), MODES, sizeof(MODES) / sizeof(*MODES))) {
+      *err = "unknown mode";
+      return false;
+    }
+
+    if (what == nullptr && strcmp(mode, "delay") == 0) {
+      // The default (idle) can't be delayed
+      *err = "mode=delay requires what=";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static int parse_rule(char* line, parsed_rule_t* rule, char const** err) {
+  int r;
+  char* cursor = line;
+  char* token;
+
+  *rule = (parsed_rule_t){0};
+
+  r = next_token(&cursor, &token);
+  if (r < 0) goto unterminated;
+  if (r == 0 || token[0] == '#') {
+    // Blank line or comment
+    return 0;
+  }
+
+  if (strcmp(token, "allow") == 0) {
+    rule->action = POLICY_ACTION_ALLOW;
+  } else if (strcmp(token, "deny") == 0) {
+    rule->action = POLICY_ACTION_DENY;
+  } else if (strcmp(token, "remap") == 0) {
+    rule->action = POLICY_ACTION_REMAP;
+  } else {
+    *err = "unknown action";
+    return -EINVAL;
+  }
+
+  while ((r = next_token(&cursor, &token)) > 0) {
+    char* value = strchr(token, '=');
+    if (value == nullptr) {
+      *err = "expected KEY=VALUE";
+      return -EINVAL;
+    }
+    *value++ = '\0';
+
+    char const** slot = nullptr;
+    for (size_t i = 0; i < _POLICY_FIELD_MAX; i++) {
+      if (strcmp(token, FIELD_NAMES[i]) == 0) {
+        slot = &rule->patterns[i];
+        break;
+      }
+    }
+
+    if (slot == nullptr) {
+      if (strcmp(token, "who") == 0) {
+        slot = &rule->who;
+      } else if (strcmp(token, "why") == 0) {
+        slot = &rule->why;
+      } else if (strcmp(token, "what") == 0) {
+        slot = &rule->what;
+      } else if (strcmp(token, "mode") == 0) {
+        slot = &rule->mode;
+      } else {
+        *err = "unknown key";
+        return -EINVAL;
+      }
+    }
+
+    if (*slot != nullptr) {
+      *err = "duplicate key";
+      return -EINVAL;
+    }
+    *slot = value;
+  }
+  if (r < 0) goto unterminated;
+
+  bool remaps = rule->who != nullptr || rule->why != nullptr;
+  if (rule->action == POLICY_ACTION_REMAP && !remaps) {
+    *err = "remap requires who= or why=";
+    return -EINVAL;
+  }
+  if (rule->action != POLICY_ACTION_REMAP && remaps) {
+    *err = "who= and why= are only valid with remap";
+    return -EINVAL;
+  }
+
+  bool locks = rule->what != nullptr || rule->mode != nullptr;
+  if (rule->action == POLICY_ACTION_DENY && locks) {
+    *err = "what= and mode= are not valid with deny";
+    return -EINVAL;
+  }
+  if (!validate_lock(rule->what, rule->mode, err)) {
+    return -EINVAL;
+  }
+
+  return 1;
+
+unterminated:
+  *err = "unterminated quote";
+  return -EINVAL;
+}
+
+static int policy_add_rule(policy_t* p, parsed_rule_t const* parsed) {
+  void* rules = reallocarray(
+    p->rules,
+    p->rules_length + 1,
+    sizeof(*p->rules)
+  );
+  if (rules == nullptr) return -ENOMEM;
+  p->rules = rules;
+
+  rule_t* rule = &p->rules[p->rules_length];
+  *rule = (rule_t){
+    .action = parsed->action,
+  };
+  p->rules_length++;
+
+  if (parsed->who != nullptr) {
+    rule->who = strdup(parsed->who);
+    if (rule->who == nullptr) return -ENOMEM;
+  }
+
+  if (parsed->why != nullptr) {
+    rule->why = strdup(parsed->why);
+    if (rule->why == nullptr) return -ENOMEM;
+  }
+
+  if (parsed->what != nullptr) {
+    rule->what = strdup(parsed->what);
+    if (rule->what == nullptr) return -ENOMEM;
+  }
+
+  if (parsed->mode != nullptr) {
+    rule->mode = strdup(parsed->mode);
+    if (rule->mode == nullptr) return -ENOMEM;
+  }
+
+  return 0;
+}
+
+static int policy_compile(policy_t* p, parsed_rule_t const* parsed) {
+  int r;
+
+  p->words = (p->rules_length + 63) / 64;
+  if (p->words == 0) {
+    return 0;
+  }
+
+  p->match = calloc(p->words, sizeof(*p->match));
+  p->scratch = calloc(p->words, sizeof(*p->scratch));
+  if (p->match == nullptr || p->scratch == nullptr) return -ENOMEM;
+
+  for (size_t f = 0; f < _POLICY_FIELD_MAX; f++) {
+    field_index_t* field = &p->fields[f];
+    field->any = calloc(p->words, sizeof(*field->any));
+    if (field->any == nullptr) return -ENOMEM;
+
+    for (size_t i = 0; i < p->rules_length; i++) {
+      char const* pattern = parsed[i].patterns[f];
+      if (pattern == nullptr || strcmp(pattern, "*") == 0) {
+        bitset_set(field->any, i);
+        continue;
+      }
+
+      r = trie_insert(&field->root, pattern, i);
+      if (r < 0) return r;
+    }
+  }
+
+  return 0;
+}
+
+int policy_load(char const* path, policy_t** ret) {
+  assert(path != nullptr);
+  assert(ret != nullptr);
+
+  int r;
+  size_t lineno = 0;
+  char* line = nullptr;
+  size_t line_capacity = 0;
+  parsed_rule_t* parsed = nullptr;
+  size_t parsed_length = 0;
+  // Parsed rules point into these, so they're kept until compilation is done
+  char** lines = nullptr;
+
+  _cleanup_(policy_destroyp)
+  policy_t* p = calloc(1, sizeof(*p));
+  if (p == nullptr) return -ENOMEM;
+
+  FILE* f = fopen(path, "re");
+  if (f == nullptr) {
+    r = -errno;
+    fprintf(
+      stderr,
+      SD_ERR "failed to open policy: %s\n"
+      SD_ERR "  path=%s\n",
+      strerror(-r),
+      path
+    );
+    return r;
+  }
+
+  while (getline(&line, &line_capacity, f) >= 0) {
+    lineno++;
+
+    parsed_rule_t rule;
+    char const* err = nullptr;
+    r = parse_rule(line, &rule, &err);
+    if (r < 0) {
+      fprintf(
+        stderr,
+        SD_ERR "invalid policy rule: %s\n"
+        SD_ERR "  path=%s\n"
+        SD_ERR "  line=%zu\n",
+        err,
+        path,
+        lineno
+      );
+      goto out;
+    }
+    if (r == 0) continue;
+
+    void* new_parsed = reallocarray(
+      parsed,
+      parsed_length + 1,
+      sizeof(*parsed)
+    );
+    void* new_lines = reallocarray(lines, parsed_length + 1, sizeof(*lines));
+    if (new_parsed != nullptr) parsed = new_parsed;
+    if (new_lines != nullptr) lines = new_lines;
+    if (new_parsed == nullptr || new_lines == nullptr) {
+      r = -ENOMEM;
+      goto out;
+    }
+
+    parsed[parsed_length] = rule;
+    lines[parsed_length] = line;
+    parsed_length++;
+    line = nullptr;
+    line_capacity = 0;
+
+    r = policy_add_rule(p, &rule);
+    if (r < 0) goto out;
+  }
+
+  if (ferror(f)) {
+    r = -EIO;
+    goto out;
+  }
+
+  r = policy_compile(p, parsed);
+  if (r < 0) goto out;
+
+  *ret = p;
+  p = nullptr;
+  r = 0;
+
+out:
+  for (size_t i = 0; i < parsed_length; i++) {
+    free(lines[i]);
+  }
+  free(lines);
+  free(parsed);
+  free(line);
+  (void)fclose(f);
+  return r;
+}
+
+void policy_eval(
+  policy_t* p,
+  char const* const fields[_POLICY_FIELD_MAX],
+  policy_decision_t* decision
+) {
+  assert(p != nullptr);
+  assert(decision != nullptr);
+
+  *decision = (policy_decision_t){
+    .action = POLICY_ACTION_ALLOW,
+  };
+
+  if (p->words == 0) {
+    return;
+  }
+
+  for (size_t w = 0; w < p->words; w++) {
+    p->match[w] = UINT64_MAX;
+  }
+
+  for (size_t f = 0; f < _POLICY_FIELD_MAX; f++) {
+    field_index_t* field = &p->fields[f];
+
+    memcpy(p->scratch, field->any, p->words * sizeof(*p->scratch));
+    if (fields[f] != nullptr) {
+      trie_match(&field->root, fields[f], p->scratch);
+    }
+
+    bool any = false;
+    for (size_t w = 0; w < p->words; w++) {
+      p->match[w] &= p->scratch[w];
+      any |= p->match[w] != 0;
+    }
+
+    if (!any) {
+      return;
+    }
+  }
+
+  for (size_t w = 0; w < p->words; w++) {
+    if (p->match[w] == 0) continue;
+
+    size_t idx = w * 64 + (size_t)__builtin_ctzll(p->match[w]);
+    if (idx >= p->rules_length) break;
+
+    rule_t const* rule = &p->rules[idx];
+    decision->action = rule->action;
+    decision->who = rule->who;
+    decision->why = rule->why;
+    decision->what = rule->what;
+    decision->mode = rule->mode;
+    return;
+  }
+}
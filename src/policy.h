@@ -0,0 +1,51 @@
+#ifndef SDIB_POLICY_H
+#define SDIB_POLICY_H
+
+#include <stdint.h>
+
+typedef struct policy policy_t;
+
+typedef enum policy_field {
+  POLICY_FIELD_SENDER,
+  POLICY_FIELD_APP_NAME,
+  POLICY_FIELD_REASON,
+  POLICY_FIELD_COMM,
+  POLICY_FIELD_UNIT,
+  _POLICY_FIELD_MAX,
+} policy_field_t;
+
+typedef enum policy_action {
+  POLICY_ACTION_ALLOW,
+  POLICY_ACTION_DENY,
+  POLICY_ACTION_REMAP,
+} policy_action_t;
+
+typedef struct policy_decision {
+  policy_action_t action;
+  // Replacement who/why for POLICY_ACTION_REMAP; nullptr keeps the original.
+  // Owned by the policy.
+  char const* who;
+  char const* why;
+  // logind lock to take instead of the default; nullptr keeps it. Owned by
+  // the policy.
+  char const* what;
+  char const* mode;
+} policy_decision_t;
+
+// Parses and compiles a rule file. Errors are reported on stderr.
+int policy_load(char const* path, policy_t** ret);
+
+void policy_destroy(policy_t* p);
+DEFINE_POINTER_CLEANUP_FUNC(policy_t, policy_destroy);
+
+size_t policy_rule_count(policy_t* p);
+
+// The first rule (in file order) whose patterns all match decides; if none
+// does, the inhibitor is allowed.
+void policy_eval(
+  policy_t* p,
+  char const* const fields[_POLICY_FIELD_MAX],
+  policy_decision_t* decision
+);
+
+#endif
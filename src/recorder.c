@@ -0,0 +1,80 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include "recorder.h"
+
+static_assert(sizeof(recorder_event_t) == 48);
+static_assert((RECORDER_CAPACITY & (RECORDER_CAPACITY - 1)) == 0);
+
+// Overwritten in place once full; nothing is ever freed
+static recorder_event_t events[RECORDER_CAPACITY];
+// Number of events ever recorded
+static uint64_t written;
+
+uint64_t recorder_now(void) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+    return 0;
+  }
+
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void recorder_record(
+  recorder_type_t type,
+  uint32_t uid,
+  char const* peer,
+  uint32_t cookie,
+  uint32_t duration_usec,
+  int32_t result
+) {
+  recorder_event_t* event = &events[written & (RECORDER_CAPACITY - 1)];
+  written++;
+
+  event->timestamp = recorder_now();
+  event->uid = uid;
+  event->cookie = cookie;
+  event->duration_usec = duration_usec;
+  event->result = result;
+  event->type = (uint8_t)type;
+
+  if (peer == nullptr) {
+    peer = "";
+  }
+  size_t len = strnlen(peer, sizeof(event->peer) - 1);
+  memcpy(event->peer, peer, len);
+  event->peer[len] = '\0';
+}
+
+bool recorder_next(size_t* pos, recorder_event_t* event) {
+  assert(pos != nullptr);
+  assert(event != nullptr);
+
+  uint64_t first = written > RECORDER_CAPACITY
+    ? written - RECORDER_CAPACITY
+    : 0;
+  uint64_t i = first + *pos;
+  if (i >= written) {
+    return false;
+  }
+
+  *event = events[i & (RECORDER_CAPACITY - 1)];
+  (*pos)++;
+  return true;
+}
+
+char const* recorder_type_name(recorder_type_t type) {
+  static char const* const names[_RECORDER_TYPE_MAX] = {
+    [RECORDER_INHIBIT] = "inhibit",
+    [RECORDER_UNINHIBIT] = "uninhibit",
+    [RECORDER_PEER_GONE] = "peer-gone",
+  };
+
+  if (type <= 0 || type >= _RECORDER_TYPE_MAX) {
+    return "unknown";
+  }
+
+  return names[type];
+}
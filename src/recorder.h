@@ -0,0 +1,52 @@
+#ifndef SDIB_RECORDER_H
+#define SDIB_RECORDER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Flight recorder: the last RECORDER_CAPACITY events, kept around at all
+// times so that there's something to look at after an incident. Recording
+// doesn't allocate and doesn't log.
+
+#define RECORDER_CAPACITY 4096
+
+typedef enum recorder_type {
+  // An Inhibit call was answered; duration covers the logind side
+  RECORDER_INHIBIT = 1,
+  RECORDER_UNINHIBIT,
+  // A peer left the bus; result is the number of inhibitors it still held
+  RECORDER_PEER_GONE,
+  _RECORDER_TYPE_MAX,
+} recorder_type_t;
+
+typedef struct recorder_event {
+  // CLOCK_MONOTONIC, in microseconds
+  uint64_t timestamp;
+  uint32_t uid;
+  uint32_t cookie;
+  uint32_t duration_usec;
+  // Negative errno on failure
+  int32_t result;
+  uint8_t type;
+  // Truncated unique name
+  char peer[23];
+} recorder_event_t;
+
+void recorder_record(
+  recorder_type_t type,
+  uint32_t uid,
+  char const* peer,
+  uint32_t cookie,
+  uint32_t duration_usec,
+  int32_t result
+);
+
+// For measuring durations on the same clock as the timestamps
+uint64_t recorder_now(void);
+
+// Walks the recorded events, oldest first. pos starts out at 0.
+bool recorder_next(size_t* pos, recorder_event_t* event);
+
+char const* recorder_type_name(recorder_type_t type);
+
+#endif
@@ -0,0 +1,943 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <errno.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+#include "capture.h"
+#include "htable.h"
+
+// Plays a capture taken with `sd-inhibit-bridge --capture` back against the
+// bridge on the user bus, with one connection per recorded peer, and
+// reports how long the bridge took to answer, and to broadcast the changes.
+
+typedef struct replay_frontend {
+  char const* bus_name;
+  char const* path;
+  char const* interface;
+  char const* uninhibit;
+  // Inhibit takes (susu) rather than (ss)
+  bool gnome_session;
+} replay_frontend_t;
+
+// Indexed by frontend_t
+static replay_frontend_t const FRONTENDS[] = {
+  {
+    .bus_name = "org.freedesktop.ScreenSaver",
+    .path = "/org/freedesktop/ScreenSaver",
+    .interface = "org.freedesktop.ScreenSaver",
+    .uninhibit = "UnInhibit",
+  },
+  {
+    .bus_name = "org.freedesktop.PowerManagement",
+    .path = "/org/freedesktop/PowerManagement/Inhibit",
+    .interface = "org.freedesktop.PowerManagement.Inhibit",
+    .uninhibit = "UnInhibit",
+  },
+  {
+    .bus_name = "org.gnome.SessionManager",
+    .path = "/org/gnome/SessionManager",
+    .interface = "org.gnome.SessionManager",
+    .uninhibit = "Uninhibit",
+    .gnome_session = true,
+  },
+};
+static size_t const FRONTENDS_LENGTH = sizeof(FRONTENDS) / sizeof(*FRONTENDS);
+
+typedef struct replay_record {
+  capture_record_t rec;
+  char* app_name;
+  char* reason;
+} replay_record_t;
+
+// One per recorded Inhibit call
+typedef struct replay_inhibit {
+  // Peer and serial, then peer and recorded cookie
+  uint64_t serial_key;
+  uint64_t cookie_key;
+  // As handed out by the bridge being replayed against
+  uint32_t cookie;
+  bool answered;
+  bool failed;
+  // UnInhibit that came due before the cookie did; sent along once it does
+  capture_record_t const* uninhibit;
+} replay_inhibit_t;
+
+typedef struct replay_peer {
+  sd_bus* bus;
+  size_t outstanding;
+  // Disconnects once the last of its calls is answered
+  bool gone;
+} replay_peer_t;
+
+typedef struct replay_latencies {
+  uint64_t* samples;
+  size_t length;
+  size_t capacity;
+  size_t errors;
+} replay_latencies_t;
+
+typedef struct replay {
+  sd_event* event;
+  sd_event_source* timer;
+  double speed;
+  uint64_t start;
+  // Number of clients taking turns in a generated workload
+  size_t generate_peers;
+
+  replay_record_t* records;
+  size_t records_length;
+  size_t next;
+
+  replay_inhibit_t* inhibits;
+  size_t inhibits_length;
+  // serial_key -> replay_inhibit_t, cookie_key -> replay_inhibit_t
+  htable_t* serials;
+  htable_t* cookies;
+
+  replay_peer_t* peers;
+  size_t peers_length;
+
+  size_t outstanding;
+  size_t skipped;
+  uint64_t finished;
+  replay_latencies_t inhibit;
+  replay_latencies_t uninhibit;
+
+  // Listens for the bridge's change signals. Each one is timed from the
+  // first reply it covers, which was sent once the change was made.
+  sd_bus* observer;
+  uint64_t unnotified;
+  replay_latencies_t notify;
+  // Gives the signal for the last replies a chance to come in
+  sd_event_source* linger;
+} replay_t;
+
+typedef struct replay_call {
+  replay_t* rp;
+  uint32_t peer;
+  uint64_t sent;
+  // nullptr for UnInhibit
+  replay_inhibit_t* inhibit;
+} replay_call_t;
+
+static uint64_t replay_key(uint32_t peer, uint32_t value) {
+  return (uint64_t)peer << 32 | value;
+}
+
+static uint64_t replay_key_hash(void const* in) {
+  return *(uint64_t const*)in * 0x9e3779b97f4a7c15u;
+}
+
+static bool replay_key_eq(void const* a, void const* b) {
+  return *(uint64_t const*)a == *(uint64_t const*)b;
+}
+
+// Not sd_event_now(): that's when the iteration started, which would hide
+// the time spent on everything dispatched before us
+static uint64_t replay_now(void) {
+  struct timespec ts;
+  (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void replay_latencies_add(replay_latencies_t* l, uint64_t usec) {
+  if (l->length == l->capacity) {
+    size_t capacity = l->capacity > 0 ? l->capacity * 2 : 1024;
+    void* samples = reallocarray(l->samples, capacity, sizeof(*l->samples));
+    // Not worth failing the whole run over
+    if (samples == nullptr) return;
+    l->samples = samples;
+    l->capacity = capacity;
+  }
+
+  l->samples[l->length++] = usec;
+}
+
+static int replay_cmp_u64(void const* a, void const* b) {
+  uint64_t x = *(uint64_t const*)a;
+  uint64_t y = *(uint64_t const*)b;
+  return x < y ? -1 : x > y;
+}
+
+static void replay_latencies_report(
+  char const* name,
+  char const* unit,
+  replay_latencies_t* l
+) {
+  printf("%s: %s=%zu errors=%zu", name, unit, l->length, l->errors);
+  if (l->length == 0) {
+    printf("\n");
+    return;
+  }
+
+  qsort(l->samples, l->length, sizeof(*l->samples), replay_cmp_u64);
+
+  static struct {
+    char const* name;
+    double q;
+  } const quantiles[] = {
+    {"p50", 0.5},
+    {"p90", 0.9},
+    {"p99", 0.99},
+    {"p99.9", 0.999},
+  };
+
+  printf(" min=%" PRIu64, l->samples[0]);
+  for (size_t i = 0; i < sizeof(quantiles) / sizeof(*quantiles); i++) {
+    size_t idx = (size_t)(quantiles[i].q * (double)(l->length - 1));
+    printf(" %s=%" PRIu64, quantiles[i].name, l->samples[idx]);
+  }
+  printf(" max=%" PRIu64 " (usec)\n", l->samples[l->length - 1]);
+}
+
+static uint64_t const LINGER_USEC = 1000 * 1000;
+
+// Calls awaiting an answer at any one time. dbus-daemon goes through every
+// pending reply of a connection for each one it routes, so past this the run
+// measures the bus rather than the bridge.
+static size_t const MAX_OUTSTANDING = 1024;
+
+static int replay_on_linger(sd_event_source* s, uint64_t usec, void* userdata) {
+  (void)s;
+  (void)usec;
+
+  auto rp = (replay_t*)userdata;
+  return sd_event_exit(rp->event, 0);
+}
+
+static void replay_check_done(replay_t* rp) {
+  if (rp->next < rp->records_length || rp->outstanding > 0) return;
+
+  if (rp->finished == 0) {
+    rp->finished = replay_now();
+  }
+  if (rp->unnotified == 0 || rp->observer == nullptr) {
+    (void)sd_event_exit(rp->event, 0);
+    return;
+  }
+  if (rp->linger != nullptr) return;
+
+  int r = sd_event_add_time_relative(
+    rp->event,
+    &rp->linger,
+    CLOCK_MONOTONIC,
+    LINGER_USEC,
+    0,
+    replay_on_linger,
+    rp
+  );
+  if (r < 0) {
+    (void)sd_event_exit(rp->event, 0);
+  }
+}
+
+static int replay_on_notify(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* ret_error
+) {
+  (void)m;
+  (void)ret_error;
+
+  auto rp = (replay_t*)userdata;
+
+  if (rp->unnotified != 0) {
+    replay_latencies_add(&rp->notify, replay_now() - rp->unnotified);
+    rp->unnotified = 0;
+  }
+
+  replay_check_done(rp);
+  return 0;
+}
+
+static int replay_watch(replay_t* rp) {
+  int r;
+
+  r = sd_bus_open_user(&rp->observer);
+  if (r < 0) return r;
+
+  r = sd_bus_attach_event(rp->observer, rp->event, SD_EVENT_PRIORITY_NORMAL);
+  if (r < 0) return r;
+
+  // Synchronous, so that it's in place before the first call goes out
+  return sd_bus_match_signal(
+    rp->observer,
+    nullptr,
+    FRONTENDS[0].bus_name,
+    "/io/github/notpeelz/SdInhibitBridge1",
+    "org.freedesktop.DBus.Properties",
+    "PropertiesChanged",
+    replay_on_notify,
+    rp
+  );
+}
+
+static void replay_peer_release(replay_t* rp, uint32_t peer) {
+  replay_peer_t* p = &rp->peers[peer];
+  if (p->gone && p->outstanding == 0) {
+    sd_bus_flush_close_unrefp(&p->bus);
+  }
+}
+
+static int replay_get_peer(replay_t* rp, uint32_t peer, sd_bus** ret) {
+  int r;
+
+  if (peer >= rp->peers_length) {
+    size_t length = peer + 1;
+    void* peers = reallocarray(rp->peers, length, sizeof(*rp->peers));
+    if (peers == nullptr) return -ENOMEM;
+    rp->peers = peers;
+    memset(
+      &rp->peers[rp->peers_length],
+      0,
+      (length - rp->peers_length) * sizeof(*rp->peers)
+    );
+    rp->peers_length = length;
+  }
+
+  // Calls still on their way out make it before the peer leaves, as they
+  // did when recorded
+  replay_peer_t* p = &rp->peers[peer];
+  if (p->gone && p->bus == nullptr) return -ENOTCONN;
+
+  if (p->bus == nullptr) {
+    r = sd_bus_open_user(&p->bus);
+    if (r < 0) return r;
+
+    r = sd_bus_attach_event(p->bus, rp->event, SD_EVENT_PRIORITY_NORMAL);
+    if (r < 0) {
+      sd_bus_flush_close_unrefp(&p->bus);
+      return r;
+    }
+  }
+
+  *ret = p->bus;
+  return 0;
+}
+
+static int replay_uninhibit(
+  replay_t* rp,
+  capture_record_t const* rec,
+  replay_inhibit_t* inhibit
+);
+
+static int replay_on_reply(
+  sd_bus_message* m,
+  void* userdata,
+  sd_bus_error* ret_error
+) {
+  (void)ret_error;
+
+  auto call = (replay_call_t*)userdata;
+  replay_t* rp = call->rp;
+  replay_inhibit_t* inhibit = call->inhibit;
+  uint64_t latency = replay_now() - call->sent;
+
+  replay_latencies_t* l = inhibit != nullptr
+    ? &rp->inhibit
+    : &rp->uninhibit;
+  if (sd_bus_message_is_method_error(m, nullptr)) {
+    l->errors++;
+    if (inhibit != nullptr) {
+      inhibit->failed = true;
+    }
+  } else {
+    replay_latencies_add(l, latency);
+    if (rp->unnotified == 0) {
+      rp->unnotified = replay_now();
+    }
+
+    uint32_t cookie;
+    if (
+      inhibit != nullptr
+      && sd_bus_message_read_basic(m, 'u', &cookie) >= 0
+    ) {
+      inhibit->cookie = cookie;
+      inhibit->answered = true;
+    }
+  }
+
+  if (inhibit != nullptr && inhibit->uninhibit != nullptr) {
+    capture_record_t const* rec = inhibit->uninhibit;
+    inhibit->uninhibit = nullptr;
+    if (!inhibit->answered || replay_uninhibit(rp, rec, inhibit) < 0) {
+      rp->skipped++;
+    }
+  }
+
+  rp->outstanding--;
+  rp->peers[call->peer].outstanding--;
+  replay_peer_release(rp, call->peer);
+  free(call);
+
+  // Records held back for room can go now
+  if (
+    rp->outstanding + 1 == MAX_OUTSTANDING
+    && rp->next < rp->records_length
+  ) {
+    int r = sd_event_source_set_time(rp->timer, 0);
+    if (r >= 0) {
+      r = sd_event_source_set_enabled(rp->timer, SD_EVENT_ONESHOT);
+    }
+    if (r < 0) return r;
+  }
+
+  replay_check_done(rp);
+  return 0;
+}
+
+static int replay_send(
+  replay_t* rp,
+  capture_record_t const* rec,
+  replay_inhibit_t* inhibit,
+  uint32_t cookie
+) {
+  int r;
+
+  if (rec->frontend >= FRONTENDS_LENGTH) return -EINVAL;
+  replay_frontend_t const* fe = &FRONTENDS[rec->frontend];
+
+  sd_bus* bus;
+  r = replay_get_peer(rp, rec->peer, &bus);
+  if (r < 0) return r;
+
+  replay_call_t* call = calloc(1, sizeof(*call));
+  if (call == nullptr) return -ENOMEM;
+
+  call->rp = rp;
+  call->peer = rec->peer;
+  call->inhibit = inhibit;
+  call->sent = replay_now();
+
+  if (inhibit == nullptr) {
+    r = sd_bus_call_method_async(
+      bus,
+      nullptr,
+      fe->bus_name,
+      fe->path,
+      fe->interface,
+      fe->uninhibit,
+      replay_on_reply,
+      call,
+      "u",
+      cookie
+    );
+  } else if (fe->gnome_session) {
+    r = sd_bus_call_method_async(
+      bus,
+      nullptr,
+      fe->bus_name,
+      fe->path,
+      fe->interface,
+      "Inhibit",
+      replay_on_reply,
+      call,
+      "susu",
+      rec->app_name,
+      0u,
+      rec->reason,
+      rec->flags
+    );
+  } else {
+    r = sd_bus_call_method_async(
+      bus,
+      nullptr,
+      fe->bus_name,
+      fe->path,
+      fe->interface,
+      "Inhibit",
+      replay_on_reply,
+      call,
+      "ss",
+      rec->app_name,
+      rec->reason
+    );
+  }
+  if (r < 0) {
+    free(call);
+    return r;
+  }
+
+  rp->outstanding++;
+  rp->peers[rec->peer].outstanding++;
+  return 0;
+}
+
+static int replay_uninhibit(
+  replay_t* rp,
+  capture_record_t const* rec,
+  replay_inhibit_t* inhibit
+) {
+  (void)htable_remove(rp->cookies, &inhibit->cookie_key, nullptr);
+  return replay_send(rp, rec, nullptr, inhibit->cookie);
+}
+
+static int replay_record(replay_t* rp, replay_record_t* record) {
+  capture_record_t const* rec = &record->rec;
+  uint64_t key;
+  replay_inhibit_t* inhibit;
+
+  switch (rec->op) {
+    case CAPTURE_INHIBIT: {
+      key = replay_key(rec->peer, rec->serial);
+      if (!htable_get(rp->serials, &key, (void**)&inhibit)) return 0;
+      return replay_send(rp, rec, inhibit, 0);
+    }
+    case CAPTURE_INHIBITED: {
+      key = replay_key(rec->peer, rec->serial);
+      if (!htable_get(rp->serials, &key, (void**)&inhibit)) return 0;
+
+      inhibit->cookie_key = replay_key(rec->peer, rec->cookie);
+      if (!htable_insert(rp->cookies, &inhibit->cookie_key, inhibit)) {
+        return -ENOMEM;
+      }
+      return 0;
+    }
+    case CAPTURE_UNINHIBIT: {
+      key = replay_key(rec->peer, rec->cookie);
+      if (
+        !htable_get(rp->cookies, &key, (void**)&inhibit)
+        || inhibit->uninhibit != nullptr
+        || inhibit->failed
+      ) {
+        // The original cookie was bogus, or ours never came
+        rp->skipped++;
+        return 0;
+      }
+      if (!inhibit->answered) {
+        // Our Inhibit is slower than the recorded one was
+        inhibit->uninhibit = rec;
+        return 0;
+      }
+      return replay_uninhibit(rp, rec, inhibit);
+    }
+    case CAPTURE_PEER_GONE: {
+      if (rec->peer < rp->peers_length) {
+        rp->peers[rec->peer].gone = true;
+        replay_peer_release(rp, rec->peer);
+      }
+      return 0;
+    }
+  }
+
+  return 0;
+}
+
+// Connects every peer up front, so that the time it takes isn't counted
+// against the bridge
+static int replay_connect(replay_t* rp) {
+  int r;
+
+  for (size_t i = 0; i < rp->records_length; i++) {
+    capture_record_t const* rec = &rp->records[i].rec;
+    if (rec->op != CAPTURE_INHIBIT && rec->op != CAPTURE_UNINHIBIT) continue;
+
+    sd_bus* bus;
+    r = replay_get_peer(rp, rec->peer, &bus);
+    if (r < 0) return r;
+
+    // Waits for the connection to be up, rather than piling up connections
+    // the bus hasn't accepted yet
+    char const* unique_name;
+    r = sd_bus_get_unique_name(bus, &unique_name);
+    if (r < 0) return r;
+  }
+
+  return 0;
+}
+
+static uint64_t replay_due(replay_t* rp, size_t i) {
+  if (rp->speed <= 0) {
+    return rp->start;
+  }
+  return rp->start + (uint64_t)((double)rp->records[i].rec.usec / rp->speed);
+}
+
+static int replay_on_timer(sd_event_source* s, uint64_t usec, void* userdata) {
+  (void)usec;
+
+  auto rp = (replay_t*)userdata;
+  int r;
+
+  uint64_t now = replay_now();
+  while (rp->next < rp->records_length && replay_due(rp, rp->next) <= now) {
+    // Picked up again from replay_on_reply()
+    if (rp->outstanding >= MAX_OUTSTANDING) return 0;
+
+    r = replay_record(rp, &rp->records[rp->next]);
+    if (r < 0) {
+      fprintf(
+        stderr,
+        "failed to replay record %zu: %s\n",
+        rp->next,
+        strerror(-r)
+      );
+      rp->skipped++;
+    }
+    rp->next++;
+  }
+
+  if (rp->next == rp->records_length) {
+    replay_check_done(rp);
+    return 0;
+  }
+
+  r = sd_event_source_set_time(s, replay_due(rp, rp->next));
+  if (r < 0) return r;
+
+  return sd_event_source_set_enabled(s, SD_EVENT_ONESHOT);
+}
+
+static int replay_on_record(capture_record_t const* rec, void* userdata) {
+  auto rp = (replay_t*)userdata;
+
+  void* records = reallocarray(
+    rp->records,
+    rp->records_length + 1,
+    sizeof(*rp->records)
+  );
+  if (records == nullptr) return -ENOMEM;
+  rp->records = records;
+
+  replay_record_t* record = &rp->records[rp->records_length];
+  *record = (replay_record_t){
+    .rec = *rec,
+  };
+  if (rec->op == CAPTURE_INHIBIT) {
+    record->app_name = strdup(rec->app_name);
+    record->reason = strdup(rec->reason);
+    if (record->app_name == nullptr || record->reason == nullptr) {
+      free(record->app_name);
+      free(record->reason);
+      return -ENOMEM;
+    }
+    rp->inhibits_length++;
+  }
+  record->rec.app_name = record->app_name;
+  record->rec.reason = record->reason;
+
+  rp->records_length++;
+  return 0;
+}
+
+// Stands in for a capture when there is none at hand, e.g. to train a PGO
+// build on: a few clients (GENERATE_PEERS, unless told otherwise) taking
+// turns, mostly through the screensaver interface, each inhibitor released
+// GENERATE_WINDOW calls after it was taken, and the last few dropped by the
+// clients leaving the bus.
+#define GENERATE_PEERS 8
+#define GENERATE_WINDOW 256
+#define GENERATE_INTERVAL_USEC 100
+
+// Indexes into FRONTENDS: mostly the screensaver interface, with the
+// occasional power-management and gnome-session client
+static uint8_t replay_generate_frontend(size_t k) {
+  if (k % 20 == 0) {
+    return 2;
+  }
+  if (k % 20 < 4) {
+    return 1;
+  }
+  return 0;
+}
+
+static int replay_generate(replay_t* rp, size_t count) {
+  static char const* const app_names[] = {
+    "firefox",
+    "mpv",
+    "chromium",
+    "org.gnome.Totem",
+  };
+  int r;
+
+  for (size_t k = 0; k < count; k++) {
+    uint64_t usec = (uint64_t)k * GENERATE_INTERVAL_USEC;
+    uint32_t peer = (uint32_t)(k % rp->generate_peers);
+    uint32_t serial = (uint32_t)(k / rp->generate_peers + 1);
+
+    capture_record_t rec = {
+      .op = CAPTURE_INHIBIT,
+      .usec = usec,
+      .peer = peer,
+      .frontend = replay_generate_frontend(k),
+      .serial = serial,
+      .app_name = app_names[k % (sizeof(app_names) / sizeof(*app_names))],
+      .reason = "Playing video",
+      // Inhibit idle, for gnome-session
+      .flags = 8,
+    };
+    r = replay_on_record(&rec, rp);
+    if (r < 0) return r;
+
+    // Any cookie will do, as long as it's unique per peer
+    rec.op = CAPTURE_INHIBITED;
+    rec.cookie = serial;
+    r = replay_on_record(&rec, rp);
+    if (r < 0) return r;
+
+    if (k < GENERATE_WINDOW) continue;
+
+    // Cookies are only valid on the interface that handed them out
+    size_t j = k - GENERATE_WINDOW;
+    rec = (capture_record_t){
+      .op = CAPTURE_UNINHIBIT,
+      .usec = usec,
+      .peer = (uint32_t)(j % rp->generate_peers),
+      .frontend = replay_generate_frontend(j),
+      .cookie = (uint32_t)(j / rp->generate_peers + 1),
+    };
+    r = replay_on_record(&rec, rp);
+    if (r < 0) return r;
+  }
+
+  for (size_t peer = 0; peer < rp->generate_peers && peer < count; peer++) {
+    capture_record_t rec = {
+      .op = CAPTURE_PEER_GONE,
+      .usec = (uint64_t)count * GENERATE_INTERVAL_USEC,
+      .peer = (uint32_t)peer,
+    };
+    r = replay_on_record(&rec, rp);
+    if (r < 0) return r;
+  }
+
+  return 0;
+}
+
+// Once all records are in
+static int replay_index(replay_t* rp) {
+  rp->inhibits = calloc(
+    rp->inhibits_length > 0 ? rp->inhibits_length : 1,
+    sizeof(*rp->inhibits)
+  );
+  if (rp->inhibits == nullptr) return -ENOMEM;
+
+  rp->serials = htable_create(replay_key_hash, replay_key_eq, nullptr);
+  rp->cookies = htable_create(replay_key_hash, replay_key_eq, nullptr);
+  if (rp->serials == nullptr || rp->cookies == nullptr) return -ENOMEM;
+
+  // Keys point into the inhibits, which stay put from here on
+  size_t n = 0;
+  for (size_t i = 0; i < rp->records_length; i++) {
+    capture_record_t const* rec = &rp->records[i].rec;
+    if (rec->op != CAPTURE_INHIBIT) continue;
+
+    replay_inhibit_t* inhibit = &rp->inhibits[n++];
+    inhibit->serial_key = replay_key(rec->peer, rec->serial);
+    if (!htable_insert(rp->serials, &inhibit->serial_key, inhibit)) {
+      return -ENOMEM;
+    }
+  }
+
+  return 0;
+}
+
+static int replay_load(replay_t* rp, char const* path) {
+  int r;
+
+  r = capture_read(path, replay_on_record, rp);
+  if (r < 0) return r;
+
+  return replay_index(rp);
+}
+
+static void replay_clear(replay_t* rp) {
+  for (size_t i = 0; i < rp->peers_length; i++) {
+    sd_bus_flush_close_unrefp(&rp->peers[i].bus);
+  }
+  free(rp->peers);
+  for (size_t i = 0; i < rp->records_length; i++) {
+    free(rp->records[i].app_name);
+    free(rp->records[i].reason);
+  }
+  free(rp->records);
+  if (rp->serials != nullptr) {
+    htable_destroy(rp->serials);
+  }
+  if (rp->cookies != nullptr) {
+    htable_destroy(rp->cookies);
+  }
+  free(rp->inhibits);
+  free(rp->inhibit.samples);
+  free(rp->uninhibit.samples);
+  free(rp->notify.samples);
+  sd_bus_flush_close_unrefp(&rp->observer);
+  sd_event_source_disable_unrefp(&rp->linger);
+  sd_event_source_disable_unrefp(&rp->timer);
+  sd_event_unrefp(&rp->event);
+}
+
+static struct option long_options[] = {
+  {"help", no_argument, nullptr, 'h'},
+  {"speed", required_argument, nullptr, 's'},
+  {"generate", required_argument, nullptr, 'g'},
+  {"peers", required_argument, nullptr, 'p'},
+  {0},
+};
+
+static char usage[] = {
+  "Usage: sd-inhibit-bridge-replay [options] CAPTURE\n"
+  "       sd-inhibit-bridge-replay [options] --generate=COUNT\n"
+  "\n"
+  "  -h, --help                              "
+  "Print help\n"
+  "  -s, --speed=FACTOR                      "
+  "Replay FACTOR times as fast as recorded\n"
+  "                                          "
+  "(default: 1; 0 sends everything at once)\n"
+  "  -g, --generate=COUNT                    "
+  "Replay a synthetic workload of COUNT\n"
+  "                                          "
+  "inhibitors instead of a capture\n"
+  "  -p, --peers=COUNT                       "
+  "Spread the synthetic workload over COUNT\n"
+  "                                          "
+  "clients (default: 8)\n"
+};
+
+int main(int argc, char** argv) {
+  int r;
+
+  _cleanup_(replay_clear)
+  replay_t rp = {
+    .speed = 1,
+    .generate_peers = GENERATE_PEERS,
+  };
+
+  size_t generate = 0;
+
+  while (true) {
+    int c = getopt_long(argc, argv, "hs:g:p:", long_options, nullptr);
+    if (c < 0) {
+      break;
+    }
+
+    switch (c) {
+      case 'h': {
+        fprintf(stderr, "%s", usage);
+        return EXIT_SUCCESS;
+      }
+      case 's': {
+        char* end;
+        errno = 0;
+        rp.speed = strtod(optarg, &end);
+        if (errno != 0 || *optarg == '\0' || *end != '\0' || rp.speed < 0) {
+          fprintf(stderr, "invalid --speed value: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      }
+      case 'g': {
+        char* end;
+        errno = 0;
+        unsigned long long n = strtoull(optarg, &end, 10);
+        if (
+          errno != 0
+          || *optarg == '\0'
+          || *end != '\0'
+          || n == 0
+          || n > SIZE_MAX / 4
+        ) {
+          fprintf(stderr, "invalid --generate value: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        generate = (size_t)n;
+        break;
+      }
+      case 'p': {
+        char* end;
+        errno = 0;
+        unsigned long n = strtoul(optarg, &end, 10);
+        if (
+          errno != 0
+          || *optarg == '\0'
+          || *end != '\0'
+          || n == 0
+          || n > UINT32_MAX
+        ) {
+          fprintf(stderr, "invalid --peers value: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        rp.generate_peers = (size_t)n;
+        break;
+      }
+      default: {
+        fprintf(stderr, "%s", usage);
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  if (optind != argc - (generate > 0 ? 0 : 1)) {
+    fprintf(stderr, "%s", usage);
+    return EXIT_FAILURE;
+  }
+
+  if (generate > 0) {
+    r = replay_generate(&rp, generate);
+    if (r >= 0) {
+      r = replay_index(&rp);
+    }
+    if (r < 0) {
+      fprintf(stderr, "failed to generate workload: %s\n", strerror(-r));
+      return EXIT_FAILURE;
+    }
+  } else {
+    r = replay_load(&rp, argv[optind]);
+    if (r < 0) {
+      fprintf(stderr, "failed to read capture: %s\n", strerror(-r));
+      return EXIT_FAILURE;
+    }
+  }
+
+  r = sd_event_new(&rp.event);
+  if (r < 0) goto fail;
+
+  if (rp.records_length == 0) {
+    fprintf(stderr, "capture is empty\n");
+    return EXIT_SUCCESS;
+  }
+
+  r = replay_connect(&rp);
+  if (r < 0) goto fail;
+
+  r = replay_watch(&rp);
+  if (r < 0) goto fail;
+
+  rp.start = replay_now();
+  r = sd_event_add_time(
+    rp.event,
+    &rp.timer,
+    CLOCK_MONOTONIC,
+    replay_due(&rp, 0),
+    1,
+    replay_on_timer,
+    &rp
+  );
+  if (r < 0) goto fail;
+
+  r = sd_event_loop(rp.event);
+  if (r < 0) goto fail;
+
+  uint64_t elapsed = rp.finished - rp.start;
+  printf(
+    "records=%zu skipped=%zu elapsed_usec=%" PRIu64 "\n",
+    rp.records_length,
+    rp.skipped,
+    elapsed
+  );
+  replay_latencies_report("inhibit", "calls", &rp.inhibit);
+  replay_latencies_report("uninhibit", "calls", &rp.uninhibit);
+  replay_latencies_report("notify", "signals", &rp.notify);
+  return EXIT_SUCCESS;
+
+fail:
+  fprintf(stderr, "replay failed: %s\n", strerror(-r));
+  return EXIT_FAILURE;
+}
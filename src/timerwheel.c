@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "timerwheel.h"
+
+// Hierarchical timing wheel with cascading, in the spirit of the classic
+// Linux kernel timer implementation: each level has 64 slots, and a slot on
+// level n covers 64^n ticks. Timers are placed on the finest level that can
+// represent their deadline, and are moved down a level whenever the level
+// below wraps around.
+
+#define LEVELS 4
+#define SLOT_BITS 6
+#define SLOTS (1 << SLOT_BITS)
+#define SLOT_MASK (SLOTS - 1)
+
+// Deadlines further out than this are clamped
+static uint64_t const MAX_TICKS = (1ull << (LEVELS * SLOT_BITS)) - 1;
+
+struct timerwheel {
+  uint64_t tick_usec;
+  // Next tick to be processed; everything before it has already fired
+  uint64_t current;
+  size_t count;
+  // Bit n is set if slot n of the level is non-empty
+  uint64_t occupied[LEVELS];
+  timerwheel_timer_t* slots[LEVELS][SLOTS];
+};
+
+timerwheel_t* timerwheel_create(uint64_t tick_usec, uint64_t now) {
+  assert(tick_usec > 0);
+
+  timerwheel_t* tw = calloc(1, sizeof(*tw));
+  if (tw == nullptr) return nullptr;
+
+  tw->tick_usec = tick_usec;
+  tw->current = now / tick_usec;
+
+  return tw;
+}
+
+void timerwheel_destroy(timerwheel_t* tw) {
+  if (tw == nullptr) return;
+
+  // Timers are owned by their users; just make sure they don't point at us
+  for (size_t level = 0; level < LEVELS; level++) {
+    for (size_t slot = 0; slot < SLOTS; slot++) {
+      timerwheel_timer_t* timer = tw->slots[level][slot];
+      while (timer != nullptr) {
+        timerwheel_timer_t* next = timer->next;
+        timer->wheel = nullptr;
+        timer->next = nullptr;
+        timer->pprev = nullptr;
+        timer = next;
+      }
+    }
+  }
+
+  free(tw);
+}
+
+void timerwheel_timer_init(
+  timerwheel_timer_t* timer,
+  timerwheel_cb_t cb,
+  void* userdata
+) {
+  assert(timer != nullptr);
+  assert(cb != nullptr);
+
+  *timer = (timerwheel_timer_t){
+    .cb = cb,
+    .userdata = userdata,
+  };
+}
+
+bool timerwheel_timer_pending(timerwheel_timer_t const* timer) {
+  assert(timer != nullptr);
+  return timer->pprev != nullptr;
+}
+
+static void timerwheel_link(
+  timerwheel_t* tw,
+  timerwheel_timer_t* timer,
+  size_t level,
+  size_t slot
+) {
+  timerwheel_timer_t** head = &tw->slots[level][slot];
+
+  timer->wheel = tw;
+  timer->level = (uint8_t)level;
+  timer->slot = (uint8_t)slot;
+  timer->next = *head;
+  if (*head != nullptr) {
+    (*head)->pprev = &timer->next;
+  }
+  timer->pprev = head;
+  *head = timer;
+
+  tw->occupied[level] |= 1ull << slot;
+}
+
+static void timerwheel_unlink(timerwheel_timer_t* timer) {
+  timerwheel_t* tw = timer->wheel;
+
+  *timer->pprev = timer->next;
+  if (timer->next != nullptr) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = nullptr;
+  timer->pprev = nullptr;
+
+  if (tw->slots[timer->level][timer->slot] == nullptr) {
+    tw->occupied[timer->level] &= ~(1ull << timer->slot);
+  }
+}
+
+static void timerwheel_place(timerwheel_t* tw, timerwheel_timer_t* timer) {
+  uint64_t expires = timer->expires;
+  if (expires < tw->current) {
+    expires = tw->current;
+  }
+
+  uint64_t delta = expires - tw->current;
+  if (delta > MAX_TICKS) {
+    delta = MAX_TICKS;
+    expires = tw->current + MAX_TICKS;
+    timer->expires = expires;
+  }
+
+  size_t level = 0;
+  while (
+    level < LEVELS - 1
+    && delta >= 1ull << ((level + 1) * SLOT_BITS)
+  ) {
+    level++;
+  }
+
+  size_t slot = (expires >> (level * SLOT_BITS)) & SLOT_MASK;
+  timerwheel_link(tw, timer, level, slot);
+}
+
+void timerwheel_add(
+  timerwheel_t* tw,
+  timerwheel_timer_t* timer,
+  uint64_t deadline
+) {
+  assert(tw != nullptr);
+  assert(timer != nullptr);
+  assert(timer->cb != nullptr);
+
+  if (timerwheel_timer_pending(timer)) {
+    timerwheel_cancel(timer);
+  }
+
+  // Round up so that timers never fire early
+  timer->expires = deadline / tw->tick_usec
+    + (deadline % tw->tick_usec != 0 ? 1 : 0);
+  timerwheel_place(tw, timer);
+  tw->count++;
+}
+
+void timerwheel_cancel(timerwheel_timer_t* timer) {
+  assert(timer != nullptr);
+
+  if (!timerwheel_timer_pending(timer)) return;
+
+  timerwheel_t* tw = timer->wheel;
+  timerwheel_unlink(timer);
+  tw->count--;
+}
+
+size_t timerwheel_count(timerwheel_t* tw) {
+  assert(tw != nullptr);
+  return tw->count;
+}
+
+static void timerwheel_cascade(timerwheel_t* tw, size_t level, size_t slot) {
+  timerwheel_timer_t* timer = tw->slots[level][slot];
+  tw->slots[level][slot] = nullptr;
+  tw->occupied[level] &= ~(1ull << slot);
+
+  while (timer != nullptr) {
+    timerwheel_timer_t* next = timer->next;
+    timerwheel_place(tw, timer);
+    timer = next;
+  }
+}
+
+static void timerwheel_tick(timerwheel_t* tw) {
+  size_t idx = tw->current & SLOT_MASK;
+
+  // Pull the next batch of timers down from the coarser levels
+  if (idx == 0) {
+    for (size_t level = 1; level < LEVELS; level++) {
+      size_t slot = (tw->current >> (level * SLOT_BITS)) & SLOT_MASK;
+      timerwheel_cascade(tw, level, slot);
+      if (slot != 0) break;
+    }
+  }
+
+  // Detach the due timers before running anything, so that callbacks can
+  // freely add or cancel timers (including ones from this batch).
+  timerwheel_timer_t* expired = tw->slots[0][idx];
+  tw->slots[0][idx] = nullptr;
+  tw->occupied[0] &= ~(1ull << idx);
+  if (expired != nullptr) {
+    expired->pprev = &expired;
+  }
+
+  tw->current++;
+
+  while (expired != nullptr) {
+    timerwheel_timer_t* timer = expired;
+    timerwheel_unlink(timer);
+    tw->count--;
+    timer->cb(timer, timer->userdata);
+  }
+}
+
+void timerwheel_advance(timerwheel_t* tw, uint64_t now) {
+  assert(tw != nullptr);
+
+  uint64_t target = now / tw->tick_usec;
+  while (tw->current <= target) {
+    if (tw->count == 0) {
+      tw->current = target + 1;
+      break;
+    }
+
+    // Skip straight to the next cascade if nothing is due before it
+    size_t idx = tw->current & SLOT_MASK;
+    if (idx != 0 && (tw->occupied[0] >> idx) == 0) {
+      uint64_t boundary = (tw->current | SLOT_MASK) + 1;
+      tw->current = boundary < target + 1 ? boundary : target + 1;
+      continue;
+    }
+
+    timerwheel_tick(tw);
+  }
+}
+
+static uint64_t rotr64(uint64_t x, unsigned n) {
+  n &= 63;
+  return n == 0 ? x : (x >> n) | (x << (64 - n));
+}
+
+bool timerwheel_next(timerwheel_t* tw, uint64_t* deadline) {
+  assert(tw != nullptr);
+  assert(deadline != nullptr);
+
+  if (tw->count == 0) {
+    return false;
+  }
+
+  // The slots of a level cover the next 64 of its periods, starting with the
+  // current one if it hasn't been cascaded yet (we're right at its start).
+  // Whatever is in the first occupied one of them can't be due before it
+  // begins; earlier cascades are caught up on by timerwheel_advance().
+  uint64_t tick = UINT64_MAX;
+  for (size_t level = 0; level < LEVELS; level++) {
+    if (tw->occupied[level] == 0) continue;
+
+    unsigned shift = (unsigned)(level * SLOT_BITS);
+    uint64_t period = tw->current >> shift;
+    if ((tw->current & ((1ull << shift) - 1)) != 0) {
+      period++;
+    }
+
+    uint64_t pending = rotr64(tw->occupied[level], (unsigned)period);
+    period += (uint64_t)__builtin_ctzll(pending);
+
+    uint64_t start = period << shift;
+    if (start < tick) {
+      tick = start;
+    }
+  }
+
+  *deadline = tick * tw->tick_usec;
+  return true;
+}
@@ -0,0 +1,55 @@
+#ifndef SDIB_TIMERWHEEL_H
+#define SDIB_TIMERWHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct timerwheel timerwheel_t;
+typedef struct timerwheel_timer timerwheel_timer_t;
+
+typedef void (*timerwheel_cb_t)(timerwheel_timer_t* timer, void* userdata);
+
+// Timers are meant to be embedded in the structure they belong to; the wheel
+// never allocates on their behalf, so arming and cancelling are O(1).
+struct timerwheel_timer {
+  timerwheel_t* wheel;
+  timerwheel_timer_t* next;
+  timerwheel_timer_t** pprev;
+  uint64_t expires;
+  uint8_t level;
+  uint8_t slot;
+  timerwheel_cb_t cb;
+  void* userdata;
+};
+
+timerwheel_t* timerwheel_create(uint64_t tick_usec, uint64_t now);
+void timerwheel_destroy(timerwheel_t* tw);
+DEFINE_POINTER_CLEANUP_FUNC(timerwheel_t, timerwheel_destroy);
+
+void timerwheel_timer_init(
+  timerwheel_timer_t* timer,
+  timerwheel_cb_t cb,
+  void* userdata
+);
+bool timerwheel_timer_pending(timerwheel_timer_t const* timer);
+
+// Deadlines are absolute, in the same clock as the `now` passed to
+// timerwheel_create() and timerwheel_advance(), rounded up to a tick.
+void timerwheel_add(
+  timerwheel_t* tw,
+  timerwheel_timer_t* timer,
+  uint64_t deadline
+);
+void timerwheel_cancel(timerwheel_timer_t* timer);
+
+size_t timerwheel_count(timerwheel_t* tw);
+
+// Runs the callbacks of every timer whose deadline is <= now
+void timerwheel_advance(timerwheel_t* tw, uint64_t now);
+
+// Earliest time the wheel needs to be advanced at. This may be before the
+// nearest deadline (at the start of the span of ticks a coarser level keeps
+// it in) but never after it.
+bool timerwheel_next(timerwheel_t* tw, uint64_t* deadline);
+
+#endif
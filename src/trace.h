@@ -0,0 +1,21 @@
+#ifndef SDIB_TRACE_H
+#define SDIB_TRACE_H
+
+// Static (USDT) tracepoints, e.g. for bpftrace:
+//   usdt:/usr/bin/sd-inhibit-bridge:sdib:inhibit_entry
+// When built with -Dusdt, an idle probe is a single nop; otherwise it
+// compiles to nothing. Arguments must be cheap to evaluate either way.
+#ifdef SDIB_USDT
+#include <sys/sdt.h>
+#define TRACE(name, ...) STAP_PROBEV(sdib, name, __VA_ARGS__)
+#else
+// Keeps the arguments type-checked (and their variables used) without ever
+// evaluating them
+static inline void trace_discard(int unused, ...) {
+  (void)unused;
+}
+#define TRACE(name, ...) \
+  do { if (false) trace_discard(0, __VA_ARGS__); } while (0)
+#endif
+
+#endif
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "check.h"
+#include "htable.h"
+
+// Times the table with the same keys and callbacks as the bridge's peers
+// table (unique bus names, copied on insert), from 10^2 to 10^6 entries.
+// Smaller tables are filled and drained several times over, so that every
+// size runs about as many operations.
+
+static size_t const MAX_KEYS = 1000000;
+static size_t const MIN_OPS = 2000000;
+
+static uint64_t bench_hash(void const* in) {
+  uint64_t hash = 0xcbf29ce484222325u;
+  for (char const* k = in; *k != '\0'; k++) {
+    hash ^= *k;
+    hash *= 0x100000001b3u;
+  }
+  return hash;
+}
+
+static bool bench_keq(void const* a, void const* b) {
+  return strcmp(a, b) == 0;
+}
+
+static void* bench_kcopy(void* in) {
+  return strdup(in);
+}
+
+static htable_callbacks_t bench_callbacks = {
+  .kcopy = bench_kcopy,
+  .kfree = free,
+};
+
+static uint64_t now_nsec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static char** make_keys(char const* prefix, size_t count) {
+  char** keys = calloc(count, sizeof(*keys));
+  CHECK(keys != nullptr);
+  for (size_t i = 0; i < count; i++) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%s%zu", prefix, i);
+    keys[i] = strdup(buf);
+    CHECK(keys[i] != nullptr);
+  }
+  return keys;
+}
+
+int main(void) {
+  char** keys = make_keys(":1.", MAX_KEYS);
+  char** missing = make_keys(":2.", MAX_KEYS);
+
+  printf("%8s %10s %10s %10s %10s  (ns/op)\n",
+    "keys", "insert", "get", "get-miss", "remove");
+
+  for (size_t n = 100; n <= MAX_KEYS; n *= 10) {
+    size_t rounds = n < MIN_OPS ? MIN_OPS / n : 1;
+    uint64_t insert = 0;
+    uint64_t get = 0;
+    uint64_t miss = 0;
+    uint64_t remove = 0;
+
+    for (size_t r = 0; r < rounds; r++) {
+      htable_t* ht = htable_create(bench_hash, bench_keq, &bench_callbacks);
+      CHECK(ht != nullptr);
+
+      uint64_t t0 = now_nsec();
+      for (size_t i = 0; i < n; i++) {
+        CHECK(htable_insert(ht, keys[i], nullptr));
+      }
+      uint64_t t1 = now_nsec();
+      for (size_t i = 0; i < n; i++) {
+        CHECK(htable_get(ht, keys[i], nullptr));
+      }
+      uint64_t t2 = now_nsec();
+      for (size_t i = 0; i < n; i++) {
+        CHECK(!htable_get(ht, missing[i], nullptr));
+      }
+      uint64_t t3 = now_nsec();
+      for (size_t i = 0; i < n; i++) {
+        CHECK(htable_remove(ht, keys[i], nullptr));
+      }
+      uint64_t t4 = now_nsec();
+
+      insert += t1 - t0;
+      get += t2 - t1;
+      miss += t3 - t2;
+      remove += t4 - t3;
+      htable_destroy(ht);
+    }
+
+    double ops = (double)n * rounds;
+    printf("%8zu %10.1f %10.1f %10.1f %10.1f\n",
+      n, insert / ops, get / ops, miss / ops, remove / ops);
+  }
+
+  for (size_t i = 0; i < MAX_KEYS; i++) {
+    free(keys[i]);
+    free(missing[i]);
+  }
+  free(keys);
+  free(missing);
+  return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef SDIB_TESTS_CHECK_H
+#define SDIB_TESTS_CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Unlike assert(), stays on in release builds
+#define CHECK(expr) \
+  do { \
+    if (!(expr)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+      abort(); \
+    } \
+  } while (0)
+
+#endif
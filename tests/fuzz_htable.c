@@ -0,0 +1,8 @@
+#include "htable_model.h"
+
+// libFuzzer entry point: the input is a sequence of table operations, see
+// htable_model.c
+int LLVMFuzzerTestOneInput(uint8_t const* data, size_t size) {
+  model_run(data, size);
+  return 0;
+}
@@ -0,0 +1,258 @@
+#include <string.h>
+
+#include "htable_model.h"
+
+// Operations are 3 bytes each: an opcode, then the key's index (big-endian,
+// modulo MODEL_KEYS). The low 3 bits of the opcode pick the operation:
+enum {
+  OP_INSERT,
+  OP_INSERT_AGAIN,
+  OP_REMOVE,
+  // Removes the entry without taking its value back
+  OP_REMOVE_DROP,
+  OP_GET,
+  // Insert while calloc() fails; bit 3 picks its first or second call
+  OP_INSERT_NOMEM,
+  // Insert while copying the key fails
+  OP_INSERT_NOKEY,
+  // Bit 3 set: compact the table (with calloc() failing if bit 4 is set
+  // too). Either way, check that enumerating yields the model's entries.
+  OP_ENUM,
+};
+
+typedef struct model {
+  htable_t* ht;
+  void* values[MODEL_KEYS];
+  size_t count;
+} model_t;
+
+static char model_keys[MODEL_KEYS][16];
+static size_t live_keys;
+static size_t live_values;
+static unsigned calloc_fail_in;
+// Whether an armed failure actually happened
+static bool failed;
+static bool kcopy_failing;
+
+void* __real_calloc(size_t n, size_t size);
+
+void* __wrap_calloc(size_t n, size_t size) {
+  if (calloc_fail_in != 0 && --calloc_fail_in == 0) {
+    failed = true;
+    return nullptr;
+  }
+  return __real_calloc(n, size);
+}
+
+void model_fail_calloc(unsigned n) {
+  calloc_fail_in = n;
+  failed = false;
+}
+
+void model_fail_kcopy(void) {
+  kcopy_failing = true;
+  failed = false;
+}
+
+uint64_t model_hash(void const* in) {
+  uint64_t hash = 0xcbf29ce484222325u;
+  for (char const* k = in; *k != '\0'; k++) {
+    hash ^= *k;
+    hash *= 0x100000001b3u;
+  }
+  return hash;
+}
+
+bool model_keq(void const* a, void const* b) {
+  return strcmp(a, b) == 0;
+}
+
+static void* model_kcopy(void* in) {
+  if (kcopy_failing) {
+    kcopy_failing = false;
+    failed = true;
+    return nullptr;
+  }
+
+  char* k = strdup(in);
+  CHECK(k != nullptr);
+  live_keys++;
+  return k;
+}
+
+static void model_kfree(void* in) {
+  CHECK(in != nullptr);
+  CHECK(live_keys > 0);
+  live_keys--;
+  free(in);
+}
+
+htable_callbacks_t model_callbacks = {
+  .kcopy = model_kcopy,
+  .kfree = model_kfree,
+  .vfree = model_value_free,
+};
+
+char const* model_key(size_t idx) {
+  CHECK(idx < MODEL_KEYS);
+  if (model_keys[idx][0] == '\0') {
+    snprintf(model_keys[idx], sizeof(model_keys[idx]), ":1.%zu", idx);
+  }
+  return model_keys[idx];
+}
+
+static size_t model_index(void const* k) {
+  char const* s = k;
+  CHECK(strncmp(s, ":1.", 3) == 0);
+  size_t idx = strtoul(s + 3, nullptr, 10);
+  CHECK(idx < MODEL_KEYS);
+  CHECK(strcmp(s, model_key(idx)) == 0);
+  return idx;
+}
+
+void* model_value_new(void) {
+  void* v = malloc(1);
+  CHECK(v != nullptr);
+  live_values++;
+  return v;
+}
+
+void model_value_free(void* v) {
+  CHECK(v != nullptr);
+  CHECK(live_values > 0);
+  live_values--;
+  free(v);
+}
+
+size_t model_live_keys(void) {
+  return live_keys;
+}
+
+size_t model_live_values(void) {
+  return live_values;
+}
+
+static void model_get(model_t* m, size_t idx) {
+  void* v = nullptr;
+  bool found = htable_get(m->ht, model_key(idx), &v);
+  CHECK(found == (m->values[idx] != nullptr));
+  CHECK(v == m->values[idx]);
+}
+
+static void model_insert(model_t* m, size_t idx, bool may_fail) {
+  // Keys must not be inserted twice
+  if (m->values[idx] != nullptr) {
+    model_get(m, idx);
+    return;
+  }
+
+  void* v = model_value_new();
+  if (!htable_insert(m->ht, (void*)model_key(idx), v)) {
+    CHECK(may_fail && failed);
+    // Neither the key nor the value was taken over
+    model_value_free(v);
+    return;
+  }
+
+  m->values[idx] = v;
+  m->count++;
+}
+
+static void model_remove(model_t* m, size_t idx, bool take) {
+  size_t values = live_values;
+  void* v = nullptr;
+  bool found = htable_remove(m->ht, model_key(idx), take ? &v : nullptr);
+  CHECK(found == (m->values[idx] != nullptr));
+  if (!found) {
+    CHECK(live_values == values);
+    return;
+  }
+
+  if (take) {
+    CHECK(v == m->values[idx]);
+    CHECK(live_values == values);
+    model_value_free(v);
+  } else {
+    // The table freed it
+    CHECK(live_values == values - 1);
+  }
+
+  m->values[idx] = nullptr;
+  m->count--;
+}
+
+static void model_enum(model_t* m) {
+  _cleanup_(htable_enum_destroyp) htable_enum_t* he = htable_enum_create(m->ht);
+  CHECK(he != nullptr);
+
+  bool seen[MODEL_KEYS] = {};
+  size_t n = 0;
+  void const* k;
+  void* v;
+  while (htable_enum_next(he, &k, &v)) {
+    size_t idx = model_index(k);
+    CHECK(!seen[idx]);
+    seen[idx] = true;
+    // The table holds its own copy of the key
+    CHECK(k != model_key(idx));
+    CHECK(v == m->values[idx]);
+    n++;
+  }
+  CHECK(n == m->count);
+}
+
+void model_run(uint8_t const* data, size_t size) {
+  size_t keys = live_keys;
+  size_t values = live_values;
+
+  model_t m = {};
+  m.ht = htable_create(model_hash, model_keq, &model_callbacks);
+  CHECK(m.ht != nullptr);
+
+  for (size_t i = 0; i + 3 <= size; i += 3) {
+    uint8_t op = data[i];
+    size_t idx = ((size_t)data[i + 1] << 8 | data[i + 2]) % MODEL_KEYS;
+
+    switch (op & 7) {
+      case OP_INSERT:
+      case OP_INSERT_AGAIN:
+        model_insert(&m, idx, false);
+        break;
+      case OP_REMOVE:
+        model_remove(&m, idx, true);
+        break;
+      case OP_REMOVE_DROP:
+        model_remove(&m, idx, false);
+        break;
+      case OP_GET:
+        model_get(&m, idx);
+        break;
+      case OP_INSERT_NOMEM:
+        model_fail_calloc(op & 8 ? 2 : 1);
+        model_insert(&m, idx, true);
+        model_fail_calloc(0);
+        break;
+      case OP_INSERT_NOKEY:
+        model_fail_kcopy();
+        model_insert(&m, idx, true);
+        // Only inserting a new key copies it
+        kcopy_failing = false;
+        break;
+      case OP_ENUM:
+        if (op & 8) {
+          if (op & 16) model_fail_calloc(1);
+          htable_compact(m.ht);
+          model_fail_calloc(0);
+        }
+        model_enum(&m);
+        break;
+    }
+
+    CHECK(htable_count(m.ht) == m.count);
+  }
+
+  model_enum(&m);
+  htable_destroy(m.ht);
+  CHECK(live_keys == keys);
+  CHECK(live_values == values);
+}
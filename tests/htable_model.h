@@ -0,0 +1,36 @@
+#ifndef SDIB_TESTS_HTABLE_MODEL_H
+#define SDIB_TESTS_HTABLE_MODEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "check.h"
+#include "htable.h"
+
+// Keys are unique bus names out of this many, so that operations keep
+// running into entries that are already in the table
+#define MODEL_KEYS 512
+
+// Same string keys and callbacks as the bridge's peers table, except that
+// every copy of a key and every value is counted while it's alive
+extern htable_callbacks_t model_callbacks;
+uint64_t model_hash(void const* in);
+bool model_keq(void const* a, void const* b);
+char const* model_key(size_t idx);
+void* model_value_new(void);
+void model_value_free(void* v);
+size_t model_live_keys(void);
+size_t model_live_values(void);
+
+// Makes the nth call to calloc() from now on fail (1 being the very next
+// one), and 0 disarms it. Needs -Wl,--wrap=calloc.
+void model_fail_calloc(unsigned n);
+// Makes the next key copy fail
+void model_fail_kcopy(void);
+
+// Runs the operations encoded in data against both a table and a plain
+// array holding the same entries, and aborts on the first difference. Every
+// key and value the table took over must be freed exactly once by the end.
+void model_run(uint8_t const* data, size_t size);
+
+#endif
@@ -0,0 +1,168 @@
+#include <string.h>
+
+#include "htable_model.h"
+
+// Enough entries to go through a few resizes
+enum { FILL = 100 };
+
+static htable_t* fill_table(void** values, size_t count) {
+  htable_t* ht = htable_create(model_hash, model_keq, &model_callbacks);
+  CHECK(ht != nullptr);
+
+  for (size_t i = 0; i < count; i++) {
+    values[i] = model_value_new();
+    CHECK(htable_insert(ht, (void*)model_key(i), values[i]));
+  }
+  CHECK(htable_count(ht) == count);
+
+  return ht;
+}
+
+static void test_remove(void) {
+  void* values[FILL];
+  htable_t* ht = fill_table(values, FILL);
+  size_t keys = model_live_keys();
+  size_t live = model_live_values();
+
+  // Handed over: the table only frees its copy of the key
+  void* v = nullptr;
+  CHECK(htable_remove(ht, model_key(0), &v));
+  CHECK(v == values[0]);
+  CHECK(model_live_keys() == keys - 1);
+  CHECK(model_live_values() == live);
+  model_value_free(v);
+
+  // Not asked for: the value goes with the key
+  CHECK(htable_remove(ht, model_key(1), nullptr));
+  CHECK(model_live_keys() == keys - 2);
+  CHECK(model_live_values() == live - 2);
+
+  // Gone, and v is left alone
+  v = values[2];
+  CHECK(!htable_remove(ht, model_key(0), &v));
+  CHECK(!htable_remove(ht, model_key(1), nullptr));
+  CHECK(v == values[2]);
+  CHECK(!htable_get(ht, model_key(0), nullptr));
+  CHECK(htable_get(ht, model_key(2), &v));
+  CHECK(v == values[2]);
+  CHECK(htable_count(ht) == FILL - 2);
+
+  htable_destroy(ht);
+  CHECK(model_live_keys() == 0);
+  CHECK(model_live_values() == 0);
+}
+
+static void test_insert_nomem(void) {
+  // 13 entries in 16 buckets: the next insert resizes first
+  void* values[FILL];
+  htable_t* ht = fill_table(values, 13);
+  size_t keys = model_live_keys();
+  size_t live = model_live_values();
+
+  // The resize failing doesn't fail the insert
+  values[13] = model_value_new();
+  model_fail_calloc(1);
+  CHECK(htable_insert(ht, (void*)model_key(13), values[13]));
+  model_fail_calloc(0);
+  CHECK(htable_count(ht) == 14);
+
+  // The entry failing does, and takes over nothing
+  void* v = model_value_new();
+  model_fail_calloc(2);
+  CHECK(!htable_insert(ht, (void*)model_key(14), v));
+  model_fail_calloc(0);
+  model_fail_kcopy();
+  CHECK(!htable_insert(ht, (void*)model_key(14), v));
+  CHECK(htable_count(ht) == 14);
+  CHECK(model_live_keys() == keys + 1);
+  CHECK(model_live_values() == live + 2);
+  CHECK(!htable_get(ht, model_key(14), nullptr));
+
+  // The next one goes through, and everything can still be found after
+  // the resize that was put off
+  CHECK(htable_insert(ht, (void*)model_key(14), v));
+  values[14] = v;
+  for (size_t i = 0; i < 15; i++) {
+    CHECK(htable_get(ht, model_key(i), &v));
+    CHECK(v == values[i]);
+  }
+
+  htable_destroy(ht);
+  CHECK(model_live_keys() == 0);
+  CHECK(model_live_values() == 0);
+}
+
+static void test_enum(void) {
+  void* values[FILL];
+  htable_t* ht = fill_table(values, FILL);
+
+  for (size_t i = 0; i < FILL; i += 2) {
+    CHECK(htable_remove(ht, model_key(i), nullptr));
+  }
+  htable_compact(ht);
+
+  bool seen[FILL] = {};
+  _cleanup_(htable_enum_destroyp) htable_enum_t* he = htable_enum_create(ht);
+  CHECK(he != nullptr);
+  void const* k;
+  void* v;
+  size_t n = 0;
+  while (htable_enum_next(he, &k, &v)) {
+    size_t i = strtoul((char const*)k + 3, nullptr, 10);
+    CHECK(i < FILL && i % 2 == 1);
+    CHECK(!seen[i]);
+    seen[i] = true;
+    CHECK(v == values[i]);
+    n++;
+  }
+  CHECK(n == FILL / 2);
+  // Stays done
+  CHECK(!htable_enum_next(he, &k, &v));
+
+  // Emptied out, the table compacts back down to where it started
+  for (size_t i = 1; i < FILL; i += 2) {
+    CHECK(htable_remove(ht, model_key(i), nullptr));
+  }
+  CHECK(htable_capacity(ht) > 16);
+  htable_compact(ht);
+  CHECK(htable_capacity(ht) == 16);
+
+  htable_destroy(ht);
+}
+
+static uint64_t xorshift(uint64_t* state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+// Random operations against the reference model, with a fixed set of seeds
+// so that failures can be reproduced
+static void test_model(void) {
+  static uint8_t data[3 * 50000];
+
+  for (uint64_t seed = 1; seed <= 8; seed++) {
+    uint64_t state = seed * 0x9e3779b97f4a7c15u;
+    for (size_t i = 0; i < sizeof(data); i++) {
+      data[i] = xorshift(&state);
+    }
+
+    // Mostly inserts at first, so that the table gets to grow before
+    // removes catch up
+    for (size_t i = 0; i < sizeof(data) / 4; i += 3) {
+      if (data[i] % 3 == 0) data[i] &= ~7;
+    }
+
+    model_run(data, sizeof(data));
+  }
+}
+
+int main(void) {
+  test_remove();
+  test_insert_nomem();
+  test_enum();
+  test_model();
+  return 0;
+}
@@ -0,0 +1,388 @@
+#include <stdint.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <systemd/sd-event.h>
+
+#include "check.h"
+#include "inhibitman.h"
+#include "lockbackend.h"
+
+// Drives inhibitman through the null backend's event loop replies, the same
+// way the bridge does, minus D-Bus. The null backend is wrapped to count
+// what's asked of it.
+
+typedef struct counting_backend {
+  lock_backend_t base;
+  lock_backend_t* inner;
+  // Locks asked for, and how many acquire_batch calls they came in
+  size_t acquired;
+  size_t batches;
+  size_t cancelled;
+  size_t released;
+} counting_backend_t;
+
+static int counting_acquire(
+  lock_backend_t* b,
+  char const* what,
+  char const* mode,
+  char const* who,
+  char const* why
+) {
+  auto cnt = (counting_backend_t*)b;
+  cnt->acquired++;
+  return lock_backend_acquire(cnt->inner, what, mode, who, why);
+}
+
+static int counting_acquire_async(
+  lock_backend_t* b,
+  char const* what,
+  char const* mode,
+  char const* who,
+  char const* why,
+  lock_backend_cb_t cb,
+  void* userdata,
+  lock_backend_call_t** ret
+) {
+  auto cnt = (counting_backend_t*)b;
+  cnt->acquired++;
+  return lock_backend_acquire_async(
+    cnt->inner,
+    what,
+    mode,
+    who,
+    why,
+    cb,
+    userdata,
+    ret
+  );
+}
+
+static void counting_acquire_batch(
+  lock_backend_t* b,
+  lock_backend_request_t* reqs,
+  size_t length,
+  lock_backend_cb_t cb
+) {
+  auto cnt = (counting_backend_t*)b;
+  cnt->acquired += length;
+  cnt->batches++;
+  lock_backend_acquire_batch(cnt->inner, reqs, length, cb);
+}
+
+static void counting_cancel(lock_backend_t* b, lock_backend_call_t* call) {
+  auto cnt = (counting_backend_t*)b;
+  cnt->cancelled++;
+  lock_backend_cancel(cnt->inner, call);
+}
+
+static void counting_release(lock_backend_t* b, int handle) {
+  auto cnt = (counting_backend_t*)b;
+  cnt->released++;
+  lock_backend_release(cnt->inner, handle);
+}
+
+static bool counting_healthy(lock_backend_t* b) {
+  auto cnt = (counting_backend_t*)b;
+  return lock_backend_healthy(cnt->inner);
+}
+
+static void counting_destroy(lock_backend_t* b) {
+  auto cnt = (counting_backend_t*)b;
+  lock_backend_destroy(cnt->inner);
+}
+
+static lock_backend_ops_t const counting_ops = {
+  .name = "counting",
+  .acquire = counting_acquire,
+  .acquire_async = counting_acquire_async,
+  .acquire_batch = counting_acquire_batch,
+  .cancel = counting_cancel,
+  .release = counting_release,
+  .healthy = counting_healthy,
+  .destroy = counting_destroy,
+};
+
+typedef struct harness {
+  sd_event* event;
+  counting_backend_t backend;
+  inhibitman_t* im;
+  // Batch callbacks run so far
+  unsigned finished;
+  // Makes the next batch callback destroy the inhibitman
+  bool destroy;
+} harness_t;
+
+static void harness_init(
+  harness_t* h,
+  uint64_t latency_usec,
+  unsigned failure_percent
+) {
+  *h = (harness_t){};
+  CHECK(sd_event_new(&h->event) >= 0);
+
+  h->backend.base.ops = &counting_ops;
+  h->backend.inner = lock_backend_null_create(
+    h->event,
+    latency_usec,
+    failure_percent
+  );
+  CHECK(h->backend.inner != nullptr);
+
+  h->im = inhibitman_create(&h->backend.base);
+  CHECK(h->im != nullptr);
+}
+
+static void harness_fini(harness_t* h) {
+  inhibitman_destroyp(&h->im);
+  // The backend is embedded, and only its inner one needs freeing
+  lock_backend_destroy(&h->backend.base);
+  // Nothing may be left for the loop to run
+  CHECK(sd_event_run(h->event, 0) == 0);
+  sd_event_unrefp(&h->event);
+}
+
+static void harness_run(harness_t* h, unsigned finished) {
+  while (h->finished < finished) {
+    CHECK(sd_event_run(h->event, UINT64_MAX) > 0);
+  }
+}
+
+static void harness_on_batch(
+  inhibitman_t* im,
+  inhibitman_request_t* reqs,
+  size_t length,
+  void* userdata
+) {
+  (void)reqs;
+  (void)length;
+
+  auto h = (harness_t*)userdata;
+  CHECK(im == h->im);
+  h->finished++;
+
+  if (h->destroy) {
+    h->destroy = false;
+    inhibitman_destroyp(&h->im);
+  }
+}
+
+#define REQUEST(w) \
+  { \
+    .what = (w), \
+    .mode = "block", \
+    .who = "test", \
+    .why = "testing", \
+    .app_name = "test", \
+    .reason = "testing", \
+  }
+
+static void test_batch(void) {
+  harness_t h;
+  harness_init(&h, 1000, 0);
+
+  inhibitman_request_t reqs[] = {
+    REQUEST("idle"),
+    REQUEST("sleep"),
+    REQUEST("idle"),
+    REQUEST("idle:sleep"),
+    REQUEST("sleep"),
+  };
+  size_t length = sizeof(reqs) / sizeof(*reqs);
+  CHECK(inhibitman_add_batch(h.im, reqs, length, harness_on_batch, &h) == 0);
+
+  // One lock per distinct what, all asked for at once
+  CHECK(h.backend.batches == 1);
+  CHECK(h.backend.acquired == 3);
+  CHECK(h.finished == 0);
+  CHECK(inhibitman_count(h.im) == 0);
+
+  harness_run(&h, 1);
+  CHECK(inhibitman_count(h.im) == length);
+  for (size_t i = 0; i < length; i++) {
+    CHECK(reqs[i].error == 0);
+    CHECK(reqs[i].id != 0);
+    for (size_t j = 0; j < i; j++) {
+      CHECK(reqs[i].id != reqs[j].id);
+    }
+  }
+
+  // Locks go with their last inhibitor
+  CHECK(inhibitman_remove(h.im, reqs[0].id, 0));
+  CHECK(h.backend.released == 0);
+  CHECK(inhibitman_remove(h.im, reqs[3].id, 0));
+  CHECK(h.backend.released == 1);
+  CHECK(!inhibitman_remove(h.im, reqs[3].id, 0));
+
+  // Later requests share the locks that are already held
+  inhibitman_request_t more[] = { REQUEST("idle"), REQUEST("sleep") };
+  CHECK(inhibitman_add_batch(h.im, more, 2, harness_on_batch, &h) == 0);
+  CHECK(h.finished == 2);
+  CHECK(h.backend.acquired == 3);
+  CHECK(more[0].error == 0 && more[1].error == 0);
+
+  harness_fini(&h);
+  CHECK(h.backend.released == 3);
+}
+
+// A batch sharing a lock another batch is still acquiring waits for that
+// reply too, and the lock is only asked for once
+static void test_joiners(void) {
+  harness_t h;
+  harness_init(&h, 1000, 0);
+
+  inhibitman_request_t a[] = { REQUEST("idle") };
+  inhibitman_request_t b[] = { REQUEST("idle"), REQUEST("sleep") };
+  CHECK(inhibitman_add_batch(h.im, a, 1, harness_on_batch, &h) == 0);
+  CHECK(inhibitman_add_batch(h.im, b, 2, harness_on_batch, &h) == 0);
+  CHECK(h.backend.acquired == 2);
+
+  // Synchronous adds don't wait for anyone's lock
+  inhibitman_request_t sync = REQUEST("idle");
+  CHECK(inhibitman_add(h.im, &sync) == 0);
+  CHECK(h.backend.acquired == 3);
+  CHECK(inhibitman_count(h.im) == 1);
+
+  harness_run(&h, 2);
+  CHECK(a[0].error == 0);
+  CHECK(b[0].error == 0 && b[1].error == 0);
+  CHECK(inhibitman_count(h.im) == 4);
+
+  harness_fini(&h);
+  CHECK(h.backend.released == 3);
+}
+
+static void test_failures(void) {
+  harness_t h;
+  harness_init(&h, 0, 100);
+
+  inhibitman_request_t a[] = { REQUEST("idle"), REQUEST("idle") };
+  inhibitman_request_t b[] = { REQUEST("idle") };
+  CHECK(inhibitman_add_batch(h.im, a, 2, harness_on_batch, &h) == 0);
+  CHECK(inhibitman_add_batch(h.im, b, 1, harness_on_batch, &h) == 0);
+  harness_run(&h, 2);
+
+  // Everyone sharing in a failure gets it
+  CHECK(a[0].error == -EIO && a[1].error == -EIO);
+  CHECK(b[0].error == -EIO);
+  CHECK(inhibitman_count(h.im) == 0);
+  CHECK(h.backend.acquired == 1);
+
+  harness_fini(&h);
+  CHECK(h.backend.released == 0);
+}
+
+// Destroying the inhibitman cancels what's in flight, without callbacks
+static void test_destroy_pending(void) {
+  harness_t h;
+  harness_init(&h, 1000, 0);
+
+  inhibitman_request_t a[] = { REQUEST("idle"), REQUEST("sleep") };
+  inhibitman_request_t b[] = { REQUEST("sleep") };
+  CHECK(inhibitman_add_batch(h.im, a, 2, harness_on_batch, &h) == 0);
+  CHECK(inhibitman_add_batch(h.im, b, 1, harness_on_batch, &h) == 0);
+  inhibitman_destroyp(&h.im);
+  CHECK(h.backend.cancelled == 2);
+
+  harness_fini(&h);
+  CHECK(h.finished == 0);
+}
+
+// The first batch's callback destroys the inhibitman, and the batch that
+// was waiting on the same reply along with it
+static void test_destroy_from_callback(void) {
+  harness_t h;
+  harness_init(&h, 0, 0);
+
+  inhibitman_request_t a[] = { REQUEST("idle") };
+  inhibitman_request_t b[] = { REQUEST("idle") };
+  CHECK(inhibitman_add_batch(h.im, a, 1, harness_on_batch, &h) == 0);
+  CHECK(inhibitman_add_batch(h.im, b, 1, harness_on_batch, &h) == 0);
+  h.destroy = true;
+  harness_run(&h, 1);
+  CHECK(h.im == nullptr);
+
+  harness_fini(&h);
+  CHECK(h.finished == 1);
+  CHECK(h.backend.released == 1);
+}
+
+// Removing the inhibitor a shared lock was taken for swaps in a new lock
+// for one that's left, and only then lets go of the old one
+static void test_handover(void) {
+  harness_t h;
+  harness_init(&h, 1000, 0);
+
+  inhibitman_request_t first = REQUEST("idle");
+  inhibitman_request_t second = REQUEST("idle");
+  second.who = "other";
+  CHECK(inhibitman_add(h.im, &first) == 0);
+  CHECK(inhibitman_add(h.im, &second) == 0);
+  CHECK(h.backend.acquired == 1);
+
+  CHECK(inhibitman_remove(h.im, first.id, 0));
+  CHECK(h.backend.acquired == 2);
+  CHECK(h.backend.released == 0);
+  while (h.backend.released == 0) {
+    CHECK(sd_event_run(h.event, UINT64_MAX) > 0);
+  }
+
+  CHECK(inhibitman_count(h.im) == 1);
+  CHECK(h.backend.acquired == 2);
+
+  // Nothing to hand over between look-alikes
+  inhibitman_request_t third = REQUEST("idle");
+  third.who = "other";
+  CHECK(inhibitman_add(h.im, &third) == 0);
+  CHECK(inhibitman_remove(h.im, second.id, 0));
+  CHECK(h.backend.acquired == 2);
+
+  harness_fini(&h);
+  CHECK(h.backend.released == 2);
+}
+
+// Inhibitors released in the order they were taken hand their lock over
+// once, to the most recent one, rather than on every release
+static void test_handover_in_order(void) {
+  harness_t h;
+  harness_init(&h, 0, 0);
+
+  enum { COUNT = 1000 };
+  static uint32_t ids[COUNT];
+  for (size_t i = 0; i < COUNT; i++) {
+    char who[32];
+    snprintf(who, sizeof(who), "test%zu", i);
+    inhibitman_request_t req = REQUEST("idle");
+    req.who = who;
+    CHECK(inhibitman_add(h.im, &req) == 0);
+    ids[i] = req.id;
+  }
+  CHECK(h.backend.acquired == 1);
+
+  for (size_t i = 0; i < COUNT - 1; i++) {
+    CHECK(inhibitman_remove(h.im, ids[i], 0));
+  }
+  CHECK(h.backend.acquired == 2);
+  CHECK(inhibitman_count(h.im) == 1);
+  while (h.backend.released == 0) {
+    CHECK(sd_event_run(h.event, UINT64_MAX) > 0);
+  }
+
+  inhibitman_entry_t entry;
+  CHECK(inhibitman_lookup(h.im, ids[COUNT - 1], &entry));
+  CHECK(strcmp(entry.who, "test999") == 0);
+
+  harness_fini(&h);
+  CHECK(h.backend.released == 2);
+}
+
+int main(void) {
+  test_batch();
+  test_joiners();
+  test_failures();
+  test_destroy_pending();
+  test_destroy_from_callback();
+  test_handover();
+  test_handover_in_order();
+  return 0;
+}